@@ -0,0 +1,245 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <set>
+#include <stdexcept>
+
+#include "instruction.hpp"
+#include "binary.hpp"
+#include "decoder.hpp"
+#include "cmdline.hpp"
+
+namespace {
+    /**
+     * find basic block leaders from absolute jump targets
+     * @param operations decoded operations (without trailing exit operation)
+     * @return sorted leader addresses
+     */
+    std::set<std::uint64_t> find_leaders(const std::vector<n64::decoder::operation>& operations) {
+        using n64::decoder::opcode;
+
+        std::set<std::uint64_t> leaders;
+        if(!operations.empty()) {
+            leaders.emplace(0);
+        }
+        for(std::uint64_t ip=0; ip<operations.size(); ++ip) {
+            const auto& op=operations[ip];
+            if(!n64::decoder::is_terminator(op.code))continue;
+
+            switch(op.code) {
+                case opcode::call:
+                case opcode::jmp:
+                case opcode::je:
+                case opcode::jne:
+                case opcode::ja:
+                case opcode::jae:
+                case opcode::jb:
+                case opcode::jbe:
+                    if(op.immediate<operations.size()) {
+                        leaders.emplace(op.immediate);
+                    }
+                    break;
+                default:
+                    break;
+            }
+            // fall-through and return address
+            if(ip+1<operations.size()) {
+                leaders.emplace(ip+1);
+            }
+        }
+        return leaders;
+    }
+
+    /**
+     * generate C++ source code
+     * every instruction runs n64::machine::execute with a constant instruction,
+     * so the host compiler folds the reference semantics into straight-line code.
+     * @param p program
+     * @param rodata read-only data of program
+     * @param input input file name
+     * @param with_main emit main function
+     * @return C++ source code
+     */
+    std::string generate(const n64::program& p, const std::vector<std::uint8_t>& rodata, const std::string& input, bool with_main) {
+        using n64::decoder::opcode;
+
+        const auto& instructions=p.code;
+        auto operations=n64::decoder::predecode(instructions);
+        operations.pop_back();
+        const auto leaders=find_leaders(operations);
+        const auto size=operations.size();
+
+        std::stringstream ss;
+        ss
+                <<"// generated by n64aot from "<<input<<". do not edit.\n"
+                <<"// compile: c++ -std=c++17 -O2 -I<n64 source directory> <this file>\n\n"
+                <<"#include <cstdlib>\n"
+                <<"#include <cstring>\n\n"
+                <<"#include \"machine.hpp\"\n\n"
+                <<"namespace {\n"
+                <<"    // program image (used when an indirect jump enters a block in the middle)\n"
+                <<"    constexpr std::uint64_t PROGRAM[]={\n";
+        for(std::size_t i=0; i<size; ++i) {
+            ss<<"            0x"<<std::hex<<instructions[i].data<<std::dec<<"ULL,\n";
+        }
+        ss
+                <<"            0\n"
+                <<"    };\n"
+                <<"    constexpr std::uint64_t SIZE="<<size<<";\n\n"
+                <<"    inline n64::instruction::instruction decode(std::uint64_t data) {\n"
+                <<"        n64::instruction::instruction ins={};\n"
+                <<"        ins.data=data;\n"
+                <<"        return ins;\n"
+                <<"    }\n"
+                <<"} /* anonymous */\n\n"
+                <<"/**\n"
+                <<" * run program from current IP until halted or IP leaves the program\n"
+                <<" * @param m machine\n"
+                <<" */\n"
+                <<"void n64_aot_run(n64::machine& m) {\n"
+                <<"    std::uint64_t *const r=m.registers();\n"
+                <<"    constexpr auto IP=n64::machine::IP;\n\n"
+                <<"    if(m.halted())return;\n\n"
+                <<"dispatch:\n"
+                <<"    switch(r[IP]) {\n";
+        for(auto leader : leaders) {
+            ss<<"        case "<<leader<<": goto block_"<<leader<<";\n";
+        }
+        ss
+                <<"        default:\n"
+                <<"            if(r[IP]>=SIZE)return;\n"
+                <<"            m.execute(decode(PROGRAM[r[IP]++]));\n"
+                <<"            goto dispatch;\n"
+                <<"    }\n";
+
+        for(std::uint64_t ip=0; ip<size; ++ip) {
+            const auto& op=operations[ip];
+            if(leaders.count(ip)>0) {
+                ss<<"\nblock_"<<ip<<":\n";
+            }
+            ss
+                    <<"    r[IP]="<<(ip+1)<<"; m.execute(decode(0x"<<std::hex<<instructions[ip].data<<std::dec<<"ULL));"
+                    <<" // "<<n64::decoder::name(op.code)<<"\n";
+
+            // direct jump to target block, or leave when target is outside program
+            const auto jump=[&ss, &size](std::uint64_t target) {
+                if(target<size) {
+                    ss<<"goto block_"<<target<<";";
+                }else{
+                    ss<<"return;";
+                }
+            };
+            switch(op.code) {
+                case opcode::call:
+                case opcode::jmp:
+                    ss<<"    ";
+                    jump(op.immediate);
+                    ss<<"\n";
+                    break;
+                case opcode::je:
+                case opcode::jne:
+                case opcode::ja:
+                case opcode::jae:
+                case opcode::jb:
+                case opcode::jbe:
+                    ss<<"    if(r[IP]!="<<(ip+1)<<") ";
+                    jump(op.immediate);
+                    ss<<"\n";
+                    break;
+                case opcode::hlt:
+                    ss<<"    return;\n";
+                    break;
+                case opcode::call_register:
+                case opcode::jmp_register:
+                case opcode::ret:
+                case opcode::generic:
+                    ss<<"    goto dispatch;\n";
+                    break;
+                default:
+                    break;
+            }
+        }
+        ss<<"}\n";
+
+        if(with_main) {
+            ss
+                    <<"\n"
+                    <<"int main() {\n"
+                    <<"    n64::machine m;\n";
+            if(!rodata.empty()) {
+                ss<<"    static const unsigned char RODATA[]={";
+                for(std::size_t i=0; i<rodata.size(); ++i) {
+                    ss<<(i%16==0 ? "\n            " : " ")<<static_cast<unsigned>(rodata[i])<<",";
+                }
+                ss
+                        <<"\n    };\n"
+                        <<"    if(m.memory().size()<"<<(p.rodata_address+rodata.size())<<"ULL)return EXIT_FAILURE;\n"
+                        <<"    std::memcpy(m.memory().data()+"<<p.rodata_address<<"ULL, RODATA, sizeof(RODATA));\n";
+            }
+            ss
+                    <<"    m.registers()[n64::machine::IP]="<<p.entry<<";\n"
+                    <<"    n64_aot_run(m);\n"
+                    <<"    std::cout<<m.dump()<<std::endl;\n"
+                    <<"    return EXIT_SUCCESS;\n"
+                    <<"}\n";
+        }
+        return ss.str();
+    }
+} /* anonymous */
+
+int main(int argc, char **argv) {
+    std::cout<<"N64 AOT Compiler"<<std::endl;
+
+    cmdline::parser parser;
+    parser.add<std::string>("output", 'o', "output file", false, "a.cpp");
+    parser.add("library", 'l', "do not emit main function");
+
+    parser.parse_check(argc, argv);
+    auto output=parser.get<std::string>("output");
+    auto input=parser.rest()[0];
+
+    n64::program program;
+    std::vector<std::uint8_t> rodata;
+    try {
+        program=n64::load_program(input);
+    }catch(const std::exception& e) {
+        std::cerr<<"error: "<<e.what()<<std::endl;
+        return EXIT_FAILURE;
+    }
+    if(program.rodata_size>0) {
+        std::ifstream fin(input, std::ios::in | std::ios::binary);
+        rodata.resize(program.rodata_size);
+        fin.seekg(static_cast<std::streamoff>(program.rodata_offset));
+        fin.read(reinterpret_cast<char*>(rodata.data()), static_cast<std::streamsize>(rodata.size()));
+        if(!fin) {
+            std::cerr<<"error: cannot read read-only data of "<<input<<std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::ofstream fout(output);
+    fout<<generate(program, rodata, input, !parser.exist("library"));
+    fout.close();
+    if(!fout) {
+        std::cerr<<"error: cannot write "<<output<<std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,763 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <fstream>
+#include <algorithm>
+#include <unordered_map>
+#include <tuple>
+#include <exception>
+#include <thread>
+
+#include <boost/optional.hpp>
+#include <boost/preprocessor.hpp>
+
+#include "instruction.hpp"
+#include "assembler.hpp"
+#include "assembly_cache.hpp"
+
+namespace {
+    using instruction_info_t=std::tuple<std::uint8_t, unsigned>;
+    using instruction_map_t=std::unordered_map<std::string_view, instruction_info_t>;
+    using register_map_t=std::unordered_map<std::string_view, std::uint8_t>;
+    using system_info_t=std::tuple<instruction_map_t, register_map_t>;
+    using label_map_t=std::unordered_map<std::string_view, std::uint64_t>;
+    constexpr int INSTRUCTION_TYPE_NUMBER=1, INSTRUCTION_NUMBER=0, INSTRUCTION_TYPE=1, INSTRUCTION_MAP=0, REGISTER_MAP=1;
+    constexpr std::size_t MIN_CHUNK=1<<14;     // fewest statements encoded by one thread
+    constexpr std::size_t MAX_REGION=1024;     // most statements of region
+    constexpr std::uint64_t LABEL_CUT=4;        // 1 in N labels starts cache region
+
+    /**
+     * run of statements encoded (or reused from cache) together
+     */
+    struct region_t {
+        std::size_t first, last;    // statement indices [first, last)
+        std::uint64_t address;      // address of first instruction
+        std::uint64_t size;         // instruction count
+    };
+
+    /**
+     * error in source, thrown by statement and caught by statement loop
+     */
+    struct assemble_error {
+        n64::diagnostic diagnostic;
+    };
+
+    /**
+     * instruction map (mnemonic -> opcode, type) and register map (name -> register number).
+     * built on first use and shared by every assembler.
+     * @return system information
+     */
+    const system_info_t& system_info() {
+        static const system_info_t info(instruction_map_t{
+#define INSTRUCTION(name, type, number) {name, std::tuple<std::uint8_t, unsigned>(number, n64::instruction::type)},
+                N64_INSTRUCTIONS(INSTRUCTION)
+#undef INSTRUCTION
+        }, register_map_t{
+                {"r0", n64::reg::id::R0},
+#define RS_REGISTER(z, n, d) {"rs" #n, n64::reg::id::RS[n]},
+                BOOST_PP_REPEAT(32, RS_REGISTER, 0)
+#undef RS_REGISTER
+#define RT_REGISTER(z, n, d) {"rt" #n, n64::reg::id::RT[n]},
+                BOOST_PP_REPEAT(32, RT_REGISTER, 0)
+#undef RT_REGISTER
+                {"ip", n64::reg::id::IP},
+                {"flags", n64::reg::id::FLAGS},
+                {"sp", n64::reg::id::SP},
+                {"bp", n64::reg::id::BP}
+        });
+        return info;
+    }
+
+    /**
+     * check whitespace
+     * @param c character
+     * @return is whitespace
+     */
+    constexpr bool is_space(char c)noexcept {
+        return c==' ' || c=='\t' || c=='\n' || c=='\r' || c=='\v' || c=='\f';
+    }
+
+    /**
+     * remove whitespace at both ends
+     * @param text text
+     * @return trimmed text
+     */
+    std::string_view trim(std::string_view text)noexcept {
+        while(!text.empty() && is_space(text.front()))text.remove_prefix(1);
+        while(!text.empty() && is_space(text.back()))text.remove_suffix(1);
+        return text;
+    }
+
+    /**
+     * reads source character by character with whitespace around ',' and ':' removed.
+     * removed whitespace may contain line breaks, so "label:" and operands after ',' continue on next line.
+     */
+    class folder {
+    private:
+        std::string_view _text;
+        std::size_t _at;
+        std::size_t _run_end;   // end of whitespace run which is kept
+        char _last;             // last character read
+
+    public:
+        folder()=delete;
+        /**
+         * @param text source
+         * @param at offset of first character to read
+         */
+        folder(std::string_view text, std::size_t at) : _text(text), _at(at), _run_end(0), _last('\n') {}
+
+    public:
+        /**
+         * read next character
+         * @param c character
+         * @param offset source offset of character
+         * @return character was read (false: end of source)
+         */
+        bool next(char& c, std::size_t& offset)noexcept {
+            if(_at>=_run_end && _at<_text.size() && is_space(_text[_at])) {
+                auto end=_at;
+                while(end<_text.size() && is_space(_text[end])) {
+                    ++end;
+                }
+                if((end<_text.size() && (_text[end]==',' || _text[end]==':')) || _last==',' || _last==':') {
+                    _at=end;
+                }else{
+                    _run_end=end;
+                }
+            }
+            if(_at>=_text.size())return false;
+            c=_last=_text[_at];
+            offset=_at++;
+            return true;
+        }
+    };
+
+    /**
+     * non-empty statement of source (label, instruction or both)
+     */
+    struct line_t {
+        std::string_view text;      // folded and trimmed text
+        std::size_t offset;         // source offset of first character
+        std::size_t first_line;     // source line of first character (1 origin)
+        std::size_t line_number;    // source line of instruction part (1 origin)
+    };
+
+    /**
+     * source split into statements.
+     * statements are separated by line breaks and ';', empty ones are dropped.
+     * remove: default constructor, copy & move constructors and copy & move assign operators.
+     */
+    class source_t {
+    private:
+        std::string _name;
+        std::string _text;          // lower case source
+        std::string _folded;        // text of every statement (never reallocated, statements refer to it)
+        std::vector<line_t> _lines;
+
+    public:
+        source_t()=delete;
+        /**
+         * @param name source name
+         * @param text source
+         */
+        source_t(std::string name, std::string text) : _name(std::move(name)), _text(std::move(text)) {
+            for(auto& c : _text) {
+                if(c>='A' && c<='Z')c=static_cast<char>(c-'A'+'a');
+            }
+            _folded.reserve(_text.size());
+
+            folder f(_text, 0);
+            std::size_t begin=0, first=0, body=std::string::npos;
+            std::size_t line_number=1, counted=0;
+            bool colon=false;
+            // finish statement read since begin
+            const auto finish=[&]() {
+                const auto text=trim(std::string_view(_folded).substr(begin));
+                if(!text.empty()) {
+                    if(body==std::string::npos)body=first;
+                    for(; counted<first; ++counted) {
+                        if(_text[counted]=='\n')++line_number;
+                    }
+                    const auto first_line=line_number;
+                    for(; counted<body; ++counted) {
+                        if(_text[counted]=='\n')++line_number;
+                    }
+                    _lines.push_back({std::string_view(_folded.data()+begin, text.size()), first, first_line, line_number});
+                }
+                _folded.resize(begin+text.size());
+                begin=_folded.size();
+                body=std::string::npos;
+                colon=false;
+            };
+
+            char c;
+            std::size_t offset;
+            while(f.next(c, offset)) {
+                if(c=='\n' || c==';') {
+                    finish();
+                    continue;
+                }
+                if(_folded.size()==begin) {
+                    if(is_space(c))continue;
+                    first=offset;
+                }
+                if(colon && body==std::string::npos) {
+                    body=offset;
+                }
+                if(c==':')colon=true;
+                _folded+=c;
+            }
+            finish();
+        }
+        source_t(const source_t&)=delete;
+        source_t(source_t&&)=delete;
+
+        source_t& operator=(const source_t&)=delete;
+        source_t& operator=(source_t&&)=delete;
+
+    public:
+        /**
+         * statements
+         * @return statements
+         */
+        const std::vector<line_t>& lines()const noexcept {
+            return _lines;
+        }
+
+        /**
+         * source name
+         * @return name
+         */
+        const std::string& name()const noexcept {
+            return _name;
+        }
+
+        /**
+         * report error at text of statement
+         * @param index statement index
+         * @param at part of statement text (other text: start of statement)
+         * @param message error message
+         * @throw assemble_error always
+         */
+        [[noreturn]] void error(std::size_t index, std::string_view at, const std::string& message)const {
+            const auto& line=_lines[index];
+            auto offset=line.offset;
+            if(at.data()>=line.text.data() && at.data()<=line.text.data()+line.text.size()) {
+                // statement text is read again to map folded position to source
+                folder f(_text, line.offset);
+                char c;
+                for(auto rest=static_cast<std::size_t>(at.data()-line.text.data())+1; rest>0 && f.next(c, offset); --rest) {}
+            }
+            const auto line_begin=offset==0 ? std::string::npos : _text.rfind('\n', offset-1);
+            const auto column=line_begin==std::string::npos ? offset+1 : offset-line_begin;
+            const auto line_number=line.first_line+static_cast<std::size_t>(
+                    std::count(std::begin(_text)+static_cast<std::ptrdiff_t>(line.offset), std::begin(_text)+static_cast<std::ptrdiff_t>(offset), '\n'));
+            throw assemble_error({_name, line_number, column, message});
+        }
+    };
+
+    /**
+     * labels defined by statement ("a:b:instruction" defines a and b)
+     * @param line statement
+     * @return labels
+     */
+    std::vector<std::string_view> labels_of(const line_t& line) {
+        std::vector<std::string_view> labels;
+        auto text=line.text;
+        for(auto colon=text.find(':'); colon!=std::string_view::npos; colon=text.find(':')) {
+            labels.emplace_back(text.substr(0, colon));
+            text.remove_prefix(colon+1);
+        }
+        return labels;
+    }
+
+    /**
+     * instruction part of statement (after last label)
+     * @param line statement
+     * @return instruction text (empty: label only)
+     */
+    std::string_view body_of(const line_t& line) {
+        auto body=line.text;
+        const auto colon=body.rfind(':');
+        if(colon!=std::string_view::npos) {
+            body=body.substr(colon+1);
+        }
+        return trim(body);
+    }
+
+    /**
+     * check operand is immediate (0x hexadecimal, 0 octal or decimal)
+     * @param text operand
+     * @return is immediate
+     */
+    bool is_immediate(std::string_view text)noexcept {
+        const auto all=[&text](std::size_t from, bool(*digit)(char)) {
+            return text.size()>from && std::all_of(std::begin(text)+from, std::end(text), digit);
+        };
+        if(text.size()>=2 && text[0]=='0' && text[1]=='x') {
+            return all(2, [](char c) { return (c>='0' && c<='9') || (c>='a' && c<='f'); });
+        }
+        if(text.size()>=2 && text[0]=='0') {
+            return all(1, [](char c) { return c>='0' && c<='7'; });
+        }
+        return text=="0" || (!text.empty() && text[0]!='0' && all(0, [](char c) { return c>='0' && c<='9'; }));
+    }
+
+    /**
+     * decode immediate checked by is_immediate
+     * @param text operand
+     * @param value decoded value
+     * @return value fits in 64 bits
+     */
+    bool decode_immediate(std::string_view text, std::uint64_t& value)noexcept {
+        unsigned base=10;
+        if(text.size()>1 && text[0]=='0') {
+            base=text[1]=='x' ? 16 : 8;
+            text.remove_prefix(base==16 ? 2 : 1);
+        }
+        value=0;
+        for(auto c : text) {
+            const unsigned digit=c>='a' ? static_cast<unsigned>(c-'a'+10) : static_cast<unsigned>(c-'0');
+            if(value>(~std::uint64_t(0)-digit)/base)return false;
+            value=value*base+digit;
+        }
+        return true;
+    }
+
+    /**
+     * split operand list at ','
+     * @param text operand list
+     * @return operands
+     */
+    std::vector<std::string_view> split_operands(std::string_view text) {
+        std::vector<std::string_view> operands;
+        for(;;) {
+            const auto comma=text.find(',');
+            operands.emplace_back(text.substr(0, comma));
+            if(comma==std::string_view::npos)break;
+            text.remove_prefix(comma+1);
+        }
+        return operands;
+    }
+
+    /**
+     * decode operand from operand string
+     * @param reg_map register map (register name -> register number)
+     * @param source source
+     * @param index statement index
+     * @param operand operand string (register or [register+offset])
+     * @return register number, register option, register type
+     */
+    std::tuple<std::uint8_t /* register */, std::uint64_t /* option */, std::uint8_t /* type */>
+            decode_operand(const register_map_t& reg_map, const source_t& source, std::size_t index, std::string_view operand) {
+        std::uint64_t option=0;
+        std::uint8_t type=0;
+
+        auto name=operand;
+        if(!operand.empty() && operand[0]=='[') {
+            // pointer
+            name.remove_prefix(1);
+            if(!name.empty() && name.back()==']')name.remove_suffix(1);
+
+            const auto plus=name.find('+');
+            if(plus!=std::string_view::npos) {
+                const auto offset=name.substr(plus+1);
+                name=name.substr(0, plus);
+                if(offset.empty() || !std::all_of(std::begin(offset), std::end(offset), [](char c) { return c>='0' && c<='9'; })
+                   || !decode_immediate(offset, option)) {
+                    source.error(index, offset, "invalid offset \""+std::string(offset)+"\"");
+                }
+            }
+            type=1U;
+        }
+
+        const auto itr=reg_map.find(name);
+        if(itr==std::end(reg_map)) {
+            source.error(index, name, "unknown operand \""+std::string(name)+"\"");
+        }
+
+        return std::tuple<std::uint8_t, std::uint64_t, std::uint8_t>(itr->second, option, type);
+    }
+
+    /**
+     * assemble one instruction
+     * @param sys_info system information (register map and instruction map)
+     * @param source source
+     * @param labels label map (label -> instruction address)
+     * @param index current statement index
+     * @param relocatable undefined label operands are left to linker (immediate 0)
+     * @param reference label operand of instruction (empty: none)
+     * @return assembled instruction (if boost::none, label only line)
+     */
+    boost::optional<n64::instruction::instruction> assemble_line(const system_info_t& sys_info, const source_t& source,
+                                                                 const label_map_t& labels, std::size_t index,
+                                                                 bool relocatable, std::string_view& reference) {
+        // jump or call operators
+        static const std::string_view JUMP_TYPE_OPERATORS[]={
+                "call", "jmp", "jr", "je", "jne", "ja", "jae", "jb", "jbe"
+        };
+        static const std::vector<std::string_view> ZERO_REGISTERS={"r0", "r0"};
+
+        // instruction info and register info
+        const auto& im=std::get<INSTRUCTION_MAP>(sys_info);
+        const auto& rm=std::get<REGISTER_MAP>(sys_info);
+
+        // // // // // // // // // // // // // // // // // // // // // // // // // // // // //
+        const auto line=body_of(source.lines()[index]);
+        if(line.empty())return boost::none;
+
+        // mnemonic and operand list are separated by ' ', text after operand list is ignored
+        const auto space=line.find(' ');
+        auto mnemonic=line.substr(0, space);
+        const bool has_operands=space!=std::string_view::npos;
+        const auto operand_text=has_operands ? line.substr(space+1, line.find(' ', space+1)-space-1) : std::string_view();
+        std::vector<std::string_view> operand;
+        if(has_operands) {
+            operand=split_operands(operand_text);
+        }
+
+        const auto operand_count_check=[&](std::size_t count) {
+            if(operand.size()!=count) {
+                source.error(index, has_operands ? operand_text : mnemonic,
+                             "operands count mismatch. "+std::to_string(count)+" operands expected, "
+                             +std::to_string(operand.size())+" passed.");
+            }
+        };
+
+        // process pseudo-instructions
+        if(mnemonic=="nop" || mnemonic=="raise") {
+            mnemonic=mnemonic=="nop" ? "xchg" : "cmp";
+            if(!has_operands)operand=ZERO_REGISTERS;
+        }else if(mnemonic=="mov") {
+            operand_count_check(2);
+            mnemonic="add";
+            operand.emplace_back("r0");
+        }else if(mnemonic=="word") {
+            // instruction word as is (words which no instruction encodes, written by n64dis)
+            operand_count_check(1);
+            n64::instruction::instruction ins={};
+            if(!is_immediate(operand[0])) {
+                source.error(index, operand[0], "operand 1 must be immediate");
+            }
+            if(!decode_immediate(operand[0], ins.data)) {
+                source.error(index, operand[0], "immediate \""+std::string(operand[0])+"\" does not fit in 64 bits");
+            }
+            return ins;
+        }
+
+        const auto info=im.find(mnemonic);
+        if(info==std::end(im)) {
+            source.error(index, mnemonic, "unknown instruction \""+std::string(mnemonic)+"\"");
+        }
+
+        // set instruction opcode
+        n64::instruction::instruction ins={};
+        ins.instruction.type=std::get<INSTRUCTION_TYPE_NUMBER>(info->second);
+        ins.instruction.instruction=std::get<INSTRUCTION_NUMBER>(info->second);
+        auto type=std::get<INSTRUCTION_TYPE>(info->second);
+
+        const auto immediate=[&](std::string_view text) {
+            std::uint64_t value=0;
+            if(!decode_immediate(text, value)) {
+                source.error(index, text, "immediate \""+std::string(text)+"\" does not fit in 64 bits");
+            }
+            return value;
+        };
+        const auto get_absolute_label_address=[&](std::string_view label) -> std::uint64_t {
+            const auto itr=labels.find(label);
+            if(itr==std::end(labels)) {
+                if(relocatable)return 0;
+                source.error(index, label, "undefined identifier \""+std::string(label)+"\"");
+            }
+
+            return itr->second;
+        };
+
+        switch(type) {
+            case n64::instruction::THREE_ADDRESS:{
+                operand_count_check(3);
+
+                auto[rd, od, td] = decode_operand(rm, source, index, operand[0]);
+                ins.ta.destination=rd;
+                ins.ta.destination_option=static_cast<unsigned>(od);
+                ins.ta.type |= (td<<2);
+
+                auto[rs1, os1, ts1] = decode_operand(rm, source, index, operand[1]);
+                ins.ta.source1=rs1;
+                ins.ta.source1_option=static_cast<unsigned>(os1);
+                ins.ta.type |= (ts1<<1);
+
+                auto[rs2, os2, ts2] = decode_operand(rm, source, index, operand[2]);
+                ins.ta.source2=rs2;
+                ins.ta.source2_option=static_cast<unsigned>(os2);
+                ins.ta.type |= ts2;
+            }
+                break;
+            case n64::instruction::BINOMIAL:{
+                operand_count_check(2);
+
+                auto[o1, oo1, ot1] =decode_operand(rm, source, index, operand[0]);
+                ins.b.operand1=o1;
+                ins.b.operand1_option=static_cast<unsigned>(oo1);
+                ins.b.type |= (ot1<<1);
+
+                auto[o2, oo2, ot2] =decode_operand(rm, source, index, operand[1]);
+                ins.b.operand2=o2;
+                ins.b.operand2_option=static_cast<unsigned>(oo2);
+                ins.b.type |= ot2;
+            }
+                break;
+            case n64::instruction::UNARY:{
+                operand_count_check(1);
+
+                if(is_immediate(operand[0])) {
+                    ins.u.imm.immediate=immediate(operand[0]);
+                    ins.u.type=0b11;
+                }else{
+                    if(std::find(std::begin(JUMP_TYPE_OPERATORS), std::end(JUMP_TYPE_OPERATORS), mnemonic)!=std::end(JUMP_TYPE_OPERATORS)) {
+                        auto absolute_address=get_absolute_label_address(operand[0]);
+                        reference=operand[0];
+                        ins.u.imm.immediate=absolute_address;
+                        ins.u.type=0b11;
+                    }else{
+                        auto[r, ro, rt]=decode_operand(rm, source, index, operand[0]);
+                        ins.u.reg.operand=r;
+                        ins.u.reg.operand_option=ro;
+                        ins.u.type=rt;
+                    }
+                }
+            }
+                break;
+            case n64::instruction::REGISTER_IMMEDIATE:{
+                operand_count_check(2);
+
+                auto r=std::get<0>(decode_operand(rm, source, index, operand[0]));
+                ins.ri.reg=r;
+
+                if(!is_immediate(operand[1])) {
+                    source.error(index, operand[1], "operand 2 must be immediate");
+                }
+                ins.ri.immediate=immediate(operand[1]);
+            }
+                break;
+        }
+
+        return ins;
+    }
+
+} /* anonymous */
+
+namespace n64 {
+    /**
+     * @param jobs threads encoding instructions (0: number of cores)
+     */
+    assembler::assembler(std::size_t jobs) : _jobs(jobs), _cache(nullptr), _relocatable(false) {
+        if(_jobs==0) {
+            _jobs=std::max(1U, std::thread::hardware_concurrency());
+        }
+    }
+
+    /**
+     * assemble source text.
+     * pass 1 gives every label the address of next instruction, pass 2 encodes instructions,
+     * so forward and backward references resolve with one hash lookup.
+     * every instruction address is known after pass 1, so pass 2 is split into chunks of regions
+     * encoded by separate threads straight into their place in the output.
+     * with cache, regions are cut at labels selected by hash of their statement text,
+     * so an edit changes only the region around it; unchanged regions are copied from cache
+     * with their label operands resolved again.
+     * relocatable output (object) keeps every label operand as relocation, undefined ones are left to linker.
+     * @param text source
+     * @param name source name used by diagnostics and line table
+     * @return assembled program and diagnostics
+     */
+    n64::assembly assembler::assemble(std::string_view text, const std::string& name)const {
+        const auto& sys_info=system_info();
+        const source_t source(name, std::string(text));
+        const auto& lines=source.lines();
+
+        n64::assembly result;
+        auto& p=result.program;
+        p.source=name;
+
+        // pass 1: symbol table, line table and regions
+        label_map_t labels;
+        labels.reserve(lines.size()/4);
+        std::vector<region_t> regions;
+        std::uint64_t address=0;
+        for(std::size_t i=0; i<lines.size(); ++i) {
+            const auto defined=labels_of(lines[i]);
+            // cache regions start at labels chosen by their own text, so an edit cannot move boundaries after next one
+            bool cut=regions.empty() || i-regions.back().first>=MAX_REGION;
+            if(!cut && _cache!=nullptr && !defined.empty()) {
+                n64::assembly_cache::key k;
+                k.add(lines[i].text);
+                cut=k.low%LABEL_CUT==0;
+            }
+            if(cut) {
+                if(!regions.empty())regions.back().last=i;
+                regions.push_back({i, i, address, 0});
+            }
+            for(const auto label : defined) {
+                if(!labels.emplace(label, address).second) {
+                    try {
+                        source.error(i, label, "label \""+std::string(label)+"\" is already defined");
+                    }catch(const assemble_error& e) {
+                        result.diagnostics.push_back(e.diagnostic);
+                    }
+                    continue;
+                }
+                p.symbols.push_back({std::string(label), address});
+            }
+            if(!body_of(lines[i]).empty()) {
+                // new line run unless instruction directly follows line of previous one
+                if(p.lines.empty() || p.lines.back().line+(address-p.lines.back().address)!=lines[i].line_number) {
+                    p.lines.push_back({address, lines[i].line_number});
+                }
+                ++address;
+                ++regions.back().size;
+            }
+        }
+        if(!regions.empty())regions.back().last=lines.size();
+
+        // pass 2: instructions, every chunk keeps its own diagnostics and cache updates
+        struct chunk_t {
+            std::vector<n64::diagnostic> diagnostics;
+            std::vector<n64::assembly_cache::key> hits;
+            std::vector<std::pair<n64::assembly_cache::key, n64::assembly_cache::region>> misses;
+            std::vector<std::uint64_t> failed;     // instruction counts of regions with errors (not cached)
+            std::vector<n64::relocation> relocations;
+        };
+        const auto chunks=std::max<std::size_t>(1, std::min({_jobs, lines.size()/MIN_CHUNK, regions.size()}));
+        std::vector<chunk_t> chunk(chunks);
+        p.code.resize(address);
+
+        // copy cached region, false if a label operand is no longer defined
+        const auto reuse=[&](const region_t& r, const n64::assembly_cache::region& cached, chunk_t& out) {
+            if(cached.code.size()!=r.size)return false;
+            for(std::size_t i=0; i<cached.code.size(); ++i) {
+                n64::instruction::instruction ins={};
+                ins.data=cached.code[i];
+                p.code[r.address+i]=ins;
+            }
+            const auto relocations=out.relocations.size();
+            for(const auto& ref : cached.references) {
+                const auto itr=labels.find(ref.label);
+                if(itr==std::end(labels) && !_relocatable) {
+                    out.relocations.resize(relocations);
+                    return false;
+                }
+                p.code[r.address+ref.index].u.imm.immediate=itr==std::end(labels) ? 0 : itr->second;
+                if(_relocatable) {
+                    out.relocations.push_back({r.address+ref.index, ref.label});
+                }
+            }
+            return true;
+        };
+        const auto encode=[&](std::size_t c) {
+            auto& out=chunk[c];
+            for(auto k=c*regions.size()/chunks; k<(c+1)*regions.size()/chunks; ++k) {
+                const auto& r=regions[k];
+                n64::assembly_cache::key key;
+                if(_cache!=nullptr) {
+                    for(auto i=r.first; i<r.last; ++i) {
+                        key.add(lines[i].text);
+                    }
+                    const auto *cached=_cache->find(key);
+                    if(cached!=nullptr && reuse(r, *cached, out)) {
+                        out.hits.push_back(key);
+                        continue;
+                    }
+                }
+
+                n64::assembly_cache::region encoded;
+                const auto errors=out.diagnostics.size();
+                auto at=r.address;
+                for(auto i=r.first; i<r.last; ++i) {
+                    if(body_of(lines[i]).empty())continue;
+                    std::string_view reference;
+                    try {
+                        p.code[at]=assemble_line(sys_info, source, labels, i, _relocatable, reference).get();
+                    }catch(const assemble_error& e) {
+                        out.diagnostics.push_back(e.diagnostic);
+                    }
+                    if(_relocatable && !reference.empty()) {
+                        out.relocations.push_back({at, std::string(reference)});
+                    }
+                    if(_cache!=nullptr) {
+                        if(!reference.empty()) {
+                            encoded.references.push_back({static_cast<std::uint32_t>(at-r.address), std::string(reference)});
+                        }
+                        encoded.code.push_back(p.code[at].data);
+                    }
+                    ++at;
+                }
+                if(_cache!=nullptr) {
+                    if(out.diagnostics.size()==errors) {
+                        out.misses.emplace_back(key, std::move(encoded));
+                    }else{
+                        out.failed.push_back(r.size);
+                    }
+                }
+            }
+        };
+        std::vector<std::thread> threads;
+        for(std::size_t c=1; c<chunks; ++c) {
+            threads.emplace_back(encode, c);
+        }
+        encode(0);
+        for(auto& t : threads) {
+            t.join();
+        }
+
+        // diagnostics of pass 1 and pass 2 are merged in source order
+        for(auto& c : chunk) {
+            result.diagnostics.insert(std::end(result.diagnostics), std::begin(c.diagnostics), std::end(c.diagnostics));
+            p.relocations.insert(std::end(p.relocations), std::make_move_iterator(std::begin(c.relocations)),
+                                 std::make_move_iterator(std::end(c.relocations)));
+            if(_cache==nullptr)continue;
+            for(const auto& k : c.hits) {
+                _cache->hit(k);
+            }
+            for(auto& [k, r] : c.misses) {
+                _cache->miss(k, std::move(r));
+            }
+            for(auto size : c.failed) {
+                _cache->miss(size);
+            }
+        }
+        std::stable_sort(std::begin(result.diagnostics), std::end(result.diagnostics), [](const n64::diagnostic& a, const n64::diagnostic& b) {
+            return std::tie(a.line, a.column)<std::tie(b.line, b.column);
+        });
+        return result;
+    }
+
+    /**
+     * assemble source file
+     * @param file source file name
+     * @return assembled program and diagnostics
+     */
+    n64::assembly assembler::assemble_file(const std::string& file)const {
+        std::ifstream fin(file);
+        if(fin.fail()) {
+            n64::assembly result;
+            result.diagnostics.push_back({file, 0, 0, "cannot open source file"});
+            return result;
+        }
+
+        return assemble(std::string(std::istreambuf_iterator<char>(fin), std::istreambuf_iterator<char>()), file);
+    }
+} /* n64 */
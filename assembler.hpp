@@ -0,0 +1,124 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef N64_EMU_ASSEMBLER_HPP
+#define N64_EMU_ASSEMBLER_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <string>
+#include <string_view>
+
+#include "binary.hpp"
+
+namespace n64 {
+    class assembly_cache;
+
+    /**
+     * error found in source
+     */
+    struct diagnostic {
+        std::string source;         // source name
+        std::uint64_t line;         // 1 origin (0: not in source, e.g. file cannot be read)
+        std::uint64_t column;       // 1 origin
+        std::string message;
+
+        /**
+         * text of diagnostic ("source:line:column: message")
+         * @return text
+         */
+        std::string str()const {
+            if(line==0)return source+": "+message;
+            return source+":"+std::to_string(line)+":"+std::to_string(column)+": "+message;
+        }
+    };
+
+    /**
+     * result of assembly
+     */
+    struct assembly {
+        n64::program program;                   // instructions, labels, line table and relocations (incomplete if diagnostics)
+        std::vector<n64::diagnostic> diagnostics;   // every error in source order
+
+        /**
+         * source was assembled without error
+         * @return no diagnostics
+         */
+        bool ok()const noexcept {
+            return diagnostics.empty();
+        }
+    };
+
+    /**
+     * in-memory assembler.
+     * instruction and register tables are built once per process and shared by every assembler.
+     * assembly never exits the process, errors are returned as diagnostics.
+     */
+    class assembler {
+    private:
+        std::size_t _jobs;
+        n64::assembly_cache *_cache;
+        bool _relocatable;
+
+    public:
+        /**
+         * @param jobs threads encoding instructions (0: number of cores)
+         */
+        explicit assembler(std::size_t jobs=1);
+
+    public:
+        /**
+         * assemble source text
+         * @param text source
+         * @param name source name used by diagnostics and line table
+         * @return assembled program and diagnostics
+         */
+        n64::assembly assemble(std::string_view text, const std::string& name="<memory>")const;
+
+        /**
+         * assemble source file
+         * @param file source file name
+         * @return assembled program and diagnostics
+         */
+        n64::assembly assemble_file(const std::string& file)const;
+
+        /**
+         * reuse regions of earlier builds and store encoded ones (statistics are counted by cache)
+         * @param cache assembly cache (nullptr: encode every region)
+         */
+        void cache(n64::assembly_cache *cache)noexcept {
+            _cache=cache;
+        }
+
+        /**
+         * emit object: every label operand is recorded as relocation and undefined labels are no error
+         * @param relocatable emit object
+         */
+        void relocatable(bool relocatable)noexcept {
+            _relocatable=relocatable;
+        }
+
+        /**
+         * threads encoding instructions
+         * @return jobs
+         */
+        std::size_t jobs()const noexcept {
+            return _jobs;
+        }
+    };
+} /* n64 */
+
+#endif //N64_EMU_ASSEMBLER_HPP
@@ -14,401 +14,185 @@
 
 #include <iostream>
 #include <fstream>
+#include <iomanip>
 #include <algorithm>
-#include <unordered_map>
-#include <regex>
-
-#include <boost/algorithm/string.hpp>
-#include <boost/optional.hpp>
-#include <boost/preprocessor.hpp>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <system_error>
 
 #include "cmdline.hpp"
 
-#include "instruction.hpp"
+#include "binary.hpp"
+#include "assembler.hpp"
+#include "assembly_cache.hpp"
+#include "peephole.hpp"
+#include "global_optimizer.hpp"
 
 namespace {
-    using instruction_info_t=std::tuple<std::uint8_t, unsigned>;
-    using instruction_map_t=std::unordered_map<std::string, instruction_info_t>;
-    using register_map_t=std::unordered_map<std::string, std::uint8_t>;
-    using system_info_t=std::tuple<instruction_map_t, register_map_t>;
-    constexpr int INSTRUCTION_TYPE_NUMBER=1, INSTRUCTION_NUMBER=0, INSTRUCTION_TYPE=1, INSTRUCTION_MAP=0, REGISTER_MAP=1;
-
     /**
-     * read from source file
-     * @param input_file source file
-     * @return file content
+     * object file name of source ("a.S" -> "a.n64o")
+     * @param input source file name
+     * @return object file name
      */
-    std::string read_file(const std::string& input_file) {
-        std::ifstream fin(input_file);
-        if(fin.fail()) {
-            std::cerr<<"error: cannot open source file."<<std::endl;
-            exit(EXIT_FAILURE);
-        }
-
-        return std::string(std::istreambuf_iterator<char>(fin), std::istreambuf_iterator<char>());
+    std::string object_name(const std::string& input) {
+        const auto dot=input.rfind('.');
+        const auto slash=input.rfind('/');
+        const auto stem=dot!=std::string::npos && (slash==std::string::npos || dot>slash) ? input.substr(0, dot) : input;
+        return stem+".n64o";
     }
+} /* anonymous */
 
-    /**
-     * reformat source code
-     * @param content source code
-     * @return formatted source code
-     */
-    std::vector<std::string> reformat_data(std::string content) {
-        namespace ba=boost::algorithm;
-
-        // convert to lower case
-        std::transform(std::begin(content), std::end(content), std::begin(content), ::tolower);
-
-        // remove useless spaces
-        content=std::regex_replace(content, std::regex(R"(\s*,\s*)"), ",");
-        content=std::regex_replace(content, std::regex(R"(\s*:\s*)"), ":");
-
-        // split lines
-        std::vector<std::string> lines;
-        ba::split(lines, content, boost::is_any_of("\n;"));
-        for(auto& line : lines) {
-            // remove useless spaces
-            ba::trim(line);
-        }
+int main(int argc, char **argv) {
+    std::cout<<"N64 Assembler"<<std::endl;
+    std::cout<<"Version: "<<1<<std::endl;
 
-        // remove empty line
-        std::remove_if(std::begin(lines), std::end(lines), [](const std::string& line) {
-            return line.empty();
-        });
+    cmdline::parser parser;
+    parser.add<std::string>("output", 'o', "output file", false, "a.n64");
+    parser.add<std::string>("format", 'f', "output format (n64: container, raw: instructions only)", false, "n64",
+                            cmdline::oneof<std::string>("n64", "raw"));
+    parser.add<std::string>("entry", 'e', "label of entry point", false, "");
+    parser.add<std::size_t>("jobs", 'j', "threads encoding instructions (0: number of cores)", false, 1);
+    parser.add<std::string>("cache", 'c', "assembly cache file (reuse unchanged regions of earlier builds)", false, "");
+    parser.add("object", '\0', "emit object file for n64ld per source (<source>.n64o, or output file with one source)");
+    parser.add("optimize", 'O', "peephole optimisation (remove nops, redundant moves, inc/dec pairs and jmp chains)");
+    parser.add("global", 'G', "whole program optimisation (unreachable code, jump threading, constant propagation)");
+    parser.add<std::string>("removed", '\0', "write instructions removed by --global to file", false, "");
+    parser.footer("source ...");
 
-        return lines;
+    parser.parse_check(argc, argv);
+    const auto& inputs=parser.rest();
+    const bool object=parser.exist("object");
+    if(inputs.empty()) {
+        std::cerr<<"error: no source file"<<std::endl<<parser.usage();
+        return EXIT_FAILURE;
+    }
+    if(!object && inputs.size()>1) {
+        std::cerr<<"error: several source files need --object (link them with n64ld)"<<std::endl;
+        return EXIT_FAILURE;
+    }
+    if(object && (parser.exist("entry") || parser.get<std::string>("format")!="n64")) {
+        std::cerr<<"error: --entry and --format are options of executable (give entry to n64ld)"<<std::endl;
+        return EXIT_FAILURE;
+    }
+    if(object && parser.exist("global")) {
+        std::cerr<<"error: --global needs whole program (object files are partial)"<<std::endl;
+        return EXIT_FAILURE;
     }
 
-    /**
-     * decode operand from operand string
-     * @param reg_map register map (register name -> register number)
-     * @param operand operand string
-     * @param index line index
-     * @return register number, register option, register type
-     */
-    std::tuple<std::uint8_t /* register */, std::uint64_t /* option */, std::uint8_t /* type */>
-            decode_operand(const register_map_t& reg_map, std::string operand, std::size_t index) {
-        namespace ba=boost::algorithm;
-
-        std::uint8_t reg=0;
-        std::uint64_t option=0;
-        std::uint8_t type=0;
-
-        if(operand[0]=='[') {
-            // pointer
-            operand=std::regex_replace(std::regex_replace(operand, std::regex(R"(\[\s*)"), ""), std::regex(R"(\s*\])"), "");
-            std::vector<std::string> op;
-            ba::split(op, operand, boost::is_any_of("+"));
-            for(auto& o : op) {
-                ba::trim(o);
-            }
-            if(reg_map.count(op[0])<=0) {
-                std::cerr<<"error: unknown operand \""<<op[0]<<"\". near line "<<(index+1)<<std::endl;
-                exit(EXIT_FAILURE);
-            }
-            reg=reg_map.at(op[0]);
+    // units are assembled in parallel, one unit uses every thread itself
+    auto jobs=parser.get<std::size_t>("jobs");
+    if(jobs==0) {
+        jobs=std::max(1U, std::thread::hardware_concurrency());
+    }
+    n64::assembler as(inputs.size()==1 ? jobs : 1);
+    as.relocatable(object);
+    n64::assembly_cache cache;
+    const auto cache_file=parser.get<std::string>("cache");
+    if(!cache_file.empty()) {
+        cache.load(cache_file);
+        as.cache(&cache);
+    }
 
-            if(op.size()>1) {
-                option=std::stoull(op[1]);
+    const bool optimize=parser.exist("optimize");
+    std::vector<n64::assembly> results(inputs.size());
+    std::vector<n64::peephole_report> reports(inputs.size());
+    std::atomic<std::size_t> next(0);
+    const auto work=[&]() {
+        for(auto i=next++; i<inputs.size(); i=next++) {
+            results[i]=as.assemble_file(inputs[i]);
+            if(optimize && results[i].ok()) {
+                reports[i]=n64::peephole(results[i].program, object);
             }
-            type=1U;
-        }else{
-            // register
-            std::vector<std::string> op;
-            ba::split(op, operand, boost::is_any_of(" "));
-            for(auto& o : op) {
-                ba::trim(o);
-            }
-
-            // size is specified
-            if(op.size()>2) {
-                if(op[0]=="byte") {
-                    option=1;
-                }else if(op[0]=="word") {
-                    option=2;
-                }else if(op[0]=="dword") {
-                    option=3;
+            if(object && results[i].ok()) {
+                const auto name=inputs.size()==1 && parser.exist("output") ? parser.get<std::string>("output") : object_name(inputs[i]);
+                try {
+                    n64::save_object(name, results[i].program);
+                }catch(const std::system_error& e) {
+                    // unit fails, so a stale object file is never linked silently
+                    results[i].diagnostics.push_back({name, 0, 0, "cannot write object file ("+e.code().message()+")"});
                 }
             }
-            const auto& re=op[op.size()-1];
-            if(reg_map.count(re)<=0) {
-                std::cerr<<"error: unknown operand \""<<op[0]<<"\". near line "<<(index+1)<<std::endl;
-                exit(EXIT_FAILURE);
-            }
-            reg=reg_map.at(re);
         }
-
-        return std::tuple<std::uint8_t, std::uint64_t, std::uint8_t>(reg, option, type);
     };
+    std::vector<std::thread> threads;
+    for(std::size_t t=1; t<std::min(jobs, inputs.size()); ++t) {
+        threads.emplace_back(work);
+    }
+    work();
+    for(auto& t : threads) {
+        t.join();
+    }
 
-    /**
-     * assemble one instruction
-     * @param sys_info system information (register map and instruction map)
-     * @param lines all lines
-     * @param index current line index
-     * @return assembled instruction (if boost::none, label only line)
-     */
-    boost::optional<n64::instruction::instruction> assemble_line(const system_info_t& sys_info, const std::vector<std::string>& lines, std::size_t index) {
-        namespace ba=boost::algorithm;
-
-        // support functions
-        const auto operand_count_check=[&index](std::size_t count, std::size_t passed) {
-            if(passed!=count) {
-                std::cerr
-                        <<"error: operands count mismatch. 3 operands expected. near line "<<(index+1)<<"\n"
-                        <<"       you passed "<<passed<<" operands."<<std::endl;
-                exit(EXIT_FAILURE);
-            }
-        };
-        const auto decode_immediate=[](std::string num) -> std::uint64_t {
-            int base=10;
-            if(num[0]=='0' && num.size()!=1) {
-                if(num[1]=='x') {
-                    num=num.substr(2);
-                    base=16;
-                }else{
-                    num=num.substr(1);
-                    base=8;
-                }
-            }
-            return std::stoull(num, nullptr, base);
-        };
-        const auto get_absolute_label_address=[&lines, &index](std::string label) -> std::uint64_t {
-            label+=":";
-            const auto label_length=label.size();
-
-            auto itr=std::find_if(std::begin(lines), std::end(lines), [&label, &label_length](const std::string& line) {
-                if(label_length>line.size())return false;
-                for(std::size_t i=0; i<label_length; ++i) {
-                    if(label[i]!=line[i])return false;
-                }
-                return true;
-            });
-            if(itr==std::end(lines)) {
-                label.pop_back();
-                std::cerr<<"error: undefined identifier \""<<label<<"\". near line "<<(index+1)<<std::endl;
-                exit(EXIT_FAILURE);
-            }
-
-            return static_cast<std::uint64_t>(itr-std::begin(lines));
-        };
-        // jump or call operators
-        static const std::vector<std::string> JUMP_TYPE_OPERATORS={
-                "call", "jmp", "jr", "je", "jne", "ja", "jae", "jb", "jbe"
-        };
-        // decimal, octal or hexadecimal regex
-        static const std::regex NUMBERS(R"(0x[0-9a-fA-F]+|0[0-7]+|[0-9][1-9]*|0)");
-
-        // instruction info and register info
-        const auto& im=std::get<INSTRUCTION_MAP>(sys_info);
-        const auto& rm=std::get<REGISTER_MAP>(sys_info);
-
-        // // // // // // // // // // // // // // // // // // // // // // // // // // // // //
-        auto line=lines[index];
-
-        std::vector<std::string> parts;
-
-        /* check line has label */ {
-            auto colon_index=line.find(':');
-            if(colon_index!=std::string::npos) {
-                line=line.substr(colon_index+1);
-            }
-            boost::algorithm::trim(line);
-            if(line.empty())return boost::none;
+    bool ok=true;
+    for(std::size_t i=0; i<results.size(); ++i) {
+        for(const auto& d : results[i].diagnostics) {
+            std::cerr<<"error: "<<d.str()<<std::endl;
         }
-
-        ba::split(parts, line, boost::is_any_of(" "));
-
-        // process pseudo-instructions
-        if(parts[0]=="nop") {
-            parts[0]="xchg";
-            parts.emplace_back("r0,r0");
-        }else if(parts[0]=="raise") {
-            parts[0]="cmp";
-            parts.emplace_back("r0,r0");
-        }else if(parts[0]=="mov") {
-            std::vector<std::string> operand;
-            ba::split(operand, parts[1], boost::is_any_of(","));
-
-            operand_count_check(2, operand.size());
-
-            parts[0]="add";
-            parts[1]=operand[0]+","+operand[1]+",r0";
+        ok=ok && results[i].ok();
+        if(optimize && results[i].ok()) {
+            std::cout<<"peephole: "<<inputs[i]<<": "<<reports[i].str()<<std::endl;
         }
-
-        if(im.count(parts[0])<=0) {
-            std::cerr<<"error: unknown instruction \""<<parts[0]<<"\". near line "<<(index+1)<<std::endl;
-            exit(EXIT_FAILURE);
+    }
+    if(!cache_file.empty()) {
+        std::cout<<"assembly cache: "<<cache.hits()<<" hits, "<<cache.misses()<<" misses, "
+                 <<cache.reused()<<" of "<<cache.reused()+cache.encoded()<<" instructions reused"<<std::endl;
+        if(!cache.save(cache_file)) {
+            std::cerr<<"warning: cannot write assembly cache "<<cache_file<<std::endl;
         }
+    }
+    if(!ok) {
+        return EXIT_FAILURE;
+    }
+    if(object) {
+        return EXIT_SUCCESS;
+    }
+    const auto output=parser.get<std::string>("output");
+    auto& program=results[0].program;
 
-        // set instruction opcode
-        n64::instruction::instruction ins={};
-        ins.instruction.type=std::get<INSTRUCTION_TYPE_NUMBER>(im.at(parts[0]));
-        ins.instruction.instruction=std::get<INSTRUCTION_NUMBER>(im.at(parts[0]));
-        auto type=std::get<INSTRUCTION_TYPE>(im.at(parts[0]));
-
-        std::vector<std::string> operand;
-        if(type!=n64::instruction::NO_OPERAND) {
-            ba::split(operand, parts[1], boost::is_any_of(","));
+    const auto entry=parser.get<std::string>("entry");
+    if(!entry.empty()) {
+        auto itr=std::find_if(std::begin(program.symbols), std::end(program.symbols), [&entry](const n64::symbol& s) {
+            return s.name==entry;
+        });
+        if(itr==std::end(program.symbols)) {
+            std::cerr<<"error: undefined entry point \""<<entry<<"\""<<std::endl;
+            return EXIT_FAILURE;
         }
+        program.entry=itr->address;
+    }
 
-        switch(type) {
-            case n64::instruction::THREE_ADDRESS:{
-                operand_count_check(3, operand.size());
-
-                auto[rd, od, td] = decode_operand(rm, operand[0], index);
-                ins.ta.destination=rd;
-                ins.ta.destination_option=static_cast<unsigned>(od);
-                ins.ta.type |= (td<<2);
-
-                auto[rs1, os1, ts1] = decode_operand(rm, operand[1], index);
-                ins.ta.source1=rs1;
-                ins.ta.source1_option=static_cast<unsigned>(os1);
-                ins.ta.type |= (ts1<<1);
-
-                auto[rs2, os2, ts2] = decode_operand(rm, operand[2], index);
-                ins.ta.source2=rs2;
-                ins.ta.source2_option=static_cast<unsigned>(os2);
-                ins.ta.type |= ts2;
-            }
-                break;
-            case n64::instruction::BINOMIAL:{
-                operand_count_check(2, operand.size());
-
-                auto[o1, oo1, ot1] =decode_operand(rm, operand[0], index);
-                ins.b.operand1=o1;
-                ins.b.operand1_option=static_cast<unsigned>(oo1);
-                ins.b.type |= (ot1<<1);
-
-                auto[o2, oo2, ot2] =decode_operand(rm, operand[1], index);
-                ins.b.operand2=o2;
-                ins.b.operand2_option=static_cast<unsigned>(oo2);
-                ins.b.type |= ot2;
-            }
-                break;
-            case n64::instruction::UNARY:{
-                operand_count_check(1, operand.size());
-
-                if(std::regex_match(operand[0], NUMBERS)) {
-                    ins.u.imm.immediate=decode_immediate(operand[0]);
-                    ins.u.type=0b11;
-                }else{
-                    if(std::find(std::begin(JUMP_TYPE_OPERATORS), std::end(JUMP_TYPE_OPERATORS), parts[0])!=std::end(JUMP_TYPE_OPERATORS)) {
-                        auto absolute_address=get_absolute_label_address(operand[0]);
-                        ins.u.imm.immediate=absolute_address;
-                        ins.u.type=0b11;
-                    }else{
-                        auto[r, ro, rt]=decode_operand(rm, operand[0], index);
-                        ins.u.reg.operand=r;
-                        ins.u.reg.operand_option=ro;
-                        ins.u.type=rt;
-                    }
-                }
+    if(parser.exist("global")) {
+        // unreachable code depends on entry point, so this runs on the final executable only
+        const auto report=n64::global_optimize(program);
+        std::cout<<"global: "<<report.str()<<std::endl;
+
+        const auto removed=parser.get<std::string>("removed");
+        if(!removed.empty()) {
+            std::ofstream out(removed);
+            for(const auto& r : report.removed) {
+                const char *name=n64::instruction::mnemonic(r.instruction);
+                out<<"0x"<<std::hex<<std::setw(16)<<std::setfill('0')<<r.address<<std::dec<<"\t"
+                   <<program.source<<":"<<r.line<<"\t"<<r.reason<<"\t"<<(name==nullptr ? "(undefined)" : name)<<"\n";
             }
-                break;
-            case n64::instruction::REGISTER_IMMEDIATE:{
-                operand_count_check(2, operand.size());
-
-                auto r=std::get<0>(decode_operand(rm, operand[0], index));
-                ins.ri.reg=r;
-
-                if(!std::regex_match(operand[1], NUMBERS)) {
-                    std::cerr<<"error: operand 2 must be immediate. near line "<<(index+1)<<std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                ins.ri.immediate=decode_immediate(operand[1]);
+            if(!out) {
+                std::cerr<<"error: cannot write "<<removed<<std::endl;
+                return EXIT_FAILURE;
             }
-                break;
         }
-
-        return ins;
     }
 
-    /**
-     * assemble all lines
-     * @param sys_info system information
-     * @param input_file input file name
-     * @return assembled instruction
-     */
-    std::vector<n64::instruction::instruction> assemble(const system_info_t& sys_info, const std::string& input_file) {
-        auto lines=reformat_data(read_file(input_file));
-
-        std::vector<n64::instruction::instruction> instructions;
-        for(std::size_t i=0; i<lines.size(); ++i) {
-            auto line=assemble_line(sys_info, lines, i);
-            if(line) {
-                instructions.emplace_back(line.get());
-            }
+    try {
+        if(parser.get<std::string>("format")=="raw") {
+            n64::save_binary(output, program.code);
+        }else{
+            n64::save_program(output, program);
         }
-        return instructions;
+    }catch(const std::system_error& e) {
+        std::cerr<<"error: "<<e.what()<<std::endl;
+        return EXIT_FAILURE;
     }
-} /* anonymous */
-
-int main(int argc, char **argv) {
-    std::cout<<"N64 Assembler"<<std::endl;
-    std::cout<<"Version: "<<1<<std::endl;
-
-    cmdline::parser parser;
-    parser.add<std::string>("output", 'o', "output file", false, "a.n64");
-
-    parser.parse_check(argc, argv);
-    auto output=parser.get<std::string>("output");
-    auto input=parser.rest()[0];
-
-    // instructions
-    instruction_map_t instruction_map={
-            {"add",   std::tuple<std::uint8_t, unsigned>(0b00000, n64::instruction::THREE_ADDRESS)},
-            {"sub",   std::tuple<std::uint8_t, unsigned>(0b00001, n64::instruction::THREE_ADDRESS)},
-            {"mul",   std::tuple<std::uint8_t, unsigned>(0b00010, n64::instruction::THREE_ADDRESS)},
-            {"div",   std::tuple<std::uint8_t, unsigned>(0b00011, n64::instruction::THREE_ADDRESS)},
-            {"shr",   std::tuple<std::uint8_t, unsigned>(0b00100, n64::instruction::THREE_ADDRESS)},
-            {"shl",   std::tuple<std::uint8_t, unsigned>(0b00101, n64::instruction::THREE_ADDRESS)},
-            {"inc",   std::tuple<std::uint8_t, unsigned>(0b00000, n64::instruction::UNARY)},
-            {"dec",   std::tuple<std::uint8_t, unsigned>(0b00001, n64::instruction::UNARY)},
-            {"not",   std::tuple<std::uint8_t, unsigned>(0b00000, n64::instruction::BINOMIAL)},
-            {"and",   std::tuple<std::uint8_t, unsigned>(0b00110, n64::instruction::THREE_ADDRESS)},
-            {"or",    std::tuple<std::uint8_t, unsigned>(0b00111, n64::instruction::THREE_ADDRESS)},
-            {"xor",   std::tuple<std::uint8_t, unsigned>(0b01000, n64::instruction::THREE_ADDRESS)},
-
-            {"call",  std::tuple<std::uint8_t, unsigned>(0b00010, n64::instruction::UNARY)},
-            {"jmp",   std::tuple<std::uint8_t, unsigned>(0b00011, n64::instruction::UNARY)},
-            {"jr",    std::tuple<std::uint8_t, unsigned>(0b00100, n64::instruction::UNARY)},
-
-            {"je",    std::tuple<std::uint8_t, unsigned>(0b00101, n64::instruction::UNARY)},
-            {"jne",   std::tuple<std::uint8_t, unsigned>(0b00110, n64::instruction::UNARY)},
-            {"ja",    std::tuple<std::uint8_t, unsigned>(0b00111, n64::instruction::UNARY)},
-            {"jae",   std::tuple<std::uint8_t, unsigned>(0b01000, n64::instruction::UNARY)},
-            {"jb",    std::tuple<std::uint8_t, unsigned>(0b01001, n64::instruction::UNARY)},
-            {"jbe",   std::tuple<std::uint8_t, unsigned>(0b01010, n64::instruction::UNARY)},
-
-            {"push",  std::tuple<std::uint8_t, unsigned>(0b01011, n64::instruction::UNARY)},
-            {"pop",   std::tuple<std::uint8_t, unsigned>(0b01100, n64::instruction::UNARY)},
-
-            {"hlt",   std::tuple<std::uint8_t, unsigned>(0b00000, n64::instruction::NO_OPERAND)},
-            {"xchg",  std::tuple<std::uint8_t, unsigned>(0b00001, n64::instruction::BINOMIAL)},
-            {"ret",   std::tuple<std::uint8_t, unsigned>(0b00001, n64::instruction::NO_OPERAND)},
-            {"cmp",   std::tuple<std::uint8_t, unsigned>(0b00010, n64::instruction::BINOMIAL)},
-            {"asgn",  std::tuple<std::uint8_t, unsigned>(0b00000, n64::instruction::REGISTER_IMMEDIATE)},
-            {"asgnh", std::tuple<std::uint8_t, unsigned>(0b00001, n64::instruction::REGISTER_IMMEDIATE)},
-            {"asgnl", std::tuple<std::uint8_t, unsigned>(0b00010, n64::instruction::REGISTER_IMMEDIATE)}
-    };
-
-    // registers
-    register_map_t register_map={
-            {"r0", n64::reg::id::R0},
-#define RS_REGISTER(z, n, d) {"rs" #n, n64::reg::id::RS[n]},
-            BOOST_PP_REPEAT(32, RS_REGISTER, 0)
-#undef RS_REGISTER
-#define RT_REGISTER(z, n, d) {"rt" #n, n64::reg::id::RT[n]},
-            BOOST_PP_REPEAT(32, RT_REGISTER, 0)
-#undef RT_REGISTER
-            {"ip", n64::reg::id::IP},
-            {"flags", n64::reg::id::FLAGS},
-            {"sp", n64::reg::id::SP},
-            {"bp", n64::reg::id::BP}
-    };
-
-    n64::save_binary(output, assemble(system_info_t(instruction_map, register_map), input));
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,245 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <fstream>
+#include <iterator>
+#include <cstring>
+#include <cstdio>
+
+#include <unistd.h>
+
+#include "assembly_cache.hpp"
+
+namespace n64 {
+    namespace {
+        constexpr char MAGIC[8]={'N', '6', '4', 'A', 'S', 'M', 'C', '\n'};
+        constexpr std::size_t HEADER_SIZE=40;
+
+        /**
+         * cache file header
+         */
+        struct header {
+            char magic[8];
+            std::uint32_t version;
+            std::uint32_t reserved;
+            std::uint64_t generation;
+            std::uint64_t regions;
+            std::uint64_t checksum;
+        };
+        static_assert(sizeof(header)==HEADER_SIZE, "cache header must be 40 bytes");
+
+        /**
+         * FNV-1a over bytes
+         * @param data data
+         * @param size data size
+         * @return hash
+         */
+        std::uint64_t checksum(const char *data, std::size_t size) {
+            std::uint64_t hash=0xcbf29ce484222325ULL;
+            for(std::size_t i=0; i<size; ++i) {
+                hash=(hash ^ static_cast<unsigned char>(data[i]))*0x100000001b3ULL;
+            }
+            return hash;
+        }
+
+        /**
+         * append value in native byte order
+         * @param out output
+         * @param value value
+         */
+        template<typename T>
+        void append(std::string& out, T value) {
+            out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+        }
+
+        /**
+         * bounds checked reader of cache file body
+         */
+        class reader {
+        private:
+            const char *_at, *_end;
+
+        public:
+            reader()=delete;
+            reader(const char *begin, const char *end) : _at(begin), _end(end) {}
+
+        public:
+            /**
+             * read value
+             * @param value value
+             * @return read (false: end of data)
+             */
+            template<typename T>
+            bool read(T& value)noexcept {
+                if(static_cast<std::size_t>(_end-_at)<sizeof(value))return false;
+                std::memcpy(&value, _at, sizeof(value));
+                _at+=sizeof(value);
+                return true;
+            }
+
+            /**
+             * read text
+             * @param text text
+             * @param size text size
+             * @return read (false: end of data)
+             */
+            bool read(std::string& text, std::size_t size) {
+                if(static_cast<std::size_t>(_end-_at)<size)return false;
+                text.assign(_at, size);
+                _at+=size;
+                return true;
+            }
+
+            /**
+             * all data was read
+             * @return done
+             */
+            bool done()const noexcept {
+                return _at==_end;
+            }
+        };
+    } /* anonymous */
+
+    /**
+     * read cache file, this build becomes next generation
+     * @param file cache file
+     * @return loaded (false: missing, stale or corrupted file, cache is empty)
+     */
+    bool assembly_cache::load(const std::string& file) {
+        _regions.clear();
+        _generation=1;
+
+        std::ifstream fin(file, std::ios::in | std::ios::binary);
+        if(fin.fail())return false;
+        const std::string data((std::istreambuf_iterator<char>(fin)), std::istreambuf_iterator<char>());
+
+        header h={};
+        if(data.size()<HEADER_SIZE)return false;
+        std::memcpy(&h, data.data(), HEADER_SIZE);
+        if(std::memcmp(h.magic, MAGIC, sizeof(MAGIC))!=0 || h.version!=VERSION
+           || h.checksum!=checksum(data.data()+HEADER_SIZE, data.size()-HEADER_SIZE)) {
+            return false;
+        }
+
+        reader in(data.data()+HEADER_SIZE, data.data()+data.size());
+        for(std::uint64_t i=0; i<h.regions; ++i) {
+            key k;
+            region r;
+            std::uint32_t instructions=0, references=0;
+            if(!in.read(k.low) || !in.read(k.high) || !in.read(r.used) || !in.read(instructions) || !in.read(references)) {
+                _regions.clear();
+                return false;
+            }
+            r.code.resize(instructions);
+            for(auto& word : r.code) {
+                if(!in.read(word)) {
+                    _regions.clear();
+                    return false;
+                }
+            }
+            r.references.resize(references);
+            for(auto& ref : r.references) {
+                std::uint32_t length=0;
+                if(!in.read(ref.index) || !in.read(length) || !in.read(ref.label, length) || ref.index>=instructions) {
+                    _regions.clear();
+                    return false;
+                }
+            }
+            _regions.emplace(k, std::move(r));
+        }
+        if(!in.done()) {
+            _regions.clear();
+            return false;
+        }
+
+        _generation=h.generation+1;
+        return true;
+    }
+
+    /**
+     * write cache file (atomically replaced), regions unused for MAX_AGE builds are dropped
+     * @param file cache file
+     * @return written
+     */
+    bool assembly_cache::save(const std::string& file)const {
+        std::string out(HEADER_SIZE, '\0');
+        std::uint64_t count=0;
+        for(const auto& [k, r] : _regions) {
+            if(r.used+MAX_AGE<=_generation)continue;
+            append(out, k.low);
+            append(out, k.high);
+            append(out, r.used);
+            append(out, static_cast<std::uint32_t>(r.code.size()));
+            append(out, static_cast<std::uint32_t>(r.references.size()));
+            out.append(reinterpret_cast<const char*>(r.code.data()), r.code.size()*sizeof(std::uint64_t));
+            for(const auto& ref : r.references) {
+                append(out, ref.index);
+                append(out, static_cast<std::uint32_t>(ref.label.size()));
+                out+=ref.label;
+            }
+            ++count;
+        }
+
+        header h={};
+        std::memcpy(h.magic, MAGIC, sizeof(MAGIC));
+        h.version=VERSION;
+        h.generation=_generation;
+        h.regions=count;
+        h.checksum=checksum(out.data()+HEADER_SIZE, out.size()-HEADER_SIZE);
+        std::memcpy(&out[0], &h, HEADER_SIZE);
+
+        // concurrent builds never read partial file: write temporary file and rename it over the cache
+        const auto temporary=file+".tmp"+std::to_string(getpid());
+        {
+            std::ofstream fout(temporary, std::ios::out | std::ios::binary);
+            fout.write(out.data(), static_cast<std::streamsize>(out.size()));
+            if(!fout.flush()) {
+                std::remove(temporary.c_str());
+                return false;
+            }
+        }
+        if(std::rename(temporary.c_str(), file.c_str())!=0) {
+            std::remove(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * count reuse of cached region
+     * @param k key of cached region
+     */
+    void assembly_cache::hit(const key& k) {
+        std::unique_lock<std::shared_mutex> lock(_mutex);
+        auto& r=_regions.at(k);
+        r.used=_generation;
+        ++_hits;
+        _reused+=r.code.size();
+    }
+
+    /**
+     * count region which was encoded and cache it (kept region if key is cached)
+     * @param k key
+     * @param r assembled region
+     */
+    void assembly_cache::miss(const key& k, region r) {
+        std::unique_lock<std::shared_mutex> lock(_mutex);
+        ++_misses;
+        _encoded+=r.code.size();
+        r.used=_generation;
+        // same key is same text, so cached region (which other threads may be reading) is kept
+        _regions.try_emplace(k, std::move(r)).first->second.used=_generation;
+    }
+} /* n64 */
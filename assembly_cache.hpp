@@ -0,0 +1,204 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef N64_EMU_ASSEMBLY_CACHE_HPP
+#define N64_EMU_ASSEMBLY_CACHE_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <mutex>
+#include <shared_mutex>
+
+/*
+ * assembly cache file (native byte order, host specific)
+ *
+ * header (40 bytes)
+ *   0  magic "N64ASMC\n"
+ *   8  u32 version (assembly_cache::VERSION)
+ *  12  u32 reserved (0)
+ *  16  u64 generation (build count)
+ *  24  u64 region count
+ *  32  u64 checksum of every byte after header
+ * region
+ *   u64 key low, u64 key high
+ *   u64 generation of last use
+ *   u32 instruction count, u32 reference count
+ *   u64[instruction count]             encoded instructions
+ *   {u32 index, u32 length, label}     label references (instruction index in region)
+ */
+
+namespace n64 {
+    /**
+     * content-addressed cache of assembled source regions.
+     * a region is a run of statements keyed by hash of their normalized text (lower case, whitespace folded),
+     * so an unchanged region is reused wherever it moved to. label operands are kept by name and
+     * resolved again on reuse, which makes cached output identical to a clean build.
+     * regions unused for MAX_AGE builds are dropped on save.
+     * find, hit and miss may be called from any thread (units assembled in parallel share one cache).
+     * remove: copy & move constructors and copy & move assign operators.
+     */
+    class assembly_cache {
+    public:
+        static constexpr std::uint32_t VERSION=1;      // bump when encoding of any statement changes
+        static constexpr std::uint64_t MAX_AGE=8;
+
+        /**
+         * 128 bit hash of region text, extended statement by statement
+         */
+        struct key {
+            std::uint64_t low=0xcbf29ce484222325ULL, high=0x84222325cbf29ce4ULL;
+
+            /**
+             * add statement to hash
+             * @param statement normalized statement text
+             */
+            void add(std::string_view statement)noexcept {
+                for(auto c : statement) {
+                    low=(low ^ static_cast<unsigned char>(c))*0x100000001b3ULL;
+                    high=(high+static_cast<unsigned char>(c))*0x9e3779b97f4a7c15ULL;
+                    high^=high >> 29;
+                }
+                // statements never contain line break, so it separates them
+                low=(low ^ '\n')*0x100000001b3ULL;
+                high=(high+'\n')*0x9e3779b97f4a7c15ULL;
+                high^=high >> 29;
+            }
+
+            bool operator==(const key& k)const noexcept {
+                return low==k.low && high==k.high;
+            }
+        };
+
+        /**
+         * label operand of cached instruction
+         */
+        struct reference {
+            std::uint32_t index;        // instruction index in region
+            std::string label;
+        };
+
+        /**
+         * assembled region
+         */
+        struct region {
+            std::vector<std::uint64_t> code;    // instruction::data of every instruction
+            std::vector<reference> references;
+            std::uint64_t used=0;               // generation of last use
+        };
+
+    private:
+        struct key_hash {
+            std::size_t operator()(const key& k)const noexcept {
+                return static_cast<std::size_t>(k.low);
+            }
+        };
+
+        std::unordered_map<key, region, key_hash> _regions;    // never erased while assembling, so regions stay in place
+        mutable std::shared_mutex _mutex;
+        std::uint64_t _generation;
+        std::uint64_t _hits, _misses, _reused, _encoded;
+
+    public:
+        /**
+         * empty cache
+         */
+        assembly_cache() : _generation(1), _hits(0), _misses(0), _reused(0), _encoded(0) {}
+        assembly_cache(const assembly_cache&)=delete;
+        assembly_cache(assembly_cache&&)=delete;
+
+        assembly_cache& operator=(const assembly_cache&)=delete;
+        assembly_cache& operator=(assembly_cache&&)=delete;
+
+    public:
+        /**
+         * read cache file, this build becomes next generation
+         * @param file cache file
+         * @return loaded (false: missing, stale or corrupted file, cache is empty)
+         */
+        bool load(const std::string& file);
+
+        /**
+         * write cache file (atomically replaced), regions unused for MAX_AGE builds are dropped
+         * @param file cache file
+         * @return written
+         */
+        bool save(const std::string& file)const;
+
+        /**
+         * find region
+         * @param k key
+         * @return region (nullptr: not cached)
+         */
+        const region *find(const key& k)const {
+            std::shared_lock<std::shared_mutex> lock(_mutex);
+            const auto itr=_regions.find(k);
+            return itr==std::end(_regions) ? nullptr : &itr->second;
+        }
+
+        /**
+         * count reuse of cached region
+         * @param k key of cached region
+         */
+        void hit(const key& k);
+
+        /**
+         * count region which was encoded
+         * @param instructions instruction count of region
+         */
+        void miss(std::uint64_t instructions) {
+            std::unique_lock<std::shared_mutex> lock(_mutex);
+            ++_misses;
+            _encoded+=instructions;
+        }
+
+        /**
+         * count region which was encoded and cache it (kept region if key is cached)
+         * @param k key
+         * @param r assembled region
+         */
+        void miss(const key& k, region r);
+
+        /**
+         * cached regions
+         * @return region count
+         */
+        std::size_t size()const noexcept {
+            return _regions.size();
+        }
+
+        /**
+         * statistics
+         * @return counts (reused, encoded: instructions)
+         */
+        std::uint64_t hits()const noexcept {
+            return _hits;
+        }
+        std::uint64_t misses()const noexcept {
+            return _misses;
+        }
+        std::uint64_t reused()const noexcept {
+            return _reused;
+        }
+        std::uint64_t encoded()const noexcept {
+            return _encoded;
+        }
+    };
+} /* n64 */
+
+#endif //N64_EMU_ASSEMBLY_CACHE_HPP
@@ -16,43 +16,531 @@
 #include <vector>
 #include <string>
 #include <fstream>
+#include <cstring>
+#include <cerrno>
+#include <system_error>
+#include <stdexcept>
+#include <unordered_map>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include <boost/endian/conversion.hpp>
 
 #include "instruction.hpp"
+#include "binary.hpp"
 
 
 namespace n64 {
+    namespace {
+        /**
+         * read-only mapping of whole file
+         * remove: default constructor, copy & move constructors and copy & move assign operators.
+         */
+        class mapped_file {
+        private:
+            void *_data;
+            std::size_t _size;
+
+        public:
+            mapped_file()=delete;
+            explicit mapped_file(const std::string& file) : _data(nullptr), _size(0) {
+                const int fd=open(file.c_str(), O_RDONLY);
+                if(fd<0) {
+                    throw std::system_error(errno, std::generic_category(), file);
+                }
+                struct stat st={};
+                if(fstat(fd, &st)!=0) {
+                    const auto error=errno;
+                    close(fd);
+                    throw std::system_error(error, std::generic_category(), file);
+                }
+                _size=static_cast<std::size_t>(st.st_size);
+                if(_size>0) {
+                    _data=mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+                    if(_data==MAP_FAILED) {
+                        const auto error=errno;
+                        close(fd);
+                        throw std::system_error(error, std::generic_category(), file);
+                    }
+                    madvise(_data, _size, MADV_SEQUENTIAL);
+                }
+                close(fd);
+            }
+            ~mapped_file() {
+                if(_size>0)munmap(_data, _size);
+            }
+            mapped_file(const mapped_file&)=delete;
+            mapped_file(mapped_file&&)=delete;
+
+            mapped_file& operator=(const mapped_file&)=delete;
+            mapped_file& operator=(mapped_file&&)=delete;
+
+        public:
+            const std::uint8_t *data()const noexcept {
+                return static_cast<const std::uint8_t*>(_data);
+            }
+            std::size_t size()const noexcept {
+                return _size;
+            }
+        };
+
+        /**
+         * convert big-endian words to instructions (scalar)
+         * @param in big-endian words
+         * @param out instructions
+         * @param count word count
+         */
+        void convert_scalar(const std::uint8_t *in, n64::instruction::instruction *out, std::size_t count) {
+            for(std::size_t i=0; i<count; ++i) {
+                std::uint64_t be;
+                std::memcpy(&be, in+i*n64::instruction::WIDTH, sizeof(be));
+                out[i].data=boost::endian::big_to_native(be);
+            }
+        }
+
+#if defined(__x86_64__) && __BYTE_ORDER__==__ORDER_LITTLE_ENDIAN__
+        /**
+         * convert big-endian words to instructions (SSSE3, 2 words per iteration).
+         * every instruction is written whole, so padding after data is zero.
+         * @param in big-endian words
+         * @param out instructions
+         * @param count word count
+         * @return converted word count
+         */
+        __attribute__((target("ssse3")))
+        std::size_t convert_ssse3(const std::uint8_t *in, n64::instruction::instruction *out, std::size_t count) {
+            static_assert(sizeof(n64::instruction::instruction)==16, "instruction must be 16 bytes");
+            const __m128i swap=_mm_set_epi8(8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7);
+            const __m128i zero=_mm_setzero_si128();
+
+            std::size_t i=0;
+            for(; i+2<=count; i+=2) {
+                const auto words=_mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in+i*8)), swap);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out+i), _mm_unpacklo_epi64(words, zero));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out+i+1), _mm_unpackhi_epi64(words, zero));
+            }
+            return i;
+        }
+
+        /**
+         * convert big-endian words to instructions (AVX2, 4 words per iteration).
+         * @param in big-endian words
+         * @param out instructions
+         * @param count word count
+         * @return converted word count
+         */
+        __attribute__((target("avx2")))
+        std::size_t convert_avx2(const std::uint8_t *in, n64::instruction::instruction *out, std::size_t count) {
+            const __m256i swap=_mm256_set_epi8(
+                    8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7,
+                    8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7);
+            const __m256i zero=_mm256_setzero_si256();
+
+            std::size_t i=0;
+            for(; i+4<=count; i+=4) {
+                // [w0 w1 | w2 w3] -> [w0 0 | w2 0], [w1 0 | w3 0] -> [w0 0 w1 0], [w2 0 w3 0]
+                const auto words=_mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in+i*8)), swap);
+                const auto even=_mm256_unpacklo_epi64(words, zero);
+                const auto odd=_mm256_unpackhi_epi64(words, zero);
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out+i), _mm256_permute2x128_si256(even, odd, 0x20));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out+i+2), _mm256_permute2x128_si256(even, odd, 0x31));
+            }
+            return i;
+        }
+#endif
+
+        /**
+         * convert big-endian words to instructions with the widest available vector instructions
+         * @param in big-endian words
+         * @param out instructions
+         * @param count word count
+         */
+        void convert(const std::uint8_t *in, n64::instruction::instruction *out, std::size_t count) {
+            std::size_t done=0;
+#if defined(__x86_64__) && __BYTE_ORDER__==__ORDER_LITTLE_ENDIAN__
+            if(__builtin_cpu_supports("avx2")) {
+                done=convert_avx2(in, out, count);
+            }else if(__builtin_cpu_supports("ssse3")) {
+                done=convert_ssse3(in, out, count);
+            }
+#endif
+            convert_scalar(in+done*n64::instruction::WIDTH, out+done, count-done);
+        }
+
+        /**
+         * convert raw image
+         * @param file file name (for error message)
+         * @param data image
+         * @param size image size in bytes
+         * @return instructions
+         */
+        std::vector<n64::instruction::instruction> load_code(const std::string& file, const std::uint8_t *data, std::size_t size) {
+            if(size%n64::instruction::WIDTH!=0) {
+                throw std::runtime_error(file+": truncated binary ("+std::to_string(size)
+                                         +" bytes is not a multiple of "+std::to_string(n64::instruction::WIDTH)+")");
+            }
+
+            std::vector<n64::instruction::instruction> instructions(size/n64::instruction::WIDTH);
+            convert(data, instructions.data(), instructions.size());
+            return instructions;
+        }
+
+        /**
+         * checksum of container body (FNV-1a over 64bit words)
+         * @param data body
+         * @param size body size (multiple of 8)
+         * @return checksum
+         */
+        std::uint64_t checksum(const std::uint8_t *data, std::size_t size) {
+            std::uint64_t hash=0xcbf29ce484222325ULL;
+            for(std::size_t i=0; i+sizeof(std::uint64_t)<=size; i+=sizeof(std::uint64_t)) {
+                std::uint64_t word;
+                std::memcpy(&word, data+i, sizeof(word));
+                hash=(hash ^ boost::endian::little_to_native(word))*0x100000001b3ULL;
+            }
+            return hash;
+        }
+
+        template<typename T>
+        T read_big(const std::uint8_t *data) {
+            T value;
+            std::memcpy(&value, data, sizeof(value));
+            return boost::endian::big_to_native(value);
+        }
+
+        template<typename T>
+        void write_big(std::vector<std::uint8_t>& out, std::size_t offset, T value) {
+            value=boost::endian::native_to_big(value);
+            std::memcpy(out.data()+offset, &value, sizeof(value));
+        }
+    } /* anonymous */
+
     /**
      * load from binary file.
+     * the file is mapped and converted in one pass into an output sized once.
      * @param file input file name
      * @return instructions in the input file
+     * @throw std::system_error file cannot be opened
+     * @throw std::runtime_error file size is not a multiple of instruction width
      */
     std::vector<n64::instruction::instruction> load_binary(const std::string& file) {
-        std::fstream fin(file, std::ios::in | std::ios::binary);
+        mapped_file image(file);
+        return load_code(file, image.data(), image.size());
+    }
+
+    namespace {
+        /**
+         * check magic of image
+         * @param data image
+         * @param size image size in bytes
+         * @param magic magic
+         * @return image starts with magic
+         */
+        bool has_magic(const std::uint8_t *data, std::size_t size, const char (&magic)[8]) {
+            return size>=sizeof(magic) && std::memcmp(data, magic, sizeof(magic))==0;
+        }
+
+        /**
+         * parse container (executable or object) after magic was checked
+         * @param file file name (for error message)
+         * @param data image
+         * @param size image size in bytes
+         * @return program
+         */
+        n64::program load_container(const std::string& file, const std::uint8_t *data, std::size_t size) {
+            namespace nb=n64::binary;
+
+            n64::program p;
+            const auto corrupted=[&file](const std::string& reason) {
+                return std::runtime_error(file+": corrupted container ("+reason+")");
+            };
+            if(size<nb::HEADER_SIZE || size%sizeof(std::uint64_t)!=0)throw corrupted("truncated");
+
+            const auto version=read_big<std::uint32_t>(data+8);
+            if(version!=nb::VERSION) {
+                throw std::runtime_error(file+": unsupported container version "+std::to_string(version));
+            }
+            const auto count=read_big<std::uint32_t>(data+12);
+            p.entry=read_big<std::uint64_t>(data+16);
+            const auto sum=read_big<std::uint64_t>(data+24);
+            const auto table=read_big<std::uint64_t>(data+32);
+
+            if(table<nb::HEADER_SIZE || table>size || (size-table)/nb::SECTION_ENTRY_SIZE<count)throw corrupted("section table");
+            if(checksum(data+nb::HEADER_SIZE, size-nb::HEADER_SIZE)!=sum)throw corrupted("checksum mismatch");
+
+            for(std::uint32_t i=0; i<count; ++i) {
+                const auto *entry=data+table+i*nb::SECTION_ENTRY_SIZE;
+                const auto type=static_cast<nb::section_type>(read_big<std::uint32_t>(entry));
+                const auto offset=read_big<std::uint64_t>(entry+8);
+                const auto file_size=read_big<std::uint64_t>(entry+16);
+                const auto address=read_big<std::uint64_t>(entry+24);
+                const auto memory_size=read_big<std::uint64_t>(entry+32);
+                if(offset>size || file_size>size-offset)throw corrupted("section "+std::to_string(i)+" is out of file");
 
-        std::vector<n64::instruction::instruction> instructions;
+                switch(type) {
+                    case nb::section_type::code:
+                        p.code=load_code(file, data+offset, file_size);
+                        break;
+                    case nb::section_type::rodata:
+                        if(offset%nb::SECTION_ALIGN!=0 || address%nb::SECTION_ALIGN!=0)throw corrupted("unaligned read-only data");
+                        p.rodata_offset=offset;
+                        p.rodata_size=file_size;
+                        p.rodata_address=address;
+                        break;
+                    case nb::section_type::bss:
+                        p.bss_address=address;
+                        p.bss_size=memory_size;
+                        break;
+                    case nb::section_type::symbols:
+                        for(std::uint64_t at=0; at+12<=file_size;) {
+                            const auto symbol_address=read_big<std::uint64_t>(data+offset+at);
+                            const auto length=read_big<std::uint32_t>(data+offset+at+8);
+                            at+=12;
+                            if(length>file_size-at)throw corrupted("symbol name");
+                            p.symbols.push_back({std::string(reinterpret_cast<const char*>(data+offset+at), length), symbol_address});
+                            at+=length;
+                        }
+                        break;
+                    case nb::section_type::relocations: {
+                        if(file_size<8)throw corrupted("relocations");
+                        const auto names=read_big<std::uint64_t>(data+offset);
+                        std::vector<std::string> name(static_cast<std::size_t>(std::min<std::uint64_t>(names, file_size/4)));
+                        if(name.size()!=names)throw corrupted("relocation names");
+                        std::uint64_t at=8;
+                        for(auto& n : name) {
+                            if(at+4>file_size)throw corrupted("relocation names");
+                            const auto length=read_big<std::uint32_t>(data+offset+at);
+                            at+=4;
+                            if(length>file_size-at)throw corrupted("relocation names");
+                            n.assign(reinterpret_cast<const char*>(data+offset+at), length);
+                            at+=length;
+                        }
+                        for(at=(at+7)/8*8; at+16<=file_size; at+=16) {
+                            const auto index=read_big<std::uint64_t>(data+offset+at+8);
+                            if(index>=name.size())throw corrupted("relocation name index");
+                            p.relocations.push_back({read_big<std::uint64_t>(data+offset+at), name[static_cast<std::size_t>(index)]});
+                        }
+                    }
+                        break;
+                    case nb::section_type::lines: {
+                        if(file_size<4)throw corrupted("line table");
+                        const auto length=read_big<std::uint32_t>(data+offset);
+                        if(length>file_size-4)throw corrupted("line table source name");
+                        p.source.assign(reinterpret_cast<const char*>(data+offset+4), length);
+                        for(auto at=(std::uint64_t(4)+length+7)/8*8; at+16<=file_size; at+=16) {
+                            p.lines.push_back({read_big<std::uint64_t>(data+offset+at), read_big<std::uint64_t>(data+offset+at+8)});
+                        }
+                    }
+                        break;
+                    default:
+                        // unknown sections are skipped, so newer minor additions stay loadable
+                        break;
+                }
+            }
+            return p;
+        }
+    } /* anonymous */
 
-        while(!fin.eof()) {
-            n64::instruction::instruction ins={};
-            fin.read(reinterpret_cast<char*>(&ins), n64::instruction::WIDTH);
-            ins.data=boost::endian::big_to_native(ins.data);
-            instructions.emplace_back(ins);
+    /**
+     * load container or raw image
+     * @param file input file name
+     * @return program (raw image: code only, entry 0)
+     */
+    n64::program load_program(const std::string& file) {
+        mapped_file image(file);
+        if(has_magic(image.data(), image.size(), n64::binary::OBJECT_MAGIC)) {
+            throw std::runtime_error(file+": object file (link it with n64ld)");
+        }
+        if(!has_magic(image.data(), image.size(), n64::binary::MAGIC)) {
+            n64::program p;
+            p.code=load_code(file, image.data(), image.size());
+            return p;
         }
-        return instructions;
+        return load_container(file, image.data(), image.size());
+    }
+
+    /**
+     * load object file
+     * @param file input file name
+     * @return object (addresses relative to start of object)
+     */
+    n64::program load_object(const std::string& file) {
+        mapped_file image(file);
+        if(!has_magic(image.data(), image.size(), n64::binary::OBJECT_MAGIC)) {
+            throw std::runtime_error(file+": not an object file");
+        }
+        return load_container(file, image.data(), image.size());
+    }
+
+    namespace {
+        /**
+         * save container (executable or object)
+         * @param file output file name
+         * @param p program
+         * @param magic magic
+         * @throw std::system_error file cannot be written
+         */
+        void save_container(const std::string& file, const n64::program& p, const char (&magic)[8]) {
+            namespace nb=n64::binary;
+
+            struct section {
+                nb::section_type type;
+                std::vector<std::uint8_t> data;
+                std::uint64_t address, memory_size;
+            };
+            std::vector<section> sections;
+
+            /* code */ {
+                section code={nb::section_type::code, std::vector<std::uint8_t>(p.code.size()*n64::instruction::WIDTH), 0, 0};
+                for(std::size_t i=0; i<p.code.size(); ++i) {
+                    write_big<std::uint64_t>(code.data, i*n64::instruction::WIDTH, p.code[i].data);
+                }
+                code.memory_size=code.data.size();
+                sections.emplace_back(std::move(code));
+            }
+            if(!p.rodata.empty()) {
+                sections.push_back({nb::section_type::rodata, p.rodata, p.rodata_address, p.rodata.size()});
+            }
+            if(p.bss_size>0) {
+                sections.push_back({nb::section_type::bss, {}, p.bss_address, p.bss_size});
+            }
+            if(!p.symbols.empty()) {
+                section symbols={nb::section_type::symbols, {}, 0, 0};
+                for(const auto& sym : p.symbols) {
+                    const auto at=symbols.data.size();
+                    symbols.data.resize(at+12+sym.name.size());
+                    write_big<std::uint64_t>(symbols.data, at, sym.address);
+                    write_big<std::uint32_t>(symbols.data, at+8, static_cast<std::uint32_t>(sym.name.size()));
+                    std::memcpy(symbols.data.data()+at+12, sym.name.data(), sym.name.size());
+                }
+                symbols.memory_size=symbols.data.size();
+                sections.emplace_back(std::move(symbols));
+            }
+
+            const auto align=[](std::size_t value, std::size_t alignment) {
+                return (value+alignment-1)/alignment*alignment;
+            };
+
+            if(!p.lines.empty()) {
+                section lines={nb::section_type::lines, std::vector<std::uint8_t>(align(4+p.source.size(), 8)), 0, 0};
+                write_big<std::uint32_t>(lines.data, 0, static_cast<std::uint32_t>(p.source.size()));
+                std::memcpy(lines.data.data()+4, p.source.data(), p.source.size());
+                for(const auto& l : p.lines) {
+                    const auto at=lines.data.size();
+                    lines.data.resize(at+16);
+                    write_big<std::uint64_t>(lines.data, at, l.address);
+                    write_big<std::uint64_t>(lines.data, at+8, l.line);
+                }
+                lines.memory_size=lines.data.size();
+                sections.emplace_back(std::move(lines));
+            }
+
+            if(!p.relocations.empty()) {
+                // every name is stored once, entries refer to it by index
+                std::unordered_map<std::string, std::uint64_t> index;
+                std::vector<const std::string*> names;
+                for(const auto& r : p.relocations) {
+                    if(index.emplace(r.symbol, names.size()).second) {
+                        names.push_back(&r.symbol);
+                    }
+                }
+                section relocations={nb::section_type::relocations, std::vector<std::uint8_t>(8), 0, 0};
+                write_big<std::uint64_t>(relocations.data, 0, names.size());
+                for(const auto *name : names) {
+                    const auto at=relocations.data.size();
+                    relocations.data.resize(at+4+name->size());
+                    write_big<std::uint32_t>(relocations.data, at, static_cast<std::uint32_t>(name->size()));
+                    std::memcpy(relocations.data.data()+at+4, name->data(), name->size());
+                }
+                relocations.data.resize(align(relocations.data.size(), 8));
+                for(const auto& r : p.relocations) {
+                    const auto at=relocations.data.size();
+                    relocations.data.resize(at+16);
+                    write_big<std::uint64_t>(relocations.data, at, r.address);
+                    write_big<std::uint64_t>(relocations.data, at+8, index[r.symbol]);
+                }
+                relocations.memory_size=relocations.data.size();
+                sections.emplace_back(std::move(relocations));
+            }
+
+            std::vector<std::uint8_t> out(nb::HEADER_SIZE+sections.size()*nb::SECTION_ENTRY_SIZE);
+            for(std::size_t i=0; i<sections.size(); ++i) {
+                const auto& s=sections[i];
+                const auto offset=align(out.size(), nb::SECTION_ALIGN);
+                out.resize(offset);
+                out.insert(std::end(out), std::begin(s.data), std::end(s.data));
+
+                const auto entry=nb::HEADER_SIZE+i*nb::SECTION_ENTRY_SIZE;
+                write_big<std::uint32_t>(out, entry, static_cast<std::uint32_t>(s.type));
+                write_big<std::uint64_t>(out, entry+8, offset);
+                write_big<std::uint64_t>(out, entry+16, s.data.size());
+                write_big<std::uint64_t>(out, entry+24, s.address);
+                write_big<std::uint64_t>(out, entry+32, s.memory_size);
+            }
+            out.resize(align(out.size(), sizeof(std::uint64_t)));
+
+            std::memcpy(out.data(), magic, sizeof(nb::MAGIC));
+            write_big<std::uint32_t>(out, 8, nb::VERSION);
+            write_big<std::uint32_t>(out, 12, static_cast<std::uint32_t>(sections.size()));
+            write_big<std::uint64_t>(out, 16, p.entry);
+            write_big<std::uint64_t>(out, 32, nb::HEADER_SIZE);
+            write_big<std::uint64_t>(out, 24, checksum(out.data()+nb::HEADER_SIZE, out.size()-nb::HEADER_SIZE));
+
+            errno=0;
+            std::ofstream fout(file, std::ios::out | std::ios::binary);
+            fout.write(reinterpret_cast<const char*>(out.data()), static_cast<std::streamsize>(out.size()));
+            fout.close();
+            if(!fout) {
+                throw std::system_error(errno!=0 ? errno : EIO, std::generic_category(), file);
+            }
+        }
+    } /* anonymous */
+
+    /**
+     * save program as container
+     * @param file output file name
+     * @param p program
+     * @throw std::system_error file cannot be written
+     */
+    void save_program(const std::string& file, const n64::program& p) {
+        save_container(file, p, n64::binary::MAGIC);
+    }
+
+    /**
+     * save program as object file
+     * @param file output file name
+     * @param p object (addresses relative to start of object)
+     * @throw std::system_error file cannot be written
+     */
+    void save_object(const std::string& file, const n64::program& p) {
+        save_container(file, p, n64::binary::OBJECT_MAGIC);
     }
 
     /**
      * save to binary file.
      * @param file output file name
      * @param instructions instructions
+     * @throw std::system_error file cannot be written
      */
     void save_binary(const std::string& file, const std::vector<n64::instruction::instruction>& instructions) {
+        errno=0;
         std::fstream fout(file, std::ios::out | std::ios::binary);
 
         for(const auto& ins : instructions) {
             std::uint64_t be=boost::endian::native_to_big(ins.data);
             fout.write(reinterpret_cast<const char*>(&be), n64::instruction::WIDTH);
         }
+        fout.close();
+        if(!fout) {
+            throw std::system_error(errno!=0 ? errno : EIO, std::generic_category(), file);
+        }
     }
 } /* n64 */
@@ -0,0 +1,149 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef N64_EMU_BINARY_HPP
+#define N64_EMU_BINARY_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <string>
+
+#include "instruction.hpp"
+
+/*
+ * N64 container format (all integers are big-endian)
+ *
+ * header (64 bytes)
+ *   0  magic "\x7fN64EXE\n"
+ *   8  u32 version
+ *  12  u32 section count
+ *  16  u64 entry IP
+ *  24  u64 checksum of every byte after header
+ *  32  u64 section table offset
+ *  40  reserved (0)
+ * section table entry (40 bytes)
+ *   0  u32 type (section_type)
+ *   4  u32 reserved (0)
+ *   8  u64 file offset (SECTION_ALIGN aligned)
+ *  16  u64 file size
+ *  24  u64 guest address (rodata, bss)
+ *  32  u64 memory size
+ * symbols section: {u64 address, u32 name length, name} repeated
+ * lines section: u32 source name length, source name, zero padding to 8 bytes, {u64 address, u64 line} repeated
+ *   entries are sorted by address, an entry covers addresses up to next entry (line grows by 1 per address)
+ * relocations section (object files only): u64 name count, {u32 length, name} repeated, zero padding to 8 bytes,
+ *   {u64 address, u64 name index} repeated (unary immediate of instruction at address receives address of name)
+ *
+ * object files have magic "\x7fN64OBJ\n" and the same layout, addresses are relative to start of the object.
+ * labels starting with '.' are local to their object, other labels are exported.
+ */
+
+namespace n64 {
+    namespace binary {
+        constexpr char MAGIC[8]={'\x7f', 'N', '6', '4', 'E', 'X', 'E', '\n'};
+        constexpr char OBJECT_MAGIC[8]={'\x7f', 'N', '6', '4', 'O', 'B', 'J', '\n'};
+        constexpr std::uint32_t VERSION=1;
+        constexpr std::size_t HEADER_SIZE=64, SECTION_ENTRY_SIZE=40, SECTION_ALIGN=4096;
+
+        /**
+         * section kind
+         */
+        enum class section_type : std::uint32_t {
+            code=1, rodata=2, bss=3, symbols=4, lines=5, relocations=6
+        };
+    } /* binary */
+
+    /**
+     * named address
+     */
+    struct symbol {
+        std::string name;
+        std::uint64_t address;
+    };
+
+    /**
+     * first address of run of instructions on consecutive source lines
+     */
+    struct source_line {
+        std::uint64_t address;
+        std::uint64_t line;     // source line of address (1 origin)
+    };
+
+    /**
+     * label operand resolved by linker
+     */
+    struct relocation {
+        std::uint64_t address;      // instruction whose unary immediate is the label address
+        std::string symbol;
+    };
+
+    /**
+     * program loaded from (or saved to) file
+     */
+    struct program {
+        std::vector<n64::instruction::instruction> code;
+        std::uint64_t entry=0;                  // first IP
+
+        std::vector<std::uint8_t> rodata;       // read-only data to save (load_program leaves it empty)
+        std::uint64_t rodata_address=0;         // guest address of read-only data (page aligned)
+        std::uint64_t rodata_offset=0;          // file offset of read-only data (load_program)
+        std::uint64_t rodata_size=0;            // read-only data size (load_program)
+        std::uint64_t bss_address=0;            // guest address of zero-initialized data
+        std::uint64_t bss_size=0;
+
+        std::vector<n64::symbol> symbols;
+        std::string source;                     // source file name of line table
+        std::vector<n64::source_line> lines;    // address -> source line runs (ascending addresses)
+
+        std::vector<n64::relocation> relocations;   // object only: every label operand (ascending addresses)
+    };
+
+    /**
+     * load container or raw image
+     * @param file input file name
+     * @return program (raw image: code only, entry 0)
+     * @throw std::system_error file cannot be opened
+     * @throw std::runtime_error file is truncated, corrupted or an object file
+     */
+    n64::program load_program(const std::string& file);
+
+    /**
+     * save program as container
+     * @param file output file name
+     * @param p program
+     * @throw std::system_error file cannot be written
+     */
+    void save_program(const std::string& file, const n64::program& p);
+
+    /**
+     * load object file
+     * @param file input file name
+     * @return object (addresses relative to start of object)
+     * @throw std::system_error file cannot be opened
+     * @throw std::runtime_error file is not an object file, or is truncated or corrupted
+     */
+    n64::program load_object(const std::string& file);
+
+    /**
+     * save program as object file
+     * @param file output file name
+     * @param p object (addresses relative to start of object)
+     * @throw std::system_error file cannot be written
+     */
+    void save_object(const std::string& file, const n64::program& p);
+} /* n64 */
+
+#endif //N64_EMU_BINARY_HPP
@@ -0,0 +1,145 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <algorithm>
+
+#include "block_cache.hpp"
+
+
+namespace n64 {
+    /**
+     * find or translate block
+     * @param entry entry address (must be in program)
+     * @return block
+     */
+    basic_block *block_cache::lookup(std::uint64_t entry) {
+        auto itr=_blocks.find(entry);
+        if(itr!=std::end(_blocks)) {
+            return itr->second.get();
+        }
+        return _blocks.emplace(entry, _translate(entry)).first->second.get();
+    }
+
+    /**
+     * chain block to successor
+     * @param from predecessor block
+     * @param slot successor slot
+     * @param to successor block
+     */
+    void block_cache::link(basic_block *from, std::size_t slot, basic_block *to) {
+        auto& old=from->successor[slot];
+        if(old==to || from->retired)return;
+        if(old!=nullptr) {
+            auto& in=old->incoming;
+            in.erase(std::remove(std::begin(in), std::end(in), &old), std::end(in));
+        }
+        old=to;
+        to->incoming.emplace_back(&old);
+    }
+
+    /**
+     * invalidate all blocks overlapping [first, last].
+     * @param first first instruction address
+     * @param last last instruction address
+     */
+    void block_cache::invalidate(std::uint64_t first, std::uint64_t last) {
+        for(auto itr=std::begin(_blocks); itr!=std::end(_blocks);) {
+            auto& b=itr->second;
+            if(b->entry<=last && first<b->end) {
+                _unlink(b.get());
+                b->retired=true;
+                _retired.emplace_back(std::move(b));
+                itr=_blocks.erase(itr);
+            }else{
+                ++itr;
+            }
+        }
+    }
+
+    /**
+     * invalidate all blocks
+     */
+    void block_cache::flush() {
+        for(auto& b : _blocks) {
+            _retired.emplace_back(std::move(b.second));
+        }
+        _blocks.clear();
+        for(auto& b : _retired) {
+            std::fill(std::begin(b->successor), std::end(b->successor), nullptr);
+            b->incoming.clear();
+            b->retired=true;
+        }
+    }
+
+    /**
+     * translate block
+     * @param entry entry address
+     * @return translated block
+     */
+    std::unique_ptr<basic_block> block_cache::_translate(std::uint64_t entry)const {
+        auto b=std::make_unique<basic_block>();
+        b->entry=entry;
+        b->retired=false;
+        b->native=nullptr;
+        b->compiled=false;
+        b->executions=0;
+        std::fill(std::begin(b->successor), std::end(b->successor), nullptr);
+
+        n64::decoder::operation exit={};
+        exit.code=n64::decoder::opcode::exit;
+        if(_translation!=nullptr) {
+            // fused pairs never cross block boundaries, so slice of fused program equals fused block
+            const auto *operations=_translation->operations();
+            b->end=_translation->block_end(entry);
+            b->operations.assign(operations+entry, operations+b->end);
+            b->operations.emplace_back(exit);
+        }else{
+            auto ip=entry;
+            while(ip<_instructions.size()) {
+                auto op=n64::decoder::decode(_instructions[ip++]);
+                b->operations.emplace_back(op);
+                if(n64::decoder::is_terminator(op.code))break;
+            }
+            b->end=ip;
+
+            b->operations.emplace_back(exit);
+            n64::decoder::fuse(b->operations, _zero);
+        }
+
+        for(auto& op : b->operations) {
+            op.handler=_handlers[static_cast<std::size_t>(op.code)];
+        }
+        return b;
+    }
+
+    /**
+     * remove all links from and to block
+     * @param b block
+     */
+    void block_cache::_unlink(basic_block *b)noexcept {
+        for(auto slot : b->incoming) {
+            *slot=nullptr;
+        }
+        b->incoming.clear();
+
+        for(auto& s : b->successor) {
+            if(s!=nullptr) {
+                auto& in=s->incoming;
+                in.erase(std::remove(std::begin(in), std::end(in), &s), std::end(in));
+                s=nullptr;
+            }
+        }
+    }
+} /* n64 */
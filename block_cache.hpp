@@ -0,0 +1,176 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef N64_EMU_BLOCK_CACHE_HPP
+#define N64_EMU_BLOCK_CACHE_HPP
+
+#include <cstdint>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+
+#include "instruction.hpp"
+#include "decoder.hpp"
+#include "translation_cache.hpp"
+
+namespace n64 {
+    namespace jit {
+        struct context;
+    } /* jit */
+
+    /**
+     * translated basic block.
+     * runs from entry to the first control transfer (or the end of program).
+     */
+    struct basic_block {
+        static constexpr std::size_t FALL_THROUGH=0, TAKEN=1, INDIRECT=2, SUCCESSORS=3;
+        using native_code=std::uint64_t (*)(n64::jit::context *ctx);
+
+        std::uint64_t entry;    // first instruction address
+        std::uint64_t end;      // one past the last instruction address
+        std::vector<n64::decoder::operation> operations;    // translated operations and a trailing exit operation
+
+        basic_block *successor[SUCCESSORS]; // chained blocks (nullptr: not linked yet)
+        std::vector<basic_block**> incoming;    // successor slots of other blocks which point this block
+        bool retired;           // invalidated, never linked again
+
+        native_code native;     // JIT translation (nullptr: not translated)
+        bool compiled;          // JIT translation was attempted
+
+        std::uint64_t executions;   // entries counted by tiered engine
+
+        /**
+         * guest address of operation
+         * @param op operation in this block
+         * @return instruction address
+         */
+        std::uint64_t address(const n64::decoder::operation *op)const noexcept {
+            return entry+static_cast<std::uint64_t>(op-operations.data());
+        }
+    };
+
+    /**
+     * basic block translation cache keyed by entry address
+     * remove: copy & move constructors and copy & move assign operators.
+     */
+    class block_cache {
+    private:
+        const std::vector<n64::instruction::instruction>& _instructions;
+        const void *const *_handlers;
+        bool _zero;     // r0 is never written (decoder::fuse)
+        const n64::translation *_translation;   // whole-program translation to slice blocks from (nullptr: decode)
+
+        std::unordered_map<std::uint64_t, std::unique_ptr<basic_block>> _blocks;
+        std::vector<std::unique_ptr<basic_block>> _retired;
+
+    public:
+        block_cache()=delete;
+        explicit block_cache(const std::vector<n64::instruction::instruction>& instructions)
+                : _instructions(instructions), _handlers(nullptr),
+                  _zero(n64::decoder::is_zero_register_constant(instructions)), _translation(nullptr) {}
+        block_cache(const block_cache&)=delete;
+        block_cache(block_cache&&)=delete;
+
+        block_cache& operator=(const block_cache&)=delete;
+        block_cache& operator=(block_cache&&)=delete;
+
+    public:
+        /**
+         * set engine handler table used to bind translated operations
+         * @param handlers handler table indexed by n64::decoder::opcode
+         */
+        void bind(const void *const *handlers)noexcept {
+            _handlers=handlers;
+        }
+
+        /**
+         * translate blocks by copying them out of predecoded program instead of decoding them
+         * @param t whole-program translation of same instructions (nullptr: decode)
+         */
+        void predecoded(const n64::translation *t)noexcept {
+            _translation=t;
+        }
+
+        /**
+         * find or translate block
+         * @param entry entry address (must be in program)
+         * @return block
+         */
+        basic_block *lookup(std::uint64_t entry);
+
+        /**
+         * find block without translating it
+         * @param entry entry address
+         * @return block (nullptr: not translated yet)
+         */
+        basic_block *find(std::uint64_t entry)const {
+            auto itr=_blocks.find(entry);
+            return itr!=std::end(_blocks) ? itr->second.get() : nullptr;
+        }
+
+        /**
+         * chain block to successor
+         * @param from predecessor block
+         * @param slot successor slot
+         * @param to successor block
+         */
+        void link(basic_block *from, std::size_t slot, basic_block *to);
+
+        /**
+         * invalidate all blocks overlapping [first, last].
+         * links to them are removed, so chained execution never enters them again.
+         * invalidated blocks are kept alive until collect(), so the running block stays valid.
+         * @param first first instruction address
+         * @param last last instruction address
+         */
+        void invalidate(std::uint64_t first, std::uint64_t last);
+
+        /**
+         * invalidate all blocks
+         */
+        void flush();
+
+        /**
+         * release invalidated blocks (call only when no block is running)
+         */
+        void collect()noexcept {
+            _retired.clear();
+        }
+
+        /**
+         * number of cached blocks
+         * @return block count
+         */
+        std::size_t size()const noexcept {
+            return _blocks.size();
+        }
+
+    private:
+        /**
+         * translate block
+         * @param entry entry address
+         * @return translated block
+         */
+        std::unique_ptr<basic_block> _translate(std::uint64_t entry)const;
+
+        /**
+         * remove all links from and to block
+         * @param b block
+         */
+        void _unlink(basic_block *b)noexcept;
+    };
+} /* n64 */
+
+#endif //N64_EMU_BLOCK_CACHE_HPP
@@ -0,0 +1,113 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <algorithm>
+
+#include "call_graph.hpp"
+
+namespace n64 {
+    /**
+     * @param entry entry address of program (root function)
+     * @param timed measure host time of every call path
+     */
+    call_graph::call_graph(std::uint64_t entry, bool timed)
+            : _nodes{{entry, 0, 0, 0, 0, 0}}, _current(0), _max_depth(0), _unmatched(0), _timed(timed),
+              _last(std::chrono::steady_clock::now()) {}
+
+    /**
+     * enter function
+     * @param function called address
+     * @param return_address address after call instruction
+     */
+    void call_graph::call(std::uint64_t function, std::uint64_t return_address) {
+        if(_timed)_charge();
+        _frames.push_back({_current, return_address});
+        _max_depth=std::max(_max_depth, _frames.size());
+
+        auto child=_nodes[_current].child;
+        while(child!=0 && _nodes[child].function!=function) {
+            child=_nodes[child].sibling;
+        }
+        if(child==0) {
+            child=_nodes.size();
+            _nodes.push_back({function, _current, 0, _nodes[_current].child, 0, 0});
+            _nodes[_current].child=child;
+        }
+        _current=child;
+    }
+
+    /**
+     * leave functions up to frame which returns to address
+     * @param address return address
+     */
+    void call_graph::ret(std::uint64_t address) {
+        auto itr=std::find_if(_frames.rbegin(), _frames.rend(), [address](const frame& f) {
+            return f.return_address==address;
+        });
+        if(itr==_frames.rend()) {
+            ++_unmatched;
+            return;
+        }
+        if(_timed)_charge();
+        _current=itr->node;
+        _frames.erase(std::next(itr).base(), std::end(_frames));
+    }
+
+    /**
+     * charge time since last call or return to current call path (timed only)
+     */
+    void call_graph::finish() {
+        if(_timed)_charge();
+    }
+
+    /**
+     * charge time since last call or return to current call path
+     */
+    void call_graph::_charge() {
+        const auto now=std::chrono::steady_clock::now();
+        _nodes[_current].nanoseconds+=static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now-_last).count());
+        _last=now;
+    }
+
+    /**
+     * collapsed stacks ("root;caller;callee weight" per line)
+     * @param symbols symbol table of program
+     * @param w weight
+     * @return collapsed stacks
+     */
+    std::string call_graph::collapsed(const n64::symbol_table& symbols, weight w)const {
+        // depth-first walk of calling context tree, path holds names from root to node
+        std::stringstream ss;
+        std::string path;
+        std::vector<std::pair<std::size_t, std::size_t>> pending={{0, 0}};     // node, path length of parent
+        while(!pending.empty()) {
+            const auto [index, length]=pending.back();
+            pending.pop_back();
+            const auto& n=_nodes[index];
+
+            path.resize(length);
+            if(length>0)path+=';';
+            path+=symbols.name(n.function);
+
+            const auto self=w==weight::time ? n.nanoseconds : n.instructions;
+            if(self>0)ss<<path<<" "<<self<<"\n";
+
+            for(auto child=n.child; child!=0; child=_nodes[child].sibling) {
+                pending.emplace_back(child, path.size());
+            }
+        }
+        return ss.str();
+    }
+} /* n64 */
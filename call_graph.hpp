@@ -0,0 +1,153 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef N64_EMU_CALL_GRAPH_HPP
+#define N64_EMU_CALL_GRAPH_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <string>
+#include <chrono>
+
+#include "symbol_table.hpp"
+
+namespace n64 {
+    /**
+     * guest call-graph profile.
+     * keeps a shadow call stack and a calling context tree (one node per distinct call path),
+     * executed instructions and host time are attributed to the node of the current path.
+     * remove: default constructor, copy & move constructors and copy & move assign operators.
+     */
+    class call_graph {
+    public:
+        /**
+         * weight of collapsed stacks
+         * instructions: executed guest instructions
+         * time: host nanoseconds
+         */
+        enum class weight {
+            instructions, time
+        };
+
+    private:
+        /**
+         * calling context tree node
+         */
+        struct node {
+            std::uint64_t function;         // entry address of function
+            std::size_t parent;
+            std::size_t child, sibling;     // first child and next sibling (0: none, root is never a child)
+            std::uint64_t instructions;     // self executed instructions
+            std::uint64_t nanoseconds;      // self host time (timed only)
+        };
+
+        /**
+         * shadow call stack entry
+         */
+        struct frame {
+            std::size_t node;
+            std::uint64_t return_address;
+        };
+
+        std::vector<node> _nodes;
+        std::vector<frame> _frames;
+        std::size_t _current;
+        std::size_t _max_depth;
+        std::uint64_t _unmatched;           // returns which matched no frame
+        bool _timed;
+        std::chrono::steady_clock::time_point _last;
+
+    public:
+        call_graph()=delete;
+        /**
+         * @param entry entry address of program (root function)
+         * @param timed measure host time of every call path
+         */
+        explicit call_graph(std::uint64_t entry, bool timed=false);
+        call_graph(const call_graph&)=delete;
+        call_graph(call_graph&&)=delete;
+
+        call_graph& operator=(const call_graph&)=delete;
+        call_graph& operator=(call_graph&&)=delete;
+
+    public:
+        /**
+         * count instruction of current call path
+         */
+        void executed()noexcept {
+            ++_nodes[_current].instructions;
+        }
+
+        /**
+         * enter function
+         * @param function called address
+         * @param return_address address after call instruction
+         */
+        void call(std::uint64_t function, std::uint64_t return_address);
+
+        /**
+         * leave functions up to frame which returns to address.
+         * returns which match no frame (e.g. stack was rewritten by program) leave the shadow stack as is.
+         * @param address return address
+         */
+        void ret(std::uint64_t address);
+
+        /**
+         * charge time since last call or return to current call path (timed only)
+         */
+        void finish();
+
+        /**
+         * collapsed stacks ("root;caller;callee weight" per line) for flame graph tools
+         * @param symbols symbol table of program (raw addresses without symbols)
+         * @param w weight
+         * @return collapsed stacks
+         */
+        std::string collapsed(const n64::symbol_table& symbols, weight w)const;
+
+        /**
+         * number of distinct call paths
+         * @return call paths
+         */
+        std::size_t paths()const noexcept {
+            return _nodes.size();
+        }
+
+        /**
+         * deepest shadow call stack
+         * @return depth
+         */
+        std::size_t max_depth()const noexcept {
+            return _max_depth;
+        }
+
+        /**
+         * returns which matched no frame
+         * @return unmatched returns
+         */
+        std::uint64_t unmatched()const noexcept {
+            return _unmatched;
+        }
+
+    private:
+        /**
+         * charge time since last call or return to current call path
+         */
+        void _charge();
+    };
+} /* n64 */
+
+#endif //N64_EMU_CALL_GRAPH_HPP
@@ -0,0 +1,429 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "decoder.hpp"
+
+
+namespace n64 {
+    namespace decoder {
+        namespace {
+            /**
+             * operation which is executed by the reference interpreter
+             * @param ins instruction
+             * @return generic operation
+             */
+            operation generic(const n64::instruction::instruction& ins) {
+                operation op={};
+                op.code=opcode::generic;
+                op.immediate=ins.data;
+                return op;
+            }
+
+            /**
+             * check register is instruction pointer
+             * threaded engines do not keep IP register up to date, so these instructions are generic.
+             * @param reg register number
+             * @return is instruction pointer
+             */
+            bool is_ip(unsigned reg) {
+                return reg==n64::reg::id::IP;
+            }
+
+            /**
+             * check instruction jumps through register or memory, or reads or writes IP
+             * @param ins instruction
+             * @return target is not known before execution
+             */
+            bool is_indirect(const n64::instruction::instruction& ins) {
+                const auto op=decode(ins);
+                if(op.code==opcode::call_register || op.code==opcode::jmp_register)return true;
+                if(op.code!=opcode::generic)return false;
+
+                switch(ins.instruction.type) {
+                    case n64::instruction::THREE_ADDRESS:
+                        return is_ip(ins.ta.destination) || is_ip(ins.ta.source1) || is_ip(ins.ta.source2);
+                    case n64::instruction::BINOMIAL:
+                        return is_ip(ins.b.operand1) || is_ip(ins.b.operand2);
+                    case n64::instruction::UNARY:
+                        if(ins.u.type!=0b11 && is_ip(ins.u.reg.operand))return true;
+                        // call, jmp, jr and j* through memory
+                        return ins.instruction.instruction>=0b00010 && ins.instruction.instruction<=0b01010;
+                    case n64::instruction::REGISTER_IMMEDIATE:
+                        return is_ip(ins.ri.reg);
+                    default:
+                        return false;
+                }
+            }
+
+            /**
+             * check written operand may change stack or sp
+             * @param pointer operand is pointer
+             * @param reg register number
+             * @return writes sp, or memory through sp or bp
+             */
+            bool is_stack_operand(bool pointer, unsigned reg) {
+                return reg==n64::reg::id::SP || (pointer && reg==n64::reg::id::BP);
+            }
+
+            /**
+             * check instruction may put a value other than a return address on stack
+             * @param ins instruction
+             * @return push, write to sp, or write through sp or bp pointer
+             */
+            bool writes_stack(const n64::instruction::instruction& ins) {
+                constexpr unsigned SP=n64::reg::id::SP;
+                const auto op=decode(ins);
+                switch(op.code) {
+                    case opcode::push:
+                    case opcode::push_immediate:
+                        return true;
+                    case opcode::xchg:
+                        return op.destination==SP || op.source1==SP;
+                    case opcode::generic:
+                        break;
+                    default:
+                        // call, ret and pop_discard move sp like a call does, others write destination register
+                        return !is_terminator(op.code) && op.code!=opcode::pop_discard && op.code!=opcode::cmp
+                               && op.code!=opcode::nop && op.destination==SP;
+                }
+
+                switch(ins.instruction.type) {
+                    case n64::instruction::THREE_ADDRESS:
+                        return is_stack_operand((ins.ta.type & 0b100)!=0, ins.ta.destination);
+                    case n64::instruction::BINOMIAL:
+                        switch(ins.instruction.instruction) {
+                            case 0b00000: // not
+                                return is_stack_operand((ins.b.type & 0b10)!=0, ins.b.operand1);
+                            case 0b00001: // xchg
+                                return is_stack_operand((ins.b.type & 0b10)!=0, ins.b.operand1)
+                                       || is_stack_operand((ins.b.type & 0b01)!=0, ins.b.operand2);
+                            default:
+                                return false;
+                        }
+                    case n64::instruction::UNARY:
+                        switch(ins.instruction.instruction) {
+                            case 0b01011: // push
+                                return true;
+                            case 0b00000: // inc
+                            case 0b00001: // dec
+                            case 0b01100: // pop
+                                return ins.u.type!=0b11 && is_stack_operand(ins.u.type==0b01, ins.u.reg.operand);
+                            default:
+                                return false;
+                        }
+                    case n64::instruction::REGISTER_IMMEDIATE:
+                        return ins.ri.reg==SP;
+                    default:
+                        return false;
+                }
+            }
+        } /* anonymous */
+
+        /**
+         * decode one instruction
+         * @param ins instruction
+         * @return decoded operation
+         */
+        operation decode(const n64::instruction::instruction& ins) {
+            operation op={};
+
+            switch(ins.instruction.type) {
+                case n64::instruction::THREE_ADDRESS:{
+                    static const opcode TA[]={
+                            opcode::add, opcode::sub, opcode::mul, opcode::div, opcode::shr,
+                            opcode::shl, opcode::and_, opcode::or_, opcode::xor_
+                    };
+                    // pointer operands access guest memory through the reference interpreter
+                    if(ins.instruction.instruction>=sizeof(TA)/sizeof(TA[0]) || ins.ta.type!=0
+                       || is_ip(ins.ta.destination) || is_ip(ins.ta.source1) || is_ip(ins.ta.source2)) {
+                        return generic(ins);
+                    }
+                    op.code=TA[ins.instruction.instruction];
+                    op.mode=ins.ta.type;
+                    op.destination=ins.ta.destination;
+                    op.source1=ins.ta.source1;
+                    op.source2=ins.ta.source2;
+                    op.option[0]=ins.ta.destination_option;
+                    op.option[1]=ins.ta.source1_option;
+                    op.option[2]=ins.ta.source2_option;
+                }
+                    break;
+                case n64::instruction::BINOMIAL:{
+                    static const opcode B[]={
+                            opcode::not_, opcode::xchg, opcode::cmp
+                    };
+                    if(ins.instruction.instruction>=sizeof(B)/sizeof(B[0]) || ins.b.type!=0
+                       || is_ip(ins.b.operand1) || is_ip(ins.b.operand2)) {
+                        return generic(ins);
+                    }
+                    op.code=B[ins.instruction.instruction];
+                    if(op.code==opcode::xchg && ins.b.operand1==ins.b.operand2) {
+                        // nop pseudo instruction (xchg r0,r0)
+                        op.code=opcode::nop;
+                    }
+                    op.mode=ins.b.type;
+                    op.destination=ins.b.operand1;
+                    op.source1=ins.b.operand2;
+                    op.option[0]=ins.b.operand1_option;
+                    op.option[1]=ins.b.operand2_option;
+                }
+                    break;
+                case n64::instruction::UNARY:{
+                    op.mode=ins.u.type;
+                    switch(ins.u.type) {
+                        case 0b00: // register
+                            if(is_ip(ins.u.reg.operand))return generic(ins);
+                            op.destination=ins.u.reg.operand;
+                            break;
+                        case 0b11: // immediate
+                            op.immediate=ins.u.imm.immediate;
+                            break;
+                        default:
+                            return generic(ins);
+                    }
+                    const bool imm=ins.u.type==0b11;
+
+                    switch(ins.instruction.instruction) {
+                        case 0b00000: // inc
+                            op.code=imm ? opcode::nop : opcode::inc;
+                            break;
+                        case 0b00001: // dec
+                            op.code=imm ? opcode::nop : opcode::dec;
+                            break;
+                        case 0b01011: // push
+                            op.code=imm ? opcode::push_immediate : opcode::push;
+                            break;
+                        case 0b01100: // pop
+                            op.code=imm ? opcode::pop_discard : opcode::pop;
+                            break;
+                        case 0b00010: // call
+                            op.code=imm ? opcode::call : opcode::call_register;
+                            break;
+                        case 0b00011: // jmp
+                        case 0b00100: // jr
+                            op.code=imm ? opcode::jmp : opcode::jmp_register;
+                            break;
+                        case 0b00101: // je
+                        case 0b00110: // jne
+                        case 0b00111: // ja
+                        case 0b01000: // jae
+                        case 0b01001: // jb
+                        case 0b01010: // jbe
+                            if(!imm)return generic(ins);
+                            op.code=static_cast<opcode>(
+                                    static_cast<unsigned>(opcode::je)+ins.instruction.instruction-0b00101);
+                            break;
+                        default:
+                            return generic(ins);
+                    }
+                }
+                    break;
+                case n64::instruction::NO_OPERAND:
+                    switch(ins.instruction.instruction) {
+                        case 0b00000: // hlt
+                            op.code=opcode::hlt;
+                            break;
+                        case 0b00001: // ret
+                            op.code=opcode::ret;
+                            break;
+                        default:
+                            return generic(ins);
+                    }
+                    break;
+                case n64::instruction::REGISTER_IMMEDIATE:{
+                    static const opcode RI[]={
+                            opcode::asgn, opcode::asgnh, opcode::asgnl
+                    };
+                    if(ins.instruction.instruction>=sizeof(RI)/sizeof(RI[0]) || is_ip(ins.ri.reg)) {
+                        return generic(ins);
+                    }
+                    op.code=RI[ins.instruction.instruction];
+                    op.destination=ins.ri.reg;
+                    op.immediate=ins.ri.immediate;
+                }
+                    break;
+                default:
+                    return generic(ins);
+            }
+            return op;
+        }
+
+        /**
+         * decode all instructions.
+         * the result has one operation per instruction and a trailing exit operation.
+         * @param instructions instructions
+         * @return decoded operations
+         */
+        std::vector<operation> predecode(const std::vector<n64::instruction::instruction>& instructions) {
+            std::vector<operation> operations;
+            operations.reserve(instructions.size()+1);
+
+            for(const auto& ins : instructions) {
+                operations.emplace_back(decode(ins));
+            }
+
+            operation end={};
+            end.code=opcode::exit;
+            operations.emplace_back(end);
+
+            return operations;
+        }
+
+        /**
+         * check r0 keeps its initial value (zero) in the whole program
+         * @param instructions instructions
+         * @return no instruction may write r0
+         */
+        bool is_zero_register_constant(const std::vector<n64::instruction::instruction>& instructions) {
+            constexpr unsigned R0=n64::reg::id::R0;
+
+            for(const auto& ins : instructions) {
+                const auto op=decode(ins);
+                switch(op.code) {
+                    case opcode::add:
+                    case opcode::sub:
+                    case opcode::mul:
+                    case opcode::div:
+                    case opcode::shr:
+                    case opcode::shl:
+                    case opcode::and_:
+                    case opcode::or_:
+                    case opcode::xor_:
+                    case opcode::not_:
+                    case opcode::inc:
+                    case opcode::dec:
+                    case opcode::pop:
+                    case opcode::asgn:
+                    case opcode::asgnh:
+                    case opcode::asgnl:
+                        if(op.destination==R0)return false;
+                        break;
+                    case opcode::xchg:
+                        if(op.destination==R0 || op.source1==R0)return false;
+                        break;
+                    case opcode::generic:
+                        return false;
+                    default:
+                        break;
+                }
+            }
+            return true;
+        }
+
+        /**
+         * fuse common operation pairs (cmp+jcc, asgnh+asgnl) and specialise mov.
+         * @param operations decoded operations of consecutive instructions
+         * @param zero r0 is always zero (is_zero_register_constant)
+         */
+        void fuse(std::vector<operation>& operations, bool zero) {
+            for(std::size_t i=0; i<operations.size(); ++i) {
+                auto& op=operations[i];
+                if(zero && op.code==opcode::add && op.source2==n64::reg::id::R0) {
+                    op.code=opcode::mov;
+                    continue;
+                }
+                if(i+1>=operations.size())break;
+
+                const auto& next=operations[i+1];
+                if(op.code==opcode::cmp && next.code>=opcode::je && next.code<=opcode::jbe) {
+                    op.code=static_cast<opcode>(
+                            static_cast<unsigned>(opcode::cmp_je)+static_cast<unsigned>(next.code)-static_cast<unsigned>(opcode::je));
+                    op.immediate=next.immediate;
+                }else if(((op.code==opcode::asgnh && next.code==opcode::asgnl) || (op.code==opcode::asgnl && next.code==opcode::asgnh))
+                         && op.destination==next.destination) {
+                    const auto high=op.code==opcode::asgnh ? op.immediate : next.immediate;
+                    const auto low=op.code==opcode::asgnl ? op.immediate : next.immediate;
+                    op.code=opcode::asgn_pair;
+                    op.immediate=((high & 0xffffffff) << 32) | (low & 0xffffffff);
+                }
+            }
+        }
+
+        /**
+         * check operation ends basic block
+         * @param code operation kind
+         * @return operation may transfer control
+         */
+        bool is_terminator(opcode code) {
+            switch(code) {
+                case opcode::call:
+                case opcode::call_register:
+                case opcode::jmp:
+                case opcode::jmp_register:
+                case opcode::je:
+                case opcode::jne:
+                case opcode::ja:
+                case opcode::jae:
+                case opcode::jb:
+                case opcode::jbe:
+                case opcode::cmp_je:
+                case opcode::cmp_jne:
+                case opcode::cmp_ja:
+                case opcode::cmp_jae:
+                case opcode::cmp_jb:
+                case opcode::cmp_jbe:
+                case opcode::hlt:
+                case opcode::ret:
+                case opcode::generic:
+                case opcode::exit:
+                    return true;
+                default:
+                    return false;
+            }
+        }
+
+        /**
+         * check operation jumps to immediate address
+         * @param op operation
+         * @return call, jmp (jr) or conditional jump to immediate
+         */
+        bool is_direct_jump(const operation& op)noexcept {
+            return op.code==opcode::call || op.code==opcode::jmp || (op.code>=opcode::je && op.code<=opcode::jbe);
+        }
+
+        /**
+         * first instruction which makes a jump target computed at run time.
+         * ret pops what call pushed only if nothing else is put on stack, so push; ret (the only
+         * computed jump of source programs) makes every ret computed.
+         * @param instructions instructions
+         * @return address (instructions.size(): every jump target is an immediate address)
+         */
+        std::uint64_t find_computed_jump(const std::vector<n64::instruction::instruction>& instructions) {
+            const auto size=instructions.size();
+            std::uint64_t stack=size;
+            bool returns=false;
+            for(std::size_t i=0; i<size; ++i) {
+                if(is_indirect(instructions[i]))return i;
+                if(decode(instructions[i]).code==opcode::ret)returns=true;
+                if(stack==size && writes_stack(instructions[i]))stack=i;
+            }
+            return returns ? stack : size;
+        }
+
+        /**
+         * operation name
+         * @param code operation kind
+         * @return name
+         */
+        const char *name(opcode code) {
+#define N64_DECODER_NAME(name) #name,
+            static const char *NAMES[]={
+                    N64_DECODER_OPCODES(N64_DECODER_NAME)
+            };
+#undef N64_DECODER_NAME
+            return NAMES[static_cast<std::size_t>(code)];
+        }
+    } /* decoder */
+} /* n64 */
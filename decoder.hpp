@@ -0,0 +1,136 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef N64_EMU_DECODER_HPP
+#define N64_EMU_DECODER_HPP
+
+#include <cstdint>
+#include <vector>
+#include <string>
+
+#include "instruction.hpp"
+
+/**
+ * decoded operation list.
+ * X(name) is expanded for every operation kind, in opcode order.
+ */
+#define N64_DECODER_OPCODES(X) \
+    X(add) X(sub) X(mul) X(div) X(shr) X(shl) X(and_) X(or_) X(xor_) \
+    X(not_) X(xchg) X(cmp) \
+    X(inc) X(dec) X(push) X(push_immediate) X(pop) X(pop_discard) \
+    X(call) X(call_register) X(jmp) X(jmp_register) \
+    X(je) X(jne) X(ja) X(jae) X(jb) X(jbe) \
+    X(hlt) X(ret) \
+    X(asgn) X(asgnh) X(asgnl) \
+    X(mov) X(cmp_je) X(cmp_jne) X(cmp_ja) X(cmp_jae) X(cmp_jb) X(cmp_jbe) X(asgn_pair) \
+    X(nop) X(generic) X(exit)
+
+namespace n64 {
+    namespace decoder {
+        constexpr std::uint64_t RI_LIMIT=std::uint64_t(1) << 49;    // asgn immediate range
+
+#define N64_DECODER_ENUM(name) name,
+        /**
+         * decoded operation kind
+         * mov: add d,s,r0 of a program which never writes r0 (plain copy)
+         * cmp_j*, asgn_pair: fused with the following operation, which is kept for jumps into the pair
+         * generic: run the raw instruction through the reference interpreter
+         * exit: sentinel placed one past the last instruction
+         */
+        enum class opcode : std::uint8_t {
+            N64_DECODER_OPCODES(N64_DECODER_ENUM)
+        };
+#undef N64_DECODER_ENUM
+
+        /**
+         * predecoded instruction.
+         * all bitfields are extracted so that engines never touch the packed encoding.
+         */
+        struct operation {
+            const void *handler;        // engine specific handler, bound by the engine
+            std::uint64_t immediate;    // immediate value, jump target or raw instruction (generic)
+            std::uint32_t option[3];    // operand options (destination/source1/source2)
+            opcode code;
+            std::uint8_t mode;          // operand type bits
+            std::uint8_t destination;   // TA: destination, B: operand1, U: operand, RI: register
+            std::uint8_t source1;       // TA: source1, B: operand2
+            std::uint8_t source2;       // TA: source2
+        };
+
+        /**
+         * decode one instruction
+         * @param ins instruction
+         * @return decoded operation
+         */
+        operation decode(const n64::instruction::instruction& ins);
+
+        /**
+         * decode all instructions.
+         * the result has one operation per instruction and a trailing exit operation.
+         * @param instructions instructions
+         * @return decoded operations
+         */
+        std::vector<operation> predecode(const std::vector<n64::instruction::instruction>& instructions);
+
+        /**
+         * check r0 keeps its initial value (zero) in the whole program
+         * @param instructions instructions
+         * @return no instruction may write r0
+         */
+        bool is_zero_register_constant(const std::vector<n64::instruction::instruction>& instructions);
+
+        /**
+         * fuse common operation pairs (cmp+jcc, asgnh+asgnl) and specialise mov.
+         * fused operation runs both operations and continues after the second one,
+         * so state at block boundaries is same as the reference interpreter.
+         * @param operations decoded operations of consecutive instructions
+         * @param zero r0 is always zero (is_zero_register_constant)
+         */
+        void fuse(std::vector<operation>& operations, bool zero);
+
+        /**
+         * check operation ends basic block
+         * @param code operation kind
+         * @return operation may transfer control
+         */
+        bool is_terminator(opcode code);
+
+        /**
+         * check operation jumps to immediate address
+         * @param op operation
+         * @return call, jmp (jr) or conditional jump to immediate
+         */
+        bool is_direct_jump(const operation& op)noexcept;
+
+        /**
+         * first instruction which makes a jump target computed at run time:
+         * jump through register or memory, IP operand, or, if program has ret, instruction which may put
+         * a value other than a return address on stack (push, write to sp, write through sp or bp pointer),
+         * so that ret may jump to a computed address
+         * @param instructions instructions
+         * @return address (instructions.size(): every jump target is an immediate address)
+         */
+        std::uint64_t find_computed_jump(const std::vector<n64::instruction::instruction>& instructions);
+
+        /**
+         * operation name
+         * @param code operation kind
+         * @return name
+         */
+        const char *name(opcode code);
+    } /* decoder */
+} /* n64 */
+
+#endif //N64_EMU_DECODER_HPP
@@ -0,0 +1,462 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <array>
+#include <vector>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <thread>
+
+#include "instruction.hpp"
+#include "disassembler.hpp"
+
+namespace n64 {
+    namespace {
+        constexpr std::size_t CHUNK=1<<16;         // instructions formatted by one thread at once
+        constexpr unsigned REGISTERS=n64::reg::id::BP+1;
+
+        /**
+         * decode table entry of opcode byte (type | instruction number << 3)
+         */
+        struct format_t {
+            std::string_view name;      // empty: undefined instruction
+            unsigned type;
+            bool jump;                  // operand is label (call, jmp, jr, j*)
+        };
+
+        /**
+         * decode table built from the instruction list of assembler
+         * @return entry of every opcode byte
+         */
+        const std::array<format_t, 256>& formats() {
+            static const auto table=[]() {
+                std::array<format_t, 256> t{};
+#define INSTRUCTION(name, type, number) \
+                t[n64::instruction::type | ((number) << 3)]={name, n64::instruction::type, \
+                        n64::instruction::type==n64::instruction::UNARY && (number)>=0b00010 && (number)<=0b01010};
+                N64_INSTRUCTIONS(INSTRUCTION)
+#undef INSTRUCTION
+                return t;
+            }();
+            return table;
+        }
+
+        /**
+         * register names of assembler
+         * @return name of every register number
+         */
+        const std::array<std::string, REGISTERS>& register_names() {
+            static const auto names=[]() {
+                namespace id=n64::reg::id;
+                std::array<std::string, REGISTERS> n;
+                n[id::R0]="r0";
+                for(unsigned i=0; i<32; ++i) {
+                    n[id::RS[i]]="rs"+std::to_string(i);
+                    n[id::RT[i]]="rt"+std::to_string(i);
+                }
+                n[id::IP]="ip";
+                n[id::FLAGS]="flags";
+                n[id::SP]="sp";
+                n[id::BP]="bp";
+                return n;
+            }();
+            return names;
+        }
+
+        /**
+         * append hexadecimal digits
+         * @param out output
+         * @param value value
+         */
+        void append_digits(std::string& out, std::uint64_t value) {
+            char digits[16];
+            int n=0;
+            do {
+                digits[n++]="0123456789abcdef"[value & 0xf];
+                value >>= 4;
+            }while(value!=0);
+            while(n>0) {
+                out+=digits[--n];
+            }
+        }
+
+        /**
+         * append immediate (0 or 0x hexadecimal)
+         * @param out output
+         * @param value value
+         */
+        void append_immediate(std::string& out, std::uint64_t value) {
+            if(value==0) {
+                out+='0';
+                return;
+            }
+            out+="0x";
+            append_digits(out, value);
+        }
+
+        /**
+         * append register or pointer operand
+         * @param out output
+         * @param reg register number
+         * @param option pointer offset
+         * @param pointer operand is [reg+option]
+         * @return assembler can write operand (named register, no offset without pointer)
+         */
+        bool append_operand(std::string& out, unsigned reg, std::uint64_t option, bool pointer) {
+            if(reg>=REGISTERS || (!pointer && option!=0))return false;
+            if(!pointer) {
+                out+=register_names()[reg];
+                return true;
+            }
+            out+='[';
+            out+=register_names()[reg];
+            if(option!=0) {
+                // assembler reads decimal offsets only
+                out+='+';
+                out+=std::to_string(option);
+            }
+            out+=']';
+            return true;
+        }
+
+        /**
+         * check symbol can be written as label (definition and jump operand)
+         * @param name symbol name
+         * @return assembler reads name back
+         */
+        bool is_label(const std::string& name) {
+            if(name.empty() || (name[0]>='0' && name[0]<='9'))return false;
+            return std::none_of(std::begin(name), std::end(name), [](char c) {
+                return c==':' || c==',' || c==';' || c==' ' || c=='\t' || c=='\n' || c=='\r' || c=='\v' || c=='\f'
+                       || (c>='A' && c<='Z');
+            });
+        }
+
+        /**
+         * labels of program: symbols and recovered jump targets
+         * remove: default constructor, copy & move constructors and copy & move assign operators.
+         */
+        class label_table {
+        private:
+            const n64::program& _p;
+            bool _object;
+            std::vector<std::pair<std::uint64_t, const std::string *>> _symbols;   // writable symbols by address
+            std::unordered_map<std::string_view, std::uint64_t> _defined;            // object: symbol -> address
+            std::vector<bool> _target;                                               // recovered label at address
+            std::uint64_t _recovered;
+            std::string _prefix;                                                     // of recovered labels
+
+        public:
+            label_table()=delete;
+
+            /**
+             * @param p program
+             * @param object p is object (labels come from relocations)
+             */
+            label_table(const n64::program& p, bool object) : _p(p), _object(object), _recovered(0), _prefix("l") {
+                const auto size=p.code.size();
+                // linked programs keep local symbols of every object, so names repeat.
+                // first definition keeps its name, other addresses get recovered labels
+                std::unordered_set<std::string_view> named;
+                for(const auto& s : p.symbols) {
+                    if(s.address<=size && is_label(s.name) && named.emplace(s.name).second)_symbols.emplace_back(s.address, &s.name);
+                    if(object)_defined.emplace(s.name, s.address);
+                }
+                std::stable_sort(std::begin(_symbols), std::end(_symbols),
+                                 [](const std::pair<std::uint64_t, const std::string *>& a, const std::pair<std::uint64_t, const std::string *>& b) {
+                                     return a.first<b.first;
+                                 });
+                if(object)return;
+
+                // recovered names must not collide with symbols
+                for(bool collision=true; collision;) {
+                    collision=std::any_of(std::begin(_symbols), std::end(_symbols), [this](const std::pair<std::uint64_t, const std::string *>& s) {
+                        const auto& name=*s.second;
+                        return name.size()>_prefix.size() && name.compare(0, _prefix.size(), _prefix)==0
+                               && std::all_of(std::begin(name)+static_cast<std::ptrdiff_t>(_prefix.size()), std::end(name), [](char c) {
+                                   return (c>='0' && c<='9') || (c>='a' && c<='f');
+                               });
+                    });
+                    if(collision)_prefix+='_';
+                }
+
+                const auto& table=formats();
+                _target.assign(size+1, false);
+                for(const auto& ins : p.code) {
+                    if(table[ins.data & 0xff].jump && ins.u.type==0b11 && ins.u.imm.immediate<=size) {
+                        _target[ins.u.imm.immediate]=true;
+                    }
+                }
+                if(p.entry<=size)_target[p.entry]=true;
+                for(const auto& s : _symbols) {
+                    _target[s.first]=false;
+                }
+                _recovered=static_cast<std::uint64_t>(std::count(std::begin(_target), std::end(_target), true));
+            }
+            label_table(const label_table&)=delete;
+            label_table(label_table&&)=delete;
+
+            label_table& operator=(const label_table&)=delete;
+            label_table& operator=(label_table&&)=delete;
+
+        public:
+            /**
+             * labels recovered from jump targets
+             * @return count
+             */
+            std::uint64_t recovered()const noexcept {
+                return _recovered;
+            }
+
+            /**
+             * first writable symbol at or after address
+             * @param address address
+             * @return index of symbol
+             */
+            std::size_t first_symbol(std::uint64_t address)const {
+                const auto itr=std::lower_bound(std::begin(_symbols), std::end(_symbols), address,
+                                                [](const std::pair<std::uint64_t, const std::string *>& s, std::uint64_t a) {
+                                                    return s.first<a;
+                                                });
+                return static_cast<std::size_t>(itr-std::begin(_symbols));
+            }
+
+            /**
+             * append label of address (executable)
+             * @param out output
+             * @param address labeled address
+             */
+            void append_label(std::string& out, std::uint64_t address)const {
+                const auto s=first_symbol(address);
+                if(s<_symbols.size() && _symbols[s].first==address) {
+                    out+=*_symbols[s].second;
+                }else{
+                    out+=_prefix;
+                    append_digits(out, address);
+                }
+            }
+
+            /**
+             * append label definitions of address
+             * @param out output
+             * @param address address
+             * @param symbol first symbol at or after address (updated)
+             */
+            void define(std::string& out, std::uint64_t address, std::size_t& symbol)const {
+                const bool target=!_object && _target[address];
+                if(!target && (symbol>=_symbols.size() || _symbols[symbol].first!=address))return;
+
+                if(address>0)out+='\n';
+                for(; symbol<_symbols.size() && _symbols[symbol].first==address; ++symbol) {
+                    out+=*_symbols[symbol].second;
+                    out+=":\n";
+                }
+                if(target) {
+                    out+=_prefix;
+                    append_digits(out, address);
+                    out+=":\n";
+                }
+            }
+
+            /**
+             * append operand of call, jmp or j*
+             * @param out output
+             * @param ins instruction (immediate operand)
+             * @param address instruction address
+             * @return assembler writes same immediate
+             */
+            bool append_target(std::string& out, const n64::instruction::instruction& ins, std::uint64_t address)const {
+                const std::uint64_t target=ins.u.imm.immediate;
+                if(!_object) {
+                    if(target<=_p.code.size()) {
+                        append_label(out, target);
+                    }else{
+                        append_immediate(out, target);
+                    }
+                    return true;
+                }
+
+                // object: label operands are relocations, undefined ones are 0 until linked
+                const auto itr=std::lower_bound(std::begin(_p.relocations), std::end(_p.relocations), address,
+                                                [](const n64::relocation& r, std::uint64_t a) {
+                                                    return r.address<a;
+                                                });
+                if(itr==std::end(_p.relocations) || itr->address!=address) {
+                    append_immediate(out, target);
+                    return true;
+                }
+                const auto defined=_defined.find(itr->symbol);
+                if(!is_label(itr->symbol) || target!=(defined==std::end(_defined) ? 0 : defined->second))return false;
+                out+=itr->symbol;
+                return true;
+            }
+        };
+
+        /**
+         * append instruction
+         * @param out output
+         * @param ins instruction
+         * @param address instruction address
+         * @param labels labels
+         * @return assembler writes same word (false: out is partially written)
+         */
+        bool append_instruction(std::string& out, const n64::instruction::instruction& ins, std::uint64_t address, const label_table& labels) {
+            constexpr unsigned R0=n64::reg::id::R0;
+            const auto& f=formats()[ins.data & 0xff];
+            if(f.name.empty())return false;
+
+            switch(f.type) {
+                case n64::instruction::THREE_ADDRESS:{
+                    const unsigned t=ins.ta.type;
+                    if(ins.ta._reserved!=0)return false;
+                    const bool mov=ins.instruction.instruction==0b00000 && ins.ta.source2==R0 && (t & 0b001)==0 && ins.ta.source2_option==0;
+                    out+=mov ? std::string_view("mov") : f.name;
+                    out+=' ';
+                    if(!append_operand(out, ins.ta.destination, ins.ta.destination_option, (t & 0b100)!=0))return false;
+                    out+=", ";
+                    if(!append_operand(out, ins.ta.source1, ins.ta.source1_option, (t & 0b010)!=0))return false;
+                    if(mov)return true;
+                    out+=", ";
+                    return append_operand(out, ins.ta.source2, ins.ta.source2_option, (t & 0b001)!=0);
+                }
+                case n64::instruction::BINOMIAL:{
+                    const unsigned t=ins.b.type;
+                    if(t==0 && ins.b.operand1==R0 && ins.b.operand2==R0 && ins.b.operand1_option==0 && ins.b.operand2_option==0
+                       && ins.instruction.instruction!=0b00000) {
+                        // nop (xchg r0,r0) and raise (cmp r0,r0)
+                        out+=ins.instruction.instruction==0b00001 ? "nop" : "raise";
+                        return true;
+                    }
+                    out+=f.name;
+                    out+=' ';
+                    if(!append_operand(out, ins.b.operand1, ins.b.operand1_option, (t & 0b10)!=0))return false;
+                    out+=", ";
+                    return append_operand(out, ins.b.operand2, ins.b.operand2_option, (t & 0b01)!=0);
+                }
+                case n64::instruction::UNARY:
+                    // operand union starts at next byte, assembler leaves bits after type zero
+                    if(((ins.data >> 10) & 0x3f)!=0)return false;
+                    out+=f.name;
+                    out+=' ';
+                    switch(ins.u.type) {
+                        case 0b11: // immediate
+                            if(f.jump)return labels.append_target(out, ins, address);
+                            append_immediate(out, ins.u.imm.immediate);
+                            return true;
+                        case 0b00: // register
+                        case 0b01: // pointer (assembler reads operand of call, jmp and j* as label)
+                            return !f.jump && append_operand(out, ins.u.reg.operand, ins.u.reg.operand_option, ins.u.type==0b01);
+                        default:
+                            return false;
+                    }
+                case n64::instruction::NO_OPERAND:
+                    if(ins.no._reserved!=0)return false;
+                    out+=f.name;
+                    return true;
+                case n64::instruction::REGISTER_IMMEDIATE:
+                    out+=f.name;
+                    out+=' ';
+                    if(!append_operand(out, ins.ri.reg, 0, false))return false;
+                    out+=", ";
+                    append_immediate(out, ins.ri.immediate);
+                    return true;
+                default:
+                    return false;
+            }
+        }
+
+        /**
+         * append instructions [first, last) with their labels
+         * @param out output
+         * @param p program
+         * @param first first address
+         * @param last end address
+         * @param labels labels
+         * @return words which no instruction encodes
+         */
+        std::uint64_t append_chunk(std::string& out, const n64::program& p, std::uint64_t first, std::uint64_t last,
+                                   const label_table& labels) {
+            std::uint64_t words=0;
+            auto symbol=labels.first_symbol(first);
+            for(auto a=first; a<last; ++a) {
+                labels.define(out, a, symbol);
+                const auto mark=out.size();
+                out+="    ";
+                if(!append_instruction(out, p.code[a], a, labels)) {
+                    out.resize(mark);
+                    out+="    word ";
+                    append_immediate(out, p.code[a].data);
+                    ++words;
+                }
+                out+='\n';
+            }
+            return words;
+        }
+    } /* anonymous */
+
+    /**
+     * write program as n64as source
+     * @param p program (executable, raw image or object)
+     * @param object p is object
+     * @param jobs formatting threads
+     * @param out output
+     * @return counts
+     */
+    n64::disassembly_report disassemble(const n64::program& p, bool object, std::size_t jobs, std::ostream& out) {
+        n64::disassembly_report report;
+        const label_table labels(p, object);
+        const std::uint64_t size=p.code.size();
+        report.instructions=size;
+        report.labels=labels.recovered();
+        if(!object && p.entry!=0 && p.entry<=size) {
+            labels.append_label(report.entry, p.entry);
+        }
+
+        // every round formats one chunk per thread, then writes them in address order
+        jobs=std::max<std::size_t>(1, jobs);
+        const auto chunks=(size+CHUNK-1)/CHUNK;
+        std::vector<std::string> buffers(jobs);
+        std::vector<std::uint64_t> words(jobs);
+        for(std::uint64_t round=0; round<chunks; round+=jobs) {
+            const auto count=std::min<std::uint64_t>(jobs, chunks-round);
+            const auto format=[&](std::size_t k) {
+                const auto first=(round+k)*CHUNK;
+                buffers[k].clear();
+                words[k]=append_chunk(buffers[k], p, first, std::min(size, first+CHUNK), labels);
+            };
+            std::vector<std::thread> threads;
+            for(std::size_t k=1; k<count; ++k) {
+                threads.emplace_back(format, k);
+            }
+            format(0);
+            for(auto& t : threads) {
+                t.join();
+            }
+            for(std::size_t k=0; k<count; ++k) {
+                out.write(buffers[k].data(), static_cast<std::streamsize>(buffers[k].size()));
+                report.words+=words[k];
+            }
+        }
+
+        // labels after last instruction
+        std::string tail;
+        auto symbol=labels.first_symbol(size);
+        labels.define(tail, size, symbol);
+        out.write(tail.data(), static_cast<std::streamsize>(tail.size()));
+        return report;
+    }
+} /* n64 */
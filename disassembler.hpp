@@ -0,0 +1,54 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef N64_EMU_DISASSEMBLER_HPP
+#define N64_EMU_DISASSEMBLER_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <ostream>
+
+#include "binary.hpp"
+
+namespace n64 {
+    /**
+     * what disassembler wrote
+     */
+    struct disassembly_report {
+        std::uint64_t instructions=0;   // instructions written
+        std::uint64_t words=0;          // of them, words which no instruction encodes (word pseudo-instruction)
+        std::uint64_t labels=0;         // labels recovered from jump targets (not in symbol table)
+        std::string entry;              // label of entry point (empty: entry is 0 or object)
+    };
+
+    /**
+     * write program as n64as source.
+     * instructions are decoded by one table indexed by opcode byte, built from N64_INSTRUCTIONS like the
+     * assembler instruction map, and written in chunks formatted by separate threads.
+     * executables get labels from symbol table (first symbol of each name) and from every call, jmp and j* target (l<hex address>),
+     * objects use relocation symbols for label operands and keep other jump targets as numbers.
+     * words which no instruction encodes are written with the word pseudo-instruction, so
+     * n64as (--object for objects) assembles the output to the same code.
+     * @param p program (executable, raw image or object)
+     * @param object p is object
+     * @param jobs formatting threads
+     * @param out output
+     * @return counts
+     */
+    n64::disassembly_report disassemble(const n64::program& p, bool object, std::size_t jobs, std::ostream& out);
+} /* n64 */
+
+#endif //N64_EMU_DISASSEMBLER_HPP
@@ -0,0 +1,105 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <exception>
+
+#include "cmdline.hpp"
+
+#include "binary.hpp"
+#include "disassembler.hpp"
+
+namespace {
+    /**
+     * check file is object file
+     * @param file file name
+     * @return file starts with object magic
+     */
+    bool is_object(const std::string& file) {
+        char magic[sizeof(n64::binary::OBJECT_MAGIC)]={};
+        std::ifstream in(file, std::ios::binary);
+        in.read(magic, sizeof(magic));
+        return in && std::memcmp(magic, n64::binary::OBJECT_MAGIC, sizeof(magic))==0;
+    }
+} /* anonymous */
+
+int main(int argc, char **argv) {
+    cmdline::parser parser;
+    parser.add<std::string>("output", 'o', "output source file (default: standard output)", false, "");
+    parser.add<std::size_t>("jobs", 'j', "threads formatting instructions (0: number of cores)", false, 1);
+    parser.footer("binary");
+
+    parser.parse_check(argc, argv);
+    // source on standard output is never mixed with messages
+    const auto output=parser.get<std::string>("output");
+    auto& log=output.empty() ? std::cerr : std::cout;
+    log<<"N64 Disassembler"<<std::endl;
+    log<<"Version: "<<1<<std::endl;
+
+    const auto& inputs=parser.rest();
+    if(inputs.size()!=1) {
+        std::cerr<<"error: one executable, raw image or object file expected"<<std::endl<<parser.usage();
+        return EXIT_FAILURE;
+    }
+    auto jobs=parser.get<std::size_t>("jobs");
+    if(jobs==0) {
+        jobs=std::max(1U, std::thread::hardware_concurrency());
+    }
+
+    const auto& input=inputs[0];
+    const bool object=is_object(input);
+    n64::program program;
+    try {
+        program=object ? n64::load_object(input) : n64::load_program(input);
+    }catch(const std::exception& e) {
+        std::cerr<<"error: "<<e.what()<<std::endl;
+        return EXIT_FAILURE;
+    }
+    if(program.rodata_size>0 || program.bss_size>0) {
+        std::cerr<<"warning: rodata and bss sections are not disassembled"<<std::endl;
+    }
+
+    n64::disassembly_report report;
+    if(output.empty()) {
+        report=n64::disassemble(program, object, jobs, std::cout);
+        std::cout.flush();
+        if(!std::cout) {
+            std::cerr<<"error: cannot write standard output"<<std::endl;
+            return EXIT_FAILURE;
+        }
+    }else{
+        std::ofstream out(output, std::ios::binary);
+        report=n64::disassemble(program, object, jobs, out);
+        out.close();
+        if(!out) {
+            std::cerr<<"error: cannot write "<<output<<std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    log<<report.instructions<<" instructions ("<<report.words<<" written as word), "
+       <<report.labels<<" labels recovered from jump targets"<<std::endl;
+    if(!report.entry.empty()) {
+        log<<"entry: "<<report.entry<<" (assemble with -e "<<report.entry<<")"<<std::endl;
+    }
+    if(object) {
+        log<<"object file: assemble with --object"<<std::endl;
+    }
+    return EXIT_SUCCESS;
+}
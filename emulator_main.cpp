@@ -14,467 +14,730 @@
 
 
 #include <iostream>
+#include <fstream>
 #include <sstream>
 #include <vector>
 #include <unistd.h>
 #include <iomanip>
+#include <memory>
+#include <algorithm>
+#include <system_error>
+#include <stdexcept>
 
 #include "instruction.hpp"
+#include "binary.hpp"
+#include "machine.hpp"
+#include "decoder.hpp"
+#include "block_cache.hpp"
+#include "translation_cache.hpp"
+#include "trace.hpp"
+#include "profile.hpp"
+#include "call_graph.hpp"
+#ifdef N64_JIT
+#include "jit.hpp"
+#endif
 #include "cmdline.hpp"
 
 namespace {
     /**
-     * flags register
+     * read byte size with optional K, M or G suffix
      */
-    class flags {
-    private:
-        std::uint64_t _value;
+    struct size_reader {
+        std::size_t operator()(const std::string& str) {
+            std::size_t end=0;
+            const auto size=static_cast<std::size_t>(std::stoull(str, &end, 0));
+            const auto suffix=str.substr(end);
+            if(suffix.empty())return size;
+            if(suffix=="K" || suffix=="k")return size<<10;
+            if(suffix=="M" || suffix=="m")return size<<20;
+            if(suffix=="G" || suffix=="g")return size<<30;
+            throw cmdline::cmdline_error("invalid size: "+str);
+        }
+    };
 
+    /**
+     * cpu emulator
+     * remove: default constructor, copy & move constructors and copy & move assign operators.
+     */
+    class cpu : public n64::machine {
     private:
+        std::vector<n64::instruction::instruction> _instructions;
+        std::unique_ptr<n64::translation> _translation;   // whole program (threaded engine, translation cache)
+        n64::decoder::operation *_bound;    // operations of _translation with bound handlers (nullptr: not bound)
+        n64::block_cache _blocks;
+
+#ifdef N64_JIT
+        n64::jit::compiler _compiler;
+        n64::jit::context _context;
+#endif
+    public:
         /**
-         * set bit
-         * @param bit bit index
-         * @param w 1 (true) or 0 (false)
+         * execution engine
+         * reference: decode and run one instruction per step (cpu::next)
+         * threaded: predecode once and run with direct-threaded dispatch
+         * block: translate basic blocks on demand and chain them together
+         * jit: block engine which runs x86-64 translations of blocks (block engine if JIT is not built)
+         * tiered: start in reference engine, move hot blocks to block engine and then to JIT
          */
-        void _set(int bit, bool w)noexcept {
-            if(w) {
-                _value |= 1ULL<<bit;
-            }else{
-                _value &= ~(1ULL<<bit);
-            }
-        }
+        enum class engine {
+            reference, threaded, block, jit, tiered
+        };
+
         /**
-         * get bit
-         * @param bit bit index
-         * @return 1 (true) or 0 (false)
+         * block moved to faster engine
          */
-        bool _get(int bit)const noexcept {
-            return (_value & (1ULL<<bit)) != 0;
-        }
+        struct tier_event {
+            std::uint64_t address;  // block entry address
+            engine from, to;
+            std::uint64_t count;    // entries of block when it was moved
+        };
 
-    public:
-        flags() : _value(0) {}
+    private:
+        std::vector<std::uint32_t> _entries;    // block entries counted by reference engine (tiered)
+        std::uint64_t _threaded_threshold, _jit_threshold;
+        std::vector<tier_event> _events;
+        std::unique_ptr<n64::profile> _profile;     // execution counts (profiling engines only)
 
+    public:
+        cpu()=delete;
         /**
-         * set equal flag
-         * @param w 0 or 1
-         */
-        void equal(bool w)noexcept {
-            _set(0, w);
-        }
-        /**
-         * get equal flag
-         * @return 0 or 1
+         * @param i program
+         * @param memory_size guest memory size in bytes
+         * @param model memory model
+         * @param huge_pages back flat guest memory with transparent huge pages
+         * @param stack_size stack size in bytes
          */
-        bool equal()const noexcept {
-            return _get(0);
+        explicit cpu(std::vector<n64::instruction::instruction> i, std::size_t memory_size=n64::memory::DEFAULT_SIZE,
+                     n64::memory_model model=n64::memory_model::flat, bool huge_pages=false,
+                     std::size_t stack_size=n64::stack::DEFAULT_SIZE)
+                : machine(memory_size, model, huge_pages, stack_size), _instructions(std::move(i)), _bound(nullptr), _blocks(_instructions),
+                                                                 _threaded_threshold(50), _jit_threshold(1000) {
+#ifdef N64_JIT
+            _context.registers=_registers;
+            _context.flags=_flags.data();
+            _context.slot=0;
+            _context.cpu=this;
+            _context.push=[](void *c, std::uint64_t value, std::uint64_t ip) {
+                auto *self=static_cast<cpu*>(c);
+                self->_registers[IP]=ip;
+                self->_push(value);
+            };
+            _context.pop=[](void *c, std::uint64_t empty, std::uint64_t ip) -> std::uint64_t {
+                auto *self=static_cast<cpu*>(c);
+                std::uint64_t value=empty;
+                self->_registers[IP]=ip;
+                self->_pop(value);
+                return value;
+            };
+#endif
         }
+        cpu(const cpu&)=delete;
+        cpu(cpu&&)=delete;
 
-        /**
-         * set above flag
-         * @param w 0 or 1
-         */
-        void above(bool w)noexcept {
-            _set(1, w);
-        }
-        /**
-         * get above flag
-         * @return 0 or 1
-         */
-        bool above()const noexcept {
-            return _get(1);
-        }
+        cpu& operator=(const cpu&)=delete;
+        cpu& operator=(cpu&&)=delete;
 
+    public:
         /**
-         * set halt flag
-         * @param w 0 or 1
+         * use translation of program (e.g. mapped from translation cache) instead of decoding it
+         * @param t translation of same instructions
          */
-        void halt(bool w)noexcept {
-            _set(2, w);
+        void translation(std::unique_ptr<n64::translation> t) {
+            _translation=std::move(t);
+            _bound=nullptr;
+            _blocks.predecoded(_translation.get());
         }
+
         /**
-         * get halt flag
-         * @return 0 or 1
+         * translation of program
+         * @return translation (nullptr: not decoded yet)
          */
-        bool halt()const noexcept {
-            return _get(2);
+        n64::translation *translation()noexcept {
+            return _translation.get();
         }
 
         /**
-         * dump flags register data
-         * @return dumped string
+         * blocks promoted by tiered engine in this and earlier runs
+         * @return entry addresses (ascending)
          */
-        std::string dump() {
-            std::string s;
-            if(equal()) {
-                s+="e";
-            }else{
-                s+="-";
+        std::vector<std::uint64_t> hot_blocks()const {
+            std::vector<std::uint64_t> hot;
+            if(_translation) {
+                hot=_translation->hot();
             }
-            if(above()) {
-                s+="a";
-            }else{
-                s+="-";
+            for(const auto& e : _events) {
+                if(e.from==engine::reference)hot.emplace_back(e.address);
             }
-            if(halt()) {
-                s+="h";
-            }else{
-                s+="-";
-            }
-            return s;
+            std::sort(std::begin(hot), std::end(hot));
+            hot.erase(std::unique(std::begin(hot), std::end(hot)), std::end(hot));
+            return hot;
         }
-    };
 
-    /**
-     * stack emulator
-     */
-    class stack {
-    private:
-        std::vector<std::uint8_t> _stack;
-
-    private:
         /**
-         * push backend
-         * @param data bytes array
-         * @param len data length(len bytes)
+         * set tier-up thresholds of tiered engine
+         * @param threaded block entries in reference engine before block is translated
+         * @param jit block entries in block engine before block is compiled to native code
          */
-        void _push_impl(const std::uint8_t *data, std::size_t len) {
-            _stack.insert(std::end(_stack), data, data+len);
+        void thresholds(std::uint64_t threaded, std::uint64_t jit)noexcept {
+            _threaded_threshold=threaded;
+            _jit_threshold=jit;
         }
+
         /**
-         * pop backend
-         * @param buf buffer
-         * @param len data length(len bytes)
-         */
-        void _pop_impl(std::uint8_t *buf, std::size_t len) {
-            for(std::size_t i=0; i<len; ++i) {
-                buf[len-i-1]=_stack.back();
-                _stack.pop_back();
-            }
-        }
-    public:
-        /**
-         * push as 64bit
-         * @param _64 64bit data
+         * program
+         * @return instructions
          */
-        void push(std::uint64_t _64) {
-            _push_impl(reinterpret_cast<std::uint8_t*>(&_64), 8);
+        const std::vector<n64::instruction::instruction>& instructions()const noexcept {
+            return _instructions;
         }
+
         /**
-         * push as 32bit
-         * @param _32 32bit data
+         * cpu has next instruction
+         * @return has next instruction
          */
-        void push(std::uint32_t _32) {
-            _push_impl(reinterpret_cast<std::uint8_t*>(&_32), 4);
+        bool has_next() {
+            return _instructions.size()>_registers[IP];
         }
+
         /**
-         * push as 16bit
-         * @param _16 16bit data
+         * run next instruction
          */
-        void push(std::uint16_t _16) {
-            _push_impl(reinterpret_cast<std::uint8_t*>(&_16), 2);
+        void next() {
+            if(_flags.halt())return;
+
+            execute(_instructions[_registers[IP]++]);
         }
+
         /**
-         * push as 8bit
-         * @param _8 8bit data
+         * run until halted or instruction pointer leaves the program
+         * @param e execution engine
          */
-        void push(std::uint8_t _8) {
-            _push_impl(&_8, 1);
+        void run(engine e) {
+            switch(e) {
+                case engine::reference:
+                    run_reference<false>();
+                    break;
+                case engine::threaded:
+                    run_threaded<engine::threaded>();
+                    break;
+                case engine::block:
+                    run_threaded<engine::block>();
+                    break;
+                case engine::jit:
+#ifdef N64_JIT
+                    run_threaded<engine::jit>();
+#else
+                    run_threaded<engine::block>();
+#endif
+                    break;
+                case engine::tiered:
+                    run_tiered();
+                    break;
+            }
         }
 
-    public:
         /**
-         * pop as 64bit
-         * @param _64 64bit buffer
+         * run profiling variant of engine (reference, threaded or block).
+         * counting is compiled only into these instantiations, so engines run by run() pay nothing.
+         * @param e execution engine
+         * @return engine can be profiled
          */
-        void pop(std::uint64_t& _64) {
-            _pop_impl(reinterpret_cast<std::uint8_t*>(&_64), 8);
+        bool profile(engine e) {
+            if(!_profile) {
+                _profile=std::make_unique<n64::profile>(_instructions.size());
+            }
+            switch(e) {
+                case engine::reference:
+                    run_reference<true>();
+                    return true;
+                case engine::threaded:
+                    run_threaded<engine::threaded, true>();
+                    return true;
+                case engine::block:
+                    run_threaded<engine::block, true>();
+                    return true;
+                default:
+                    return false;
+            }
         }
+
         /**
-         * pop as 32bit
-         * @param _32 32bit buffer
+         * execution profile
+         * @return profile (nullptr: not profiled)
          */
-        void pop(std::uint32_t& _32) {
-            _pop_impl(reinterpret_cast<std::uint8_t*>(&_32), 4);
+        const n64::profile *execution_profile()const noexcept {
+            return _profile.get();
         }
+
         /**
-         * pop as 16bit
-         * @param _16 16bit buffer
+         * run reference engine and record trace
+         * @param l trace level (not off)
+         * @param r trace recorder
          */
-        void pop(std::uint16_t& _16) {
-            _pop_impl(reinterpret_cast<std::uint8_t*>(&_16), 2);
+        void trace(n64::trace::level l, n64::trace::recorder& r) {
+            switch(l) {
+                case n64::trace::level::branches:
+                    run_traced<n64::trace::level::branches>(r);
+                    break;
+                case n64::trace::level::instructions:
+                    run_traced<n64::trace::level::instructions>(r);
+                    break;
+                case n64::trace::level::registers:
+                    run_traced<n64::trace::level::registers>(r);
+                    break;
+                default:
+                    run(engine::reference);
+                    break;
+            }
         }
+
         /**
-         * pop as 8bit
-         * @param _8 8bit buffer
+         * run reference engine and record guest call graph
+         * @param g call graph
          */
-        void pop(std::uint8_t&_8) {
-            _pop_impl(&_8, 1);
+        void call_graph(n64::call_graph& g) {
+            using n64::decoder::opcode;
+
+            while(has_next() && !halted()) {
+                const auto address=_registers[IP];
+                const auto ins=_instructions[address];
+                next();
+                g.executed();
+
+                switch(n64::decoder::decode(ins).code) {
+                    case opcode::call:
+                    case opcode::call_register:
+                        g.call(_registers[IP], address+1);
+                        break;
+                    case opcode::ret:
+                        g.ret(_registers[IP]);
+                        break;
+                    default:
+                        break;
+                }
+            }
+            g.finish();
         }
-    };
-
-    /**
-     * cpu emulator
-     * remove: default constructor, copy & move constructors and copy & move assign operators.
-     */
-    class cpu {
-    public:
-        static constexpr unsigned IP=n64::reg::id::IP, FLAGS=n64::reg::id::FLAGS,
-                RS_FIRST=n64::reg::id::RS[0], RS_LAST=n64::reg::id::RS[31],
-                RT_FIRST=n64::reg::id::RT[0], RT_LAST=n64::reg::id::RT[31];
-        static constexpr int UD=0;
-    private:
-        std::uint64_t _registers[128];
-        flags _flags;
-
-        std::vector<n64::instruction::instruction> _instructions;
-
-        stack _stack;
-    public:
-        cpu()=delete;
-        explicit cpu(std::vector<n64::instruction::instruction> i) : _registers(), _flags(), _instructions(std::move(i)) {}
-        cpu(const cpu&)=delete;
-        cpu(cpu&&)=delete;
 
-        cpu& operator=(const cpu&)=delete;
-        cpu& operator=(cpu&&)=delete;
-
-    public:
         /**
-         * check halted
-         * @return is halted
+         * engine name
+         * @param e execution engine
+         * @return name
          */
-        bool halted()const noexcept {
-            return _flags.halt();
+        static const char *name(engine e) {
+            static const char *NAMES[]={"reference", "threaded", "block", "jit", "tiered"};
+            return NAMES[static_cast<std::size_t>(e)];
         }
 
         /**
-         * dump cpu info
-         * @return current cpu info
+         * execution statistics
+         * @return statistics report
          */
-        std::string dump() {
+        std::string report()const {
+            std::size_t threaded=0, jit=0;
+            for(const auto& e : _events) {
+                ++(e.to==engine::jit ? jit : threaded);
+            }
+
             std::stringstream ss;
             ss
-                    <<"======== ======== ======== dump ======== ======== ========\n"<<std::hex
-                    <<" IP   = 0x"<<std::setw(16)<<std::setfill('0')<<_registers[IP]<<std::setw(0)<<"  FLAGS = "<<_flags.dump()<<std::endl;
-            for(std::size_t i=RS_FIRST; i<=RS_LAST; ++i) {
-                ss<<" RS"<<std::setw(2)<<std::setfill(' ')<<std::dec<<(i-RS_FIRST)<<" = 0x"<<std::setw(16)<<std::setfill('0')<<std::hex<<_registers[i];
-                ++i;
-                ss<<"  RS"<<std::setw(2)<<std::setfill(' ')<<std::dec<<(i-RS_FIRST)<<" = 0x"<<std::setw(16)<<std::setfill('0')<<std::hex<<_registers[i]<<"\n";
+                    <<"======== ======== ======== stats ======== ======== ========"<<std::endl
+                    <<"translated blocks: "<<_blocks.size()<<std::endl
+                    <<"tier-up events: "<<_events.size()
+                    <<" (to block: "<<threaded<<", to jit: "<<jit<<")"<<std::endl;
+            for(const auto& e : _events) {
+                ss
+                        <<"  0x"<<std::hex<<std::setw(16)<<std::setfill('0')<<e.address<<std::dec<<std::setfill(' ')
+                        <<" "<<name(e.from)<<" -> "<<name(e.to)<<" after "<<e.count<<" entries"<<std::endl;
             }
-            for(std::size_t i=RT_FIRST; i<=RT_LAST; ++i) {
-                ss<<" RT"<<std::setw(2)<<std::setfill(' ')<<std::dec<<(i-RT_FIRST)<<" = 0x"<<std::setw(16)<<std::setfill('0')<<std::hex<<_registers[i];
-                ++i;
-                ss<<"  RT"<<std::setw(2)<<std::setfill(' ')<<std::dec<<(i-RT_FIRST)<<" = 0x"<<std::setw(16)<<std::setfill('0')<<std::hex<<_registers[i]<<"\n";
+            if(_paged) {
+                ss
+                        <<"TLB hits: "<<_paged->hits()<<", misses: "<<_paged->misses()<<std::endl
+                        <<"allocated pages: "<<_paged->pages()<<std::endl;
             }
-            ss<<"======== ======== ======== ---- ======== ======== ========"<<std::endl;
             return ss.str();
         }
 
+    private:
         /**
-         * raise cpu exception
-         * @param type exception type
+         * reference engine
+         * @tparam Profile count executions and branch outcomes
          */
-        void raise_exception(int type) {
-            static const std::string EXCEPT[]={
-                    "undefined instruction"
-            };
-            std::cerr<<"Exception raised: "<<EXCEPT[type]<<std::endl;
-            std::cerr<<dump()<<std::endl;
-            _flags.halt(false);
+        template<bool Profile>
+        void run_reference() {
+            while(has_next() && !halted()) {
+                if constexpr(Profile) {
+                    const auto address=_registers[IP];
+                    const auto ins=_instructions[address];
+                    next();
+                    _profile->executed(address);
+                    if(n64::profile::is_conditional_branch(ins)) {
+                        _profile->branch(address, n64::profile::is_taken(ins, _flags.equal(), _flags.above()));
+                    }
+                }else{
+                    next();
+                }
+            }
         }
 
         /**
-         * cpu has next instruction
-         * @return has next instruction
+         * reference engine with trace recording (no formatting on the emulator thread)
+         * @tparam L trace level
+         * @param r trace recorder
          */
-        bool has_next() {
-            return _instructions.size()>_registers[IP];
+        template<n64::trace::level L>
+        void run_traced(n64::trace::recorder& r) {
+            using n64::decoder::opcode;
+
+            std::uint64_t sequence=0;
+            while(has_next() && !halted()) {
+                const auto address=_registers[IP];
+                const auto ins=_instructions[address];
+                next();
+
+                if constexpr(L==n64::trace::level::branches) {
+                    bool branch=_registers[IP]!=address+1;
+                    switch(n64::decoder::decode(ins).code) {
+                        case opcode::call:
+                        case opcode::call_register:
+                        case opcode::jmp:
+                        case opcode::jmp_register:
+                        case opcode::je:
+                        case opcode::jne:
+                        case opcode::ja:
+                        case opcode::jae:
+                        case opcode::jb:
+                        case opcode::jbe:
+                        case opcode::ret:
+                        case opcode::hlt:
+                            branch=true;
+                            break;
+                        default:
+                            break;
+                    }
+                    if(!branch) {
+                        ++sequence;
+                        continue;
+                    }
+                }
+
+                auto *slot=r.slot();
+                const n64::trace::record record={sequence++, address, _registers[IP], ins.data};
+                std::memcpy(slot, &record, sizeof(record));
+                if constexpr(L==n64::trace::level::registers) {
+                    std::uint64_t registers[n64::trace::REGISTERS]={};
+                    std::memcpy(registers, _registers, (BP+1)*sizeof(std::uint64_t));
+                    registers[FLAGS]=*_flags.data();
+                    std::memcpy(slot+sizeof(record), registers, sizeof(registers));
+                }
+                r.commit();
+            }
         }
 
         /**
-         * run next instruction
+         * tiered execution.
+         * reference engine counts entries of every block (targets of control transfers),
+         * so short-lived code never pays translation cost.
+         * blocks crossing threaded threshold are translated and run by block engine,
+         * which counts entries again and compiles blocks crossing JIT threshold.
+         * block engine returns here when it reaches a block which is not translated yet.
          */
-        void next() {
-            if(_flags.halt())return;
-
-            auto ins=_instructions[_registers[IP]++];
-
-            switch(ins.instruction.type) {
-                case n64::instruction::THREE_ADDRESS:{
-                    std::uint64_t& dest=_registers[ins.ta.destination];
-                    std::uint64_t& src1=_registers[ins.ta.source1];
-                    std::uint64_t& src2=_registers[ins.ta.source2];
+        void run_tiered() {
+            const auto size=_instructions.size();
+            if(_entries.size()!=size) {
+                _entries.assign(size, 0);
+            }
+            // blocks which were hot in earlier runs (translation cache) are promoted on first entry
+            const auto warm=[this](std::uint64_t ip) {
+                return _translation && std::binary_search(std::begin(_translation->hot()), std::end(_translation->hot()), ip);
+            };
 
-                    switch(ins.instruction.instruction) {
-                        case 0b00000: // add
-                            dest=src1+src2;
-                            break;
-                        case 0b00001: // sub
-                            dest=src1-src2;
-                            break;
-                        case 0b00010: // mul
-                            dest=src1*src2;
-                            break;
-                        case 0b00011: // div
-                            dest=src1/src2;
-                            break;
-                        case 0b00100: // shr
-                            dest=src1 >> src2;
-                            break;
-                        case 0b00101: // shl
-                            dest=src1 << src1;
-                            break;
-                        case 0b00110: // and
-                            dest=src1 & src2;
-                            break;
-                        case 0b00111: // or
-                            dest=src1 | src2;
-                            break;
-                        case 0b01000: // xor
-                            dest=src1 ^ src2;
-                            break;
-                        default:
-                            raise_exception(UD);
-                            return;
+            bool entry=true;
+            while(has_next() && !halted()) {
+                const auto ip=_registers[IP];
+                if(entry) {
+                    bool hot=_blocks.find(ip)!=nullptr;
+                    if(!hot && (++_entries[ip]>=_threaded_threshold || warm(ip))) {
+                        _events.push_back({ip, engine::reference, engine::block, _entries[ip]});
+                        hot=true;
                     }
-                }
-                    break;
-                case n64::instruction::BINOMIAL:{
-                    std::uint64_t& op1=_registers[ins.b.operand1];
-                    std::uint64_t& op2=_registers[ins.b.operand2];
-
-                    switch(ins.instruction.instruction) {
-                        case 0b00000: // not
-                            op1= ~op2;
-                            break;
-                        case 0b00001: // xchg
-                            if(ins.b.operand1!=ins.b.operand2)std::swap(op1, op2);
-                            break;
-                        case 0b00010: // cmp
-                            _flags.equal(op1==op2);
-                            _flags.equal(op1 > op2);
-                            break;
-                        default:
-                            raise_exception(UD);
-                            return;
+                    if(hot) {
+                        run_threaded<engine::tiered>();
+                        continue;
                     }
                 }
-                    break;
-                case n64::instruction::UNARY:{
-                    std::uint64_t data=0;
-                    switch(ins.u.type) {
-                        case 0b00: // register
-                            data=_registers[ins.u.reg.operand];
-                            break;
-                        case 0b01: // pointer
-                            // memory not implemented
-                            break;
-                        case 0b11: // immediate
-                            data=ins.u.imm.immediate;
-                            break;
-                    }
+                next();
+                entry=_registers[IP]!=ip+1;
+            }
+        }
 
-                    bool assign=false, jump=false;
+        /**
+         * run operations with direct-threaded dispatch.
+         * every operation stores the address of its handler, so dispatch is one indirect jump.
+         * threaded: predecode whole program once and run flat operation array.
+         * block: run translated basic blocks and chain each block directly to its successor.
+         * jit: same as block, but blocks with native translation run natively.
+         * tiered: same as jit, but only hot blocks are compiled and untranslated blocks return to run_tiered.
+         * @tparam E engine
+         * @tparam Profile count executions and branch outcomes (threaded and block only)
+         */
+        template<engine E, bool Profile=false>
+        void run_threaded() {
+            constexpr bool Blocks=E!=engine::threaded;
 
-                    switch(ins.instruction.instruction) {
-                        case 0b00000: // inc
-                            ++data;
-                            assign=true;
-                            break;
-                        case 0b00001: // dec
-                            --data;
-                            assign=true;
-                            break;
-                        case 0b01011: // push
-                            _stack.push(data);
-                            break;
-                        case 0b01100: // pop
-                            _stack.pop(data);
-                            assign=true;
-                            break;
+#define N64_THREADED_LABEL(name) &&op_##name,
+            static const void *const HANDLERS[]={
+                    N64_DECODER_OPCODES(N64_THREADED_LABEL)
+            };
+#undef N64_THREADED_LABEL
 
-                        case 0b00010: // call
-                            _stack.push(_registers[IP]);
-                        case 0b00011: // jmp
-                        case 0b00100: // jr
-                            jump=true;
-                            break;
-                        case 0b00101: // je
-                            jump=_flags.equal();
-                            break;
-                        case 0b00110: // jne
-                            jump=!_flags.equal();
-                            break;
-                        case 0b00111: // ja
-                            jump=_flags.above();
-                            break;
-                        case 0b01000: // jae
-                            jump=_flags.equal() || _flags.above();
-                            break;
-                        case 0b01001: // jb
-                            jump=!_flags.equal() && !_flags.above();
-                            break;
-                        case 0b01010: // jbe
-                            jump=!_flags.above();
-                            break;
-                        default:
-                            raise_exception(UD);
-                            return;
+            const auto size=_instructions.size();
+            std::uint64_t *const r=_registers;
+
+            if(_flags.halt() || _registers[IP]>=size)return;
+
+            const n64::decoder::operation *base=nullptr, *pc=nullptr;
+            n64::basic_block *current=nullptr;
+            std::uint64_t target=0;
+            std::size_t slot=n64::basic_block::FALL_THROUGH;
+
+            if constexpr(Blocks) {
+                _blocks.bind(HANDLERS);
+                _blocks.collect();
+                current=_blocks.lookup(_registers[IP]);
+            }else{
+                if(!_translation) {
+                    _translation=std::make_unique<n64::translation>(_instructions);
+                }
+                if(_bound==nullptr) {
+                    _bound=_translation->bind(HANDLERS);
+                    if(_bound==nullptr) {
+                        // mapped translation cannot be written, decode again
+                        _translation=std::make_unique<n64::translation>(_instructions);
+                        _blocks.predecoded(_translation.get());
+                        _bound=_translation->bind(HANDLERS);
                     }
+                }
+                base=_bound;
+                pc=base+_registers[IP];
+            }
+            // guest address of operation
+            const auto address=[&](const n64::decoder::operation *op) -> std::uint64_t {
+                if constexpr(Blocks) {
+                    return current->address(op);
+                }else{
+                    return static_cast<std::uint64_t>(op-base);
+                }
+            };
+            if constexpr(Blocks) {
+                goto enter;
+            }
 
-                    if(assign) {
-                        switch(ins.u.type) {
-                            case 0b00: // register
-                                _registers[ins.u.reg.operand]=data;
-                                break;
-                            case 0b01: // pointer
-                                // memory not implemented
-                                break;
-                        }
+#define N64_DISPATCH() \
+            do { \
+                if constexpr(Profile) { \
+                    if(pc->code!=n64::decoder::opcode::exit)_profile->executed(address(pc)); \
+                } \
+                goto *pc->handler; \
+            } while(false)
+#define N64_NEXT() do { ++pc; N64_DISPATCH(); } while(false)
+#define N64_JUMP(to, successor) \
+            do { \
+                target=(to); \
+                if constexpr(Blocks) { \
+                    slot=(successor); \
+                    goto chain; \
+                } \
+                if(target>=size) { \
+                    _registers[IP]=target; \
+                    return; \
+                } \
+                pc=base+target; \
+                N64_DISPATCH(); \
+            } while(false)
+#define N64_BRANCH(condition) \
+            do { \
+                if constexpr(Profile) { \
+                    _profile->branch(address(pc), condition); \
+                } \
+                if(condition)N64_JUMP(pc->immediate, n64::basic_block::TAKEN); \
+                if constexpr(Blocks) { \
+                    N64_JUMP(address(pc)+1, n64::basic_block::FALL_THROUGH); \
+                } \
+                N64_NEXT(); \
+            } while(false)
+#define N64_COMPARE_BRANCH(condition) \
+            do { \
+                _flags.equal(r[pc->destination] > r[pc->source1]); \
+                ++pc; \
+                if constexpr(Profile) { \
+                    _profile->executed(address(pc)); \
+                } \
+                N64_BRANCH(condition); \
+            } while(false)
+
+            N64_DISPATCH();
+
+            op_add: r[pc->destination]=r[pc->source1]+r[pc->source2]; N64_NEXT();
+            op_sub: r[pc->destination]=r[pc->source1]-r[pc->source2]; N64_NEXT();
+            op_mul: r[pc->destination]=r[pc->source1]*r[pc->source2]; N64_NEXT();
+            op_div: r[pc->destination]=r[pc->source1]/r[pc->source2]; N64_NEXT();
+            op_shr: r[pc->destination]=r[pc->source1] >> r[pc->source2]; N64_NEXT();
+            op_shl: r[pc->destination]=r[pc->source1] << r[pc->source1]; N64_NEXT();
+            op_and_: r[pc->destination]=r[pc->source1] & r[pc->source2]; N64_NEXT();
+            op_or_: r[pc->destination]=r[pc->source1] | r[pc->source2]; N64_NEXT();
+            op_xor_: r[pc->destination]=r[pc->source1] ^ r[pc->source2]; N64_NEXT();
+
+            op_not_: r[pc->destination]= ~r[pc->source1]; N64_NEXT();
+            op_xchg: if(pc->destination!=pc->source1)std::swap(r[pc->destination], r[pc->source1]); N64_NEXT();
+            op_cmp:
+                _flags.equal(r[pc->destination]==r[pc->source1]);
+                _flags.equal(r[pc->destination] > r[pc->source1]);
+                N64_NEXT();
+
+            op_inc: ++r[pc->destination]; N64_NEXT();
+            op_dec: --r[pc->destination]; N64_NEXT();
+            // stack operations keep IP up to date, so stack exceptions dump raising instruction
+            op_push: _registers[IP]=address(pc)+1; _push(r[pc->destination]); N64_NEXT();
+            op_push_immediate: _registers[IP]=address(pc)+1; _push(pc->immediate); N64_NEXT();
+            op_pop: {
+                // popped value is assigned after SP is updated, so pop sp loads sp
+                std::uint64_t value=r[pc->destination];
+                _registers[IP]=address(pc)+1;
+                _pop(value);
+                r[pc->destination]=value;
+            }
+                N64_NEXT();
+            op_pop_discard: {
+                std::uint64_t discard;
+                _registers[IP]=address(pc)+1;
+                _pop(discard);
+            }
+                N64_NEXT();
+
+            op_call: _registers[IP]=address(pc)+1; _push(_registers[IP]); N64_JUMP(pc->immediate, n64::basic_block::TAKEN);
+            op_call_register: {
+                const std::uint64_t to=r[pc->destination];
+                _registers[IP]=address(pc)+1;
+                _push(_registers[IP]);
+                N64_JUMP(to, n64::basic_block::INDIRECT);
+            }
+            op_jmp: N64_JUMP(pc->immediate, n64::basic_block::TAKEN);
+            op_jmp_register: N64_JUMP(r[pc->destination], n64::basic_block::INDIRECT);
+            op_je: N64_BRANCH(_flags.equal());
+            op_jne: N64_BRANCH(!_flags.equal());
+            op_ja: N64_BRANCH(_flags.above());
+            op_jae: N64_BRANCH(_flags.equal() || _flags.above());
+            op_jb: N64_BRANCH(!_flags.equal() && !_flags.above());
+            op_jbe: N64_BRANCH(!_flags.above());
+
+            op_hlt:
+                _flags.halt(true);
+                _registers[IP]=address(pc)+1;
+                return;
+            op_ret: {
+                std::uint64_t to=address(pc)+1;
+                _registers[IP]=to;
+                _pop(to);
+                N64_JUMP(to, n64::basic_block::INDIRECT);
+            }
+
+            op_asgn: r[pc->destination]=pc->immediate; N64_NEXT();
+            op_asgnh: r[pc->destination]=((pc->immediate & 0xffffffff) << 32) | (r[pc->destination] & 0xffffffff); N64_NEXT();
+            op_asgnl: r[pc->destination]=(pc->immediate & 0xffffffff) | (r[pc->destination] & (0xffffffffULL<<32)); N64_NEXT();
+
+            op_mov: r[pc->destination]=r[pc->source1]; N64_NEXT();
+            // fused pairs: run first operation, then continue with second one without dispatch
+            op_cmp_je: N64_COMPARE_BRANCH(_flags.equal());
+            op_cmp_jne: N64_COMPARE_BRANCH(!_flags.equal());
+            op_cmp_ja: N64_COMPARE_BRANCH(_flags.above());
+            op_cmp_jae: N64_COMPARE_BRANCH(_flags.equal() || _flags.above());
+            op_cmp_jb: N64_COMPARE_BRANCH(!_flags.equal() && !_flags.above());
+            op_cmp_jbe: N64_COMPARE_BRANCH(!_flags.above());
+            op_asgn_pair:
+                if constexpr(Profile) {
+                    _profile->executed(address(pc)+1);
+                }
+                r[pc->destination]=pc->immediate;
+                pc+=2;
+                N64_DISPATCH();
+
+            op_nop: N64_NEXT();
+            op_generic: {
+                n64::instruction::instruction ins={};
+                ins.data=pc->immediate;
+                _registers[IP]=address(pc)+1;
+                execute(ins);
+                if constexpr(Profile) {
+                    if(n64::profile::is_conditional_branch(ins)) {
+                        _profile->branch(address(pc), n64::profile::is_taken(ins, _flags.equal(), _flags.above()));
                     }
-                    if(jump) {
-                        _registers[IP]=data;
+                }
+                N64_JUMP(_registers[IP], n64::basic_block::INDIRECT);
+            }
+            op_exit:
+                if constexpr(Blocks) {
+                    N64_JUMP(current->end, n64::basic_block::FALL_THROUGH);
+                }
+                _registers[IP]=address(pc);
+                return;
+
+            chain: __attribute__((unused));
+                // blocks only: follow chained successor, translate and link it at first use
+                if(target>=size) {
+                    _registers[IP]=target;
+                    return;
+                }
+                if constexpr(Blocks) {
+                    auto next=current->successor[slot];
+                    if(next==nullptr || next->entry!=target) {
+                        if constexpr(E==engine::tiered) {
+                            next=_blocks.find(target);
+                            if(next==nullptr) {
+                                _registers[IP]=target;
+                                return;
+                            }
+                        }else{
+                            next=_blocks.lookup(target);
+                        }
+                        _blocks.link(current, slot, next);
                     }
+                    current=next;
                 }
-                    break;
-                case n64::instruction::NO_OPERAND:
-                    switch(ins.instruction.instruction) {
-                        case 0b00000: // hlt
-                            _flags.halt(true);
-                            break;
-                        case 0b00001: // ret
-                            _stack.pop(_registers[IP]);
-                            break;
-                        default:
-                            raise_exception(UD);
-                            return;
+            enter: __attribute__((unused));
+                if constexpr(E==engine::tiered) {
+                    ++current->executions;
+                }
+#ifdef N64_JIT
+                if constexpr(E==engine::jit || E==engine::tiered) {
+                    if(!current->compiled && (E==engine::jit || current->executions>=_jit_threshold)) {
+                        current->compiled=true;
+                        current->native=_compiler.compile(*current);
+                        if(E==engine::tiered && current->native!=nullptr) {
+                            _events.push_back({current->entry, engine::block, engine::jit, current->executions});
+                        }
                     }
-                    break;
-                case n64::instruction::REGISTER_IMMEDIATE:{
-                    std::uint64_t& reg=_registers[ins.ri.reg];
-                    std::uint64_t imm=ins.ri.immediate;
-
-                    switch(ins.instruction.instruction) {
-                        case 0: // asgn
-                            break;
-                        case 0b00001: // asgnh
-                            imm &= 0xffffffff;
-                            imm <<= 32;
-                            imm |= (reg & 0xffffffff);
-                            break;
-                        case 0b00010: // asgnl
-                            imm &= 0xffffffff;
-                            imm |= (reg & (0xffffffffULL<<32));
-                            break;
-                        default:
-                            raise_exception(UD);
+                    if(current->native!=nullptr) {
+                        target=current->native(&_context);
+                        if(_context.slot==n64::jit::HALTED) {
+                            _registers[IP]=target;
                             return;
+                        }
+                        slot=_context.slot;
+                        goto chain;
                     }
-                    reg=imm;
                 }
-                    break;
-            }
+#endif
+                if constexpr(Blocks) {
+                    pc=current->operations.data();
+                }
+                N64_DISPATCH();
+
+#undef N64_COMPARE_BRANCH
+#undef N64_BRANCH
+#undef N64_JUMP
+#undef N64_NEXT
+#undef N64_DISPATCH
         }
     };
 } /* anonymous */
@@ -483,17 +746,195 @@ int main(int argc, char **argv) {
     std::cout<<"N64 CPU Emulator"<<std::endl;
 
     cmdline::parser parser;
+    parser.add<std::string>("engine", 'e', "execution engine", false, "threaded",
+                            cmdline::oneof<std::string>("reference", "threaded", "block", "jit", "tiered"));
+    parser.add<std::uint64_t>("tier-threshold", '\0', "block entries before tiered engine translates block", false, 50);
+    parser.add<std::uint64_t>("jit-threshold", '\0', "block entries before tiered engine compiles block", false, 1000);
+    parser.add("stats", 's', "print execution statistics");
+    parser.add<std::size_t>("memory", 'm', "guest memory size in bytes (K, M or G suffix)", false,
+                            n64::memory::DEFAULT_SIZE, size_reader());
+    parser.add<std::string>("memory-model", '\0', "guest memory model", false, "flat",
+                            cmdline::oneof<std::string>("flat", "paged"));
+    parser.add("huge-pages", '\0', "back flat guest memory with transparent huge pages");
+    parser.add<std::size_t>("stack", '\0', "guest stack size in bytes (K, M or G suffix)", false,
+                            n64::stack::DEFAULT_SIZE, size_reader());
+    parser.add<std::string>("cache-dir", '\0', "translation cache directory (default: $N64_CACHE_DIR, $XDG_CACHE_HOME/n64 or ~/.cache/n64)",
+                            false, "");
+    parser.add<std::size_t>("cache-size", '\0', "translation cache capacity in bytes (K, M or G suffix)", false,
+                            n64::translation_cache::DEFAULT_CAPACITY, size_reader());
+    parser.add("no-cache", '\0', "do not use translation cache");
+    parser.add<std::string>("trace", 't', "trace level (reference engine)", false, "off",
+                            cmdline::oneof<std::string>("off", "branches", "instructions", "registers"));
+    parser.add<std::string>("trace-file", '\0', "trace output file (format with n64trace)", false, "n64.trace");
+    parser.add("profile", 'p', "count executions per opcode, address and branch (reference, threaded or block engine)");
+    parser.add<std::string>("profile-output", '\0', "profile report file (default: standard output)", false, "");
+    parser.add<std::size_t>("profile-top", '\0', "number of hot addresses and branches in profile report", false, 20);
+    parser.add("call-graph", 'g', "record guest call graph as collapsed stacks (reference engine)");
+    parser.add<std::string>("call-graph-output", '\0', "collapsed stacks file (flame graph input)", false, "n64.folded");
+    parser.add<std::string>("call-graph-weight", '\0', "weight of call paths", false, "instructions",
+                            cmdline::oneof<std::string>("instructions", "time"));
+    parser.add<std::size_t>("trace-buffer", '\0', "trace ring buffer size in bytes (K, M or G suffix)", false,
+                            n64::trace::DEFAULT_BUFFER, size_reader());
 
     parser.parse_check(argc, argv);
     auto input=parser.rest()[0];
+    auto engine=parser.get<std::string>("engine");
+    const auto trace_level=parser.get<std::string>("trace");
+    auto trace=n64::trace::level::off;
+    if(trace_level=="branches") {
+        trace=n64::trace::level::branches;
+    }else if(trace_level=="instructions") {
+        trace=n64::trace::level::instructions;
+    }else if(trace_level=="registers") {
+        trace=n64::trace::level::registers;
+    }
+    if(trace!=n64::trace::level::off && engine!="reference") {
+        std::cerr<<"error: --trace needs --engine=reference"<<std::endl;
+        return EXIT_FAILURE;
+    }
+    const bool profiling=parser.exist("profile");
+    if(profiling && engine!="reference" && engine!="threaded" && engine!="block") {
+        std::cerr<<"error: --profile needs --engine=reference, threaded or block"<<std::endl;
+        return EXIT_FAILURE;
+    }
+    const bool call_graph=parser.exist("call-graph");
+    if(call_graph && (engine!="reference" || trace!=n64::trace::level::off || profiling)) {
+        std::cerr<<"error: --call-graph needs --engine=reference without --trace and --profile"<<std::endl;
+        return EXIT_FAILURE;
+    }
 
-    auto instructions=n64::load_binary(input);
+    n64::program program;
+    try {
+        program=n64::load_program(input);
+    }catch(const std::exception& e) {
+        std::cerr<<"error: "<<e.what()<<std::endl;
+        return EXIT_FAILURE;
+    }
 
-    cpu c(instructions);
-    int i=0;
-    while(c.has_next() && !c.halted()) {
-        c.next();
-        std::cout<<(i++)<<" "<<c.dump()<<std::endl;
+    const n64::symbol_table symbols(program);
+
+    // translation cache is used by engines which predecode program
+    std::unique_ptr<n64::translation_cache> cache;
+    std::unique_ptr<n64::translation> translation;
+    std::uint64_t key=0;
+    if(engine!="reference" && !parser.exist("no-cache")) {
+        auto directory=parser.get<std::string>("cache-dir");
+        cache=std::make_unique<n64::translation_cache>(directory.empty() ? n64::translation_cache::default_directory() : directory,
+                                                       parser.get<std::size_t>("cache-size"));
+        key=n64::translation_cache::key(program.code);
+        translation=cache->load(key, program.code);
+        if(!translation) {
+            translation=std::make_unique<n64::translation>(program.code);
+        }
+    }
+
+    std::unique_ptr<cpu> c;
+    try {
+        const auto model=parser.get<std::string>("memory-model")=="paged" ? n64::memory_model::paged : n64::memory_model::flat;
+        c=std::make_unique<cpu>(std::move(program.code), parser.get<std::size_t>("memory"), model, parser.exist("huge-pages"),
+                                parser.get<std::size_t>("stack"));
+    }catch(const std::system_error& e) {
+        std::cerr<<"error: "<<e.what()<<std::endl;
+        return EXIT_FAILURE;
+    }
+    if(!c->load_data(input, program)) {
+        std::cerr<<"error: data sections of "<<input<<" do not fit in guest memory"<<std::endl;
+        return EXIT_FAILURE;
+    }
+    c->registers()[n64::machine::IP]=program.entry;
+    c->symbols(&symbols);
+    const bool cached=translation && translation->cached();
+    if(translation) {
+        c->translation(std::move(translation));
+    }
+    c->thresholds(parser.get<std::uint64_t>("tier-threshold"), parser.get<std::uint64_t>("jit-threshold"));
+    if(trace!=n64::trace::level::off) {
+        std::unique_ptr<n64::trace::recorder> recorder;
+        try {
+            recorder=std::make_unique<n64::trace::recorder>(parser.get<std::string>("trace-file"), trace,
+                                                            parser.get<std::size_t>("trace-buffer"));
+        }catch(const std::system_error& e) {
+            std::cerr<<"error: "<<e.what()<<std::endl;
+            return EXIT_FAILURE;
+        }
+        c->trace(trace, *recorder);
+        if(!recorder->close()) {
+            std::cerr<<"error: cannot write trace to "<<parser.get<std::string>("trace-file")<<std::endl;
+            return EXIT_FAILURE;
+        }
+        std::cout<<c->dump()<<std::endl;
+        if(parser.exist("stats")) {
+            std::cout
+                    <<"trace: "<<recorder->records()<<" records ("<<n64::trace::name(trace)<<"), "
+                    <<recorder->stalls()<<" stalls on full buffer"<<std::endl;
+        }
+    }else if(call_graph) {
+        const auto weight=parser.get<std::string>("call-graph-weight")=="time" ? n64::call_graph::weight::time
+                                                                             : n64::call_graph::weight::instructions;
+        n64::call_graph graph(program.entry, weight==n64::call_graph::weight::time);
+        c->call_graph(graph);
+        std::cout<<c->dump()<<std::endl;
+
+        const auto output=parser.get<std::string>("call-graph-output");
+        std::ofstream fout(output);
+        fout<<graph.collapsed(symbols, weight);
+        if(!fout) {
+            std::cerr<<"error: cannot write call graph to "<<output<<std::endl;
+            return EXIT_FAILURE;
+        }
+        if(parser.exist("stats")) {
+            std::cout
+                    <<"call graph: "<<graph.paths()<<" call paths, max depth "<<graph.max_depth()
+                    <<", unmatched returns: "<<graph.unmatched()<<std::endl;
+        }
+    }else if(profiling) {
+        c->profile(engine=="reference" ? cpu::engine::reference : engine=="block" ? cpu::engine::block : cpu::engine::threaded);
+        std::cout<<c->dump()<<std::endl;
+    }else if(engine=="reference") {
+        c->run(cpu::engine::reference);
+        std::cout<<c->dump()<<std::endl;
+    }else{
+        if(engine=="tiered") {
+            c->run(cpu::engine::tiered);
+        }else if(engine=="jit") {
+            c->run(cpu::engine::jit);
+        }else if(engine=="block") {
+            c->run(cpu::engine::block);
+        }else{
+            c->run(cpu::engine::threaded);
+        }
+        std::cout<<c->dump()<<std::endl;
+    }
+    if(cache) {
+        // rewrite entry when it was missing or tiered engine found new hot blocks
+        auto *t=c->translation();
+        auto hot=c->hot_blocks();
+        if(!cached || hot!=t->hot()) {
+            t->hot(std::move(hot));
+            cache->store(key, *t, c->instructions());
+        }
+    }
+    if(const auto *profile=c->execution_profile()) {
+        const auto report=profile->report(c->instructions(), symbols, parser.get<std::size_t>("profile-top"));
+        const auto output=parser.get<std::string>("profile-output");
+        if(output.empty()) {
+            std::cout<<report;
+        }else{
+            std::ofstream fout(output);
+            fout<<report;
+            if(!fout) {
+                std::cerr<<"error: cannot write profile to "<<output<<std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    if(parser.exist("stats")) {
+        std::cout<<c->report();
+        if(cache) {
+            std::cout
+                    <<"translation cache: "<<(cached ? "hit" : "miss")<<(cache->usable() ? "" : " (directory is not usable)")
+                    <<", corrupted entries removed: "<<cache->corrupted()<<", evicted: "<<cache->evicted()<<std::endl;
+        }
     }
 
     return EXIT_SUCCESS;
@@ -0,0 +1,448 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <algorithm>
+#include <bitset>
+#include <array>
+#include <utility>
+
+#include "decoder.hpp"
+#include "peephole.hpp"
+#include "global_optimizer.hpp"
+
+namespace n64 {
+    namespace {
+        namespace nd=n64::decoder;
+        constexpr unsigned REGISTERS=n64::reg::id::BP+1;
+        constexpr unsigned SP=n64::reg::id::SP, R0=n64::reg::id::R0;
+
+        /**
+         * check operation ends basic block
+         * @param op operation
+         * @return jump, call, ret or hlt
+         */
+        bool ends_block(const nd::operation& op)noexcept {
+            return nd::is_direct_jump(op) || op.code==nd::opcode::ret || op.code==nd::opcode::hlt
+                   || op.code==nd::opcode::call_register || op.code==nd::opcode::jmp_register;
+        }
+
+        /**
+         * register values known at one point (dense, used while walking block)
+         */
+        struct registers_t {
+            std::bitset<REGISTERS> known;
+            std::array<std::uint64_t, REGISTERS> value;
+
+            void set(unsigned reg, std::uint64_t v) {
+                if(reg>=REGISTERS)return;
+                known.set(reg);
+                value[reg]=v;
+            }
+
+            void forget(unsigned reg) {
+                if(reg<REGISTERS)known.reset(reg);
+            }
+
+            bool get(unsigned reg, std::uint64_t& v)const {
+                if(reg>=REGISTERS || !known.test(reg))return false;
+                v=value[reg];
+                return true;
+            }
+        };
+
+        // register values known at block entry (sorted by register, only known ones)
+        using known_t=std::vector<std::pair<std::uint8_t, std::uint64_t>>;
+
+        registers_t expand(const known_t& k) {
+            registers_t r;
+            for(const auto& kv : k) {
+                r.set(kv.first, kv.second);
+            }
+            return r;
+        }
+
+        known_t compress(const registers_t& r) {
+            known_t k;
+            for(unsigned reg=0; reg<REGISTERS; ++reg) {
+                if(r.known.test(reg))k.emplace_back(static_cast<std::uint8_t>(reg), r.value[reg]);
+            }
+            return k;
+        }
+
+        /**
+         * keep values which are known with same value in both
+         * @param k values at block entry (updated)
+         * @param r values on incoming edge
+         * @return k changed
+         */
+        bool meet(known_t& k, const registers_t& r) {
+            const auto size=k.size();
+            k.erase(std::remove_if(std::begin(k), std::end(k), [&r](const std::pair<std::uint8_t, std::uint64_t>& kv) {
+                std::uint64_t v;
+                return !r.get(kv.first, v) || v!=kv.second;
+            }), std::end(k));
+            return k.size()!=size;
+        }
+
+        /**
+         * value which operation writes to its destination register
+         * @param op operation
+         * @param r values before operation
+         * @param value result
+         * @return result is known
+         */
+        bool evaluate(const nd::operation& op, const registers_t& r, std::uint64_t& value) {
+            std::uint64_t a, b;
+            switch(op.code) {
+                case nd::opcode::add:
+                    if(!r.get(op.source1, a) || !r.get(op.source2, b))return false;
+                    value=a+b;
+                    return true;
+                case nd::opcode::sub:
+                    if(!r.get(op.source1, a) || !r.get(op.source2, b))return false;
+                    value=a-b;
+                    return true;
+                case nd::opcode::shl:
+                    // every engine shifts source1 by itself
+                    if(!r.get(op.source1, a) || a>=64)return false;
+                    value=a << a;
+                    return true;
+                case nd::opcode::inc:
+                    if(!r.get(op.destination, a))return false;
+                    value=a+1;
+                    return true;
+                case nd::opcode::dec:
+                    if(!r.get(op.destination, a))return false;
+                    value=a-1;
+                    return true;
+                case nd::opcode::asgn:
+                    value=op.immediate;
+                    return true;
+                case nd::opcode::asgnh:
+                    if(!r.get(op.destination, a))return false;
+                    value=((op.immediate & 0xffffffff) << 32) | (a & 0xffffffff);
+                    return true;
+                case nd::opcode::asgnl:
+                    if(!r.get(op.destination, a))return false;
+                    value=(a & (0xffffffffULL << 32)) | (op.immediate & 0xffffffff);
+                    return true;
+                default:
+                    return false;
+            }
+        }
+
+        /**
+         * registers which generic instruction writes (pointer operands write memory)
+         * @param ins instruction
+         * @param r values (updated)
+         */
+        void clobber(const n64::instruction::instruction& ins, registers_t& r) {
+            switch(ins.instruction.type) {
+                case n64::instruction::THREE_ADDRESS:
+                    if((ins.ta.type & 0b100)==0)r.forget(ins.ta.destination);
+                    break;
+                case n64::instruction::BINOMIAL:
+                    if((ins.b.type & 0b10)==0)r.forget(ins.b.operand1);
+                    if((ins.b.type & 0b01)==0)r.forget(ins.b.operand2);
+                    break;
+                case n64::instruction::UNARY:
+                    if(ins.u.type==0b00)r.forget(ins.u.reg.operand);
+                    r.forget(SP);
+                    break;
+                case n64::instruction::REGISTER_IMMEDIATE:
+                    r.forget(ins.ri.reg);
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        /**
+         * run operation on known values
+         * @param ins instruction
+         * @param op decoded instruction
+         * @param r values (updated)
+         */
+        void step(const n64::instruction::instruction& ins, const nd::operation& op, registers_t& r) {
+            std::uint64_t v;
+            switch(op.code) {
+                case nd::opcode::add:
+                case nd::opcode::sub:
+                case nd::opcode::shl:
+                case nd::opcode::inc:
+                case nd::opcode::dec:
+                case nd::opcode::asgn:
+                case nd::opcode::asgnh:
+                case nd::opcode::asgnl:
+                    if(evaluate(op, r, v)) {
+                        r.set(op.destination, v);
+                    }else{
+                        r.forget(op.destination);
+                    }
+                    break;
+                case nd::opcode::mul:
+                case nd::opcode::div:
+                case nd::opcode::shr:
+                case nd::opcode::and_:
+                case nd::opcode::or_:
+                case nd::opcode::xor_:
+                case nd::opcode::not_:
+                    r.forget(op.destination);
+                    break;
+                case nd::opcode::xchg:{
+                    std::uint64_t a, b;
+                    const bool ka=r.get(op.destination, a), kb=r.get(op.source1, b);
+                    r.forget(op.destination);
+                    r.forget(op.source1);
+                    if(kb)r.set(op.destination, b);
+                    if(ka)r.set(op.source1, a);
+                }
+                    break;
+                case nd::opcode::pop:
+                    r.forget(op.destination);
+                    r.forget(SP);
+                    break;
+                case nd::opcode::push:
+                case nd::opcode::push_immediate:
+                case nd::opcode::pop_discard:
+                case nd::opcode::ret:
+                    r.forget(SP);
+                    break;
+                case nd::opcode::call:
+                case nd::opcode::call_register:
+                    // callee may change any register
+                    r.known.reset();
+                    break;
+                case nd::opcode::generic:
+                    clobber(ins, r);
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        /**
+         * source line of instruction
+         * @param p program
+         * @param address instruction address
+         * @return line (0: unknown)
+         */
+        std::uint64_t line_of(const n64::program& p, std::uint64_t address) {
+            auto itr=std::upper_bound(std::begin(p.lines), std::end(p.lines), address, [](std::uint64_t a, const n64::source_line& l) {
+                return a<l.address;
+            });
+            if(itr==std::begin(p.lines))return 0;
+            --itr;
+            return itr->line+(address-itr->address);
+        }
+    } /* anonymous */
+
+    /**
+     * split program into basic blocks
+     * @param code instructions
+     * @param entry entry point (starts block)
+     */
+    control_flow_graph::control_flow_graph(const std::vector<n64::instruction::instruction>& code, std::uint64_t entry)
+            : _blocks(), _indirect(std::numeric_limits<std::uint64_t>::max()) {
+        const auto size=code.size();
+        std::vector<bool> leader(size+1, false);
+        leader[0]=true;
+        if(entry<size)leader[entry]=true;
+        if(const auto computed=nd::find_computed_jump(code); computed<size) {
+            _indirect=computed;
+            return;
+        }
+        for(std::size_t i=0; i<size; ++i) {
+            const auto op=nd::decode(code[i]);
+            if(nd::is_direct_jump(op) && op.immediate<size)leader[op.immediate]=true;
+            if(ends_block(op))leader[i+1]=true;
+        }
+
+        for(std::size_t i=0; i<size; ++i) {
+            if(!leader[i])continue;
+            if(!_blocks.empty())_blocks.back().last=i;
+            _blocks.push_back({i, size});
+        }
+        for(std::size_t b=0; b<_blocks.size(); ++b) {
+            auto& block=_blocks[b];
+            const auto op=nd::decode(code[block.last-1]);
+            const bool falls=op.code!=nd::opcode::jmp && op.code!=nd::opcode::ret && op.code!=nd::opcode::hlt;
+            if(falls && block.last<size)block.next=b+1;
+            if(nd::is_direct_jump(op) && op.immediate<size)block.branch=block_of(op.immediate);
+        }
+    }
+
+    /**
+     * block which contains instruction
+     * @param address instruction address
+     * @return block index (basic_block::NONE: out of code)
+     */
+    std::size_t control_flow_graph::block_of(std::uint64_t address)const noexcept {
+        if(_blocks.empty() || address>=_blocks.back().last)return n64::basic_block::NONE;
+        const auto itr=std::upper_bound(std::begin(_blocks), std::end(_blocks), address, [](std::uint64_t a, const n64::basic_block& b) {
+            return a<b.first;
+        });
+        return static_cast<std::size_t>(itr-std::begin(_blocks))-1;
+    }
+
+    /**
+     * whole program optimisation of assembled executable
+     * @param p program (executable)
+     * @return changes and removed instructions
+     */
+    n64::global_report global_optimize(n64::program& p) {
+        n64::global_report report;
+        auto& code=p.code;
+        const auto size=code.size();
+
+        {
+            const n64::control_flow_graph check(code, p.entry);
+            if(!check.exact()) {
+                report.exact=false;
+                report.indirect=check.indirect();
+                return report;
+            }
+        }
+
+        // jumps to jmp go to end of chain (trampolines may become unreachable)
+        for(auto& ins : code) {
+            const auto op=nd::decode(ins);
+            if(!nd::is_direct_jump(op))continue;
+            auto to=op.immediate;
+            for(std::size_t steps=0; to<size && steps<size; ++steps) {
+                const auto next=nd::decode(code[to]);
+                if(next.code!=nd::opcode::jmp || next.immediate==to)break;
+                to=next.immediate;
+            }
+            if(to!=op.immediate) {
+                ins.u.imm.immediate=to;
+                ++report.threaded;
+            }
+        }
+
+        // known register values at block entry, blocks never visited are unreachable
+        const n64::control_flow_graph cfg(code, p.entry);
+        const auto& blocks=cfg.blocks();
+        const bool zero=nd::is_zero_register_constant(code);
+        std::vector<known_t> in(blocks.size());
+        std::vector<bool> visited(blocks.size(), false), queued(blocks.size(), false);
+        std::vector<std::size_t> work;
+        const auto flow=[&](std::size_t b, const registers_t& r) {
+            if(b==n64::basic_block::NONE)return;
+            bool changed;
+            if(!visited[b]) {
+                visited[b]=true;
+                in[b]=compress(r);
+                changed=true;
+            }else{
+                changed=meet(in[b], r);
+            }
+            if(changed && !queued[b]) {
+                queued[b]=true;
+                work.push_back(b);
+            }
+        };
+        registers_t start;
+        start.set(R0, 0);
+        flow(cfg.block_of(p.entry), start);
+        while(!work.empty()) {
+            const auto b=work.back();
+            work.pop_back();
+            queued[b]=false;
+
+            auto r=expand(in[b]);
+            for(auto a=blocks[b].first; a+1<blocks[b].last; ++a) {
+                step(code[a], nd::decode(code[a]), r);
+                if(zero)r.set(R0, 0);
+            }
+            // callee starts with caller values, return site does not know anything
+            const auto& last=code[blocks[b].last-1];
+            const auto op=nd::decode(last);
+            auto before=r;
+            step(last, op, r);
+            if(zero)r.set(R0, 0);
+            if(op.code==nd::opcode::call) {
+                before.forget(SP);
+                flow(blocks[b].branch, before);
+            }else{
+                flow(blocks[b].branch, r);
+            }
+            flow(blocks[b].next, r);
+        }
+
+        // rewrite with known values
+        std::vector<const char *> removed(size, nullptr);
+        for(std::size_t b=0; b<blocks.size(); ++b) {
+            if(!visited[b]) {
+                for(auto a=blocks[b].first; a<blocks[b].last; ++a) {
+                    removed[a]="unreachable";
+                    ++report.unreachable;
+                }
+                continue;
+            }
+            auto r=expand(in[b]);
+            for(auto a=blocks[b].first; a<blocks[b].last; ++a) {
+                const auto op=nd::decode(code[a]);
+                std::uint64_t value, current;
+                if(evaluate(op, r, value)) {
+                    if(r.get(op.destination, current) && current==value) {
+                        removed[a]="constant";
+                        ++report.constant;
+                    }else if(op.code!=nd::opcode::asgn && op.code!=nd::opcode::inc && op.code!=nd::opcode::dec && value<nd::RI_LIMIT) {
+                        n64::instruction::instruction asgn={};
+                        asgn.instruction.type=n64::instruction::REGISTER_IMMEDIATE;
+                        asgn.instruction.instruction=0b00000;
+                        asgn.ri.reg=op.destination;
+                        asgn.ri.immediate=value;
+                        code[a]=asgn;
+                        ++report.folded;
+                    }
+                }
+                step(code[a], op, r);
+                if(zero)r.set(R0, 0);
+            }
+        }
+
+        // jumps whose target is the next kept instruction
+        for(bool changed=true; changed;) {
+            changed=false;
+            std::vector<std::uint64_t> kept(size+1, 0);     // kept instructions before address
+            for(std::size_t i=0; i<size; ++i) {
+                kept[i+1]=kept[i]+(removed[i]==nullptr ? 1 : 0);
+            }
+            for(std::size_t i=0; i<size; ++i) {
+                if(removed[i]!=nullptr)continue;
+                const auto op=nd::decode(code[i]);
+                if(op.code!=nd::opcode::jmp && !(op.code>=nd::opcode::je && op.code<=nd::opcode::jbe))continue;
+                if(op.immediate>i && op.immediate<=size && kept[op.immediate]==kept[i]+1) {
+                    removed[i]="jump to next";
+                    ++report.jumps;
+                    changed=true;
+                }
+            }
+        }
+
+        std::vector<bool> remove(size, false);
+        for(std::size_t i=0; i<size; ++i) {
+            if(removed[i]==nullptr)continue;
+            remove[i]=true;
+            report.removed.push_back({i, line_of(p, i), code[i], removed[i]});
+        }
+        if(!report.removed.empty()) {
+            n64::remove_instructions(p, remove);
+        }
+        return report;
+    }
+} /* n64 */
@@ -0,0 +1,147 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef N64_EMU_GLOBAL_OPTIMIZER_HPP
+#define N64_EMU_GLOBAL_OPTIMIZER_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <limits>
+#include <vector>
+#include <string>
+
+#include "instruction.hpp"
+#include "binary.hpp"
+
+namespace n64 {
+    /**
+     * straight line instructions [first, last)
+     */
+    struct basic_block {
+        static constexpr std::size_t NONE=std::numeric_limits<std::size_t>::max();
+
+        std::uint64_t first, last;
+        std::size_t next=NONE;          // fall through block (return site of call)
+        std::size_t branch=NONE;        // jump or call target block
+    };
+
+    /**
+     * control flow graph of whole program.
+     * every call, jmp and j* target is an absolute address, so the graph is exact unless the program
+     * jumps through registers or memory or uses IP as operand (indirect()).
+     * ret returns to the instruction after a call, so programs with ret which may put other values
+     * on stack (push; ret jumps to pushed address) are not exact either (decoder::find_computed_jump).
+     */
+    class control_flow_graph {
+    private:
+        std::vector<n64::basic_block> _blocks;
+        std::uint64_t _indirect;
+
+    public:
+        control_flow_graph()=delete;
+
+        /**
+         * split program into basic blocks
+         * @param code instructions
+         * @param entry entry point (starts block)
+         */
+        control_flow_graph(const std::vector<n64::instruction::instruction>& code, std::uint64_t entry);
+
+    public:
+        /**
+         * basic blocks in address order
+         * @return blocks
+         */
+        const std::vector<n64::basic_block>& blocks()const noexcept {
+            return _blocks;
+        }
+
+        /**
+         * block which contains instruction
+         * @param address instruction address
+         * @return block index (basic_block::NONE: out of code)
+         */
+        std::size_t block_of(std::uint64_t address)const noexcept;
+
+        /**
+         * all control transfers are known
+         * @return no indirect jump
+         */
+        bool exact()const noexcept {
+            return _indirect==std::numeric_limits<std::uint64_t>::max();
+        }
+
+        /**
+         * first instruction which makes a jump target unknown
+         * @return address
+         */
+        std::uint64_t indirect()const noexcept {
+            return _indirect;
+        }
+    };
+
+    /**
+     * instruction removed by global optimisation
+     */
+    struct removed_instruction {
+        std::uint64_t address;                          // address before optimisation
+        std::uint64_t line;                             // source line (0: unknown)
+        n64::instruction::instruction instruction;
+        const char *reason;
+    };
+
+    /**
+     * what global optimisation changed
+     */
+    struct global_report {
+        bool exact=true;                // control flow graph was exact (false: nothing changed)
+        std::uint64_t indirect=0;       // first instruction which makes a jump target unknown when not exact
+        std::uint64_t unreachable=0;    // instructions in unreachable blocks
+        std::uint64_t constant=0;       // instructions assigning value the register already has
+        std::uint64_t jumps=0;          // jumps to next instruction
+        std::uint64_t threaded=0;       // jumps retargeted past jmp chains
+        std::uint64_t folded=0;         // add/sub/shl/asgnh/asgnl of known values rewritten to asgn
+        std::vector<n64::removed_instruction> removed;
+
+        /**
+         * one line summary
+         * @return text
+         */
+        std::string str()const {
+            if(!exact) {
+                return "not optimised, jump target computed at "+std::to_string(indirect)
+                       +" (indirect jump, IP operand, or ret with values pushed on stack)";
+            }
+            return std::to_string(removed.size())+" instructions removed (unreachable "+std::to_string(unreachable)
+                   +", constant "+std::to_string(constant)+", jump to next "+std::to_string(jumps)+"), "
+                   +std::to_string(threaded)+" jumps threaded, "+std::to_string(folded)+" instructions folded into asgn";
+        }
+    };
+
+    /**
+     * whole program optimisation of assembled executable.
+     * builds control flow graph from entry, retargets jumps past chains of jmp, propagates register
+     * constants through asgn, asgnh, asgnl, add, sub, shl, inc, dec and mov along the graph, rewrites
+     * instructions with known result into asgn, removes assignments of values the register already has,
+     * unreachable blocks and jumps to the next instruction.
+     * only r0 is known at entry, calls forget every register (callee may change them).
+     * programs with indirect jumps or computed returns (push; ret) are left as they are.
+     * @param p program (executable)
+     * @return changes and removed instructions
+     */
+    n64::global_report global_optimize(n64::program& p);
+} /* n64 */
+
+#endif //N64_EMU_GLOBAL_OPTIMIZER_HPP
@@ -17,6 +17,24 @@
 #define N64_EMU_INSTRUCTION_HPP
 
 #include <cstdint>
+#include <array>
+
+/**
+ * instruction list.
+ * X(mnemonic, type, number) is expanded for every instruction (assembler instruction map, disassembler table, mnemonic).
+ */
+#define N64_INSTRUCTIONS(X) \
+    X("add", THREE_ADDRESS, 0b00000) X("sub", THREE_ADDRESS, 0b00001) X("mul", THREE_ADDRESS, 0b00010) \
+    X("div", THREE_ADDRESS, 0b00011) X("shr", THREE_ADDRESS, 0b00100) X("shl", THREE_ADDRESS, 0b00101) \
+    X("and", THREE_ADDRESS, 0b00110) X("or", THREE_ADDRESS, 0b00111) X("xor", THREE_ADDRESS, 0b01000) \
+    X("not", BINOMIAL, 0b00000) X("xchg", BINOMIAL, 0b00001) X("cmp", BINOMIAL, 0b00010) \
+    X("inc", UNARY, 0b00000) X("dec", UNARY, 0b00001) \
+    X("call", UNARY, 0b00010) X("jmp", UNARY, 0b00011) X("jr", UNARY, 0b00100) \
+    X("je", UNARY, 0b00101) X("jne", UNARY, 0b00110) X("ja", UNARY, 0b00111) \
+    X("jae", UNARY, 0b01000) X("jb", UNARY, 0b01001) X("jbe", UNARY, 0b01010) \
+    X("push", UNARY, 0b01011) X("pop", UNARY, 0b01100) \
+    X("hlt", NO_OPERAND, 0b00000) X("ret", NO_OPERAND, 0b00001) \
+    X("asgn", REGISTER_IMMEDIATE, 0b00000) X("asgnh", REGISTER_IMMEDIATE, 0b00001) X("asgnl", REGISTER_IMMEDIATE, 0b00010)
 
 namespace n64 {
     namespace instruction {
@@ -82,6 +100,23 @@ namespace n64 {
             }__attribute__((__packed__)) instruction;
             std::uint64_t data;
         };
+
+        /**
+         * instruction mnemonic
+         * @param ins instruction
+         * @return mnemonic (nullptr: undefined instruction)
+         */
+        inline const char *mnemonic(const instruction& ins)noexcept {
+            // indexed by opcode byte (type | instruction number << 3)
+            static const auto NAMES=[]() {
+                std::array<const char*, 256> n{};
+#define N64_MNEMONIC(name, type, number) n[(type) | ((number) << 3)]=name;
+                N64_INSTRUCTIONS(N64_MNEMONIC)
+#undef N64_MNEMONIC
+                return n;
+            }();
+            return NAMES[ins.instruction.type | (ins.instruction.instruction << 3)];
+        }
     } /* instruction */
 
     namespace reg {
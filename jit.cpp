@@ -0,0 +1,441 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <cstring>
+#include <initializer_list>
+
+#include <sys/mman.h>
+
+#include "jit.hpp"
+
+
+namespace n64 {
+    namespace jit {
+        namespace {
+            /**
+             * x86-64 register numbers
+             */
+            enum host : std::uint8_t {
+                RAX=0, RCX=1, RDX=2, RBX=3, RSP=4, RBP=5, RSI=6, RDI=7,
+                R8=8, R9=9, R10=10, R11=11, R12=12, R13=13, R14=14, R15=15
+            };
+            // pinned registers
+            constexpr host REGISTERS=RBX, CONTEXT=R12, FLAGS=R13;
+
+            /**
+             * x86-64 machine code writer
+             */
+            class emitter {
+            private:
+                std::vector<std::uint8_t> _code;
+                std::vector<std::size_t> _epilogue_fixups;
+
+            public:
+                const std::vector<std::uint8_t>& code()const noexcept {
+                    return _code;
+                }
+                std::size_t position()const noexcept {
+                    return _code.size();
+                }
+
+                void byte(std::uint8_t b) {
+                    _code.emplace_back(b);
+                }
+                void dword(std::uint32_t d) {
+                    for(int i=0; i<4; ++i) {
+                        byte(static_cast<std::uint8_t>(d>>(i*8)));
+                    }
+                }
+                void qword(std::uint64_t q) {
+                    for(int i=0; i<8; ++i) {
+                        byte(static_cast<std::uint8_t>(q>>(i*8)));
+                    }
+                }
+                void patch(std::size_t pos, std::uint32_t d) {
+                    for(int i=0; i<4; ++i) {
+                        _code[pos+i]=static_cast<std::uint8_t>(d>>(i*8));
+                    }
+                }
+
+                /**
+                 * instruction with memory operand [base+disp32]
+                 * @param opcode opcode bytes
+                 * @param r ModRM reg field (register or opcode extension)
+                 * @param base base register
+                 * @param disp displacement
+                 * @param wide use 64bit operand size
+                 */
+                void memory(std::initializer_list<std::uint8_t> opcode, unsigned r, host base, std::int32_t disp, bool wide=true) {
+                    const std::uint8_t rex=(wide ? 0x48 : 0x40) | ((r & 8) ? 0x04 : 0) | ((base & 8) ? 0x01 : 0);
+                    if(rex!=0x40)byte(rex);
+                    for(auto o : opcode)byte(o);
+                    byte(static_cast<std::uint8_t>(0x80 | ((r & 7)<<3) | (base & 7)));
+                    if((base & 7)==RSP)byte(0x24);
+                    dword(static_cast<std::uint32_t>(disp));
+                }
+                /**
+                 * instruction with register operand
+                 * @param opcode opcode bytes
+                 * @param r ModRM reg field (register or opcode extension)
+                 * @param rm ModRM r/m register
+                 * @param wide use 64bit operand size
+                 */
+                void direct(std::initializer_list<std::uint8_t> opcode, unsigned r, host rm, bool wide=true) {
+                    const std::uint8_t rex=(wide ? 0x48 : 0x40) | ((r & 8) ? 0x04 : 0) | ((rm & 8) ? 0x01 : 0);
+                    if(rex!=0x40)byte(rex);
+                    for(auto o : opcode)byte(o);
+                    byte(static_cast<std::uint8_t>(0xc0 | ((r & 7)<<3) | (rm & 7)));
+                }
+
+                // guest register access
+                void load(host r, unsigned guest) {
+                    memory({0x8b}, r, REGISTERS, static_cast<std::int32_t>(guest*8));
+                }
+                void store(unsigned guest, host r) {
+                    memory({0x89}, r, REGISTERS, static_cast<std::int32_t>(guest*8));
+                }
+                void immediate(host r, std::uint64_t imm) {
+                    byte(static_cast<std::uint8_t>(0x48 | ((r & 8) ? 0x01 : 0)));
+                    byte(static_cast<std::uint8_t>(0xb8 | (r & 7)));
+                    qword(imm);
+                }
+
+                // control transfer
+                void jump_epilogue() {
+                    byte(0xe9);
+                    _epilogue_fixups.emplace_back(position());
+                    dword(0);
+                }
+                void jump(std::size_t to) {
+                    byte(0xe9);
+                    dword(static_cast<std::uint32_t>(to-(position()+4)));
+                }
+                /**
+                 * forward conditional jump
+                 * @param cc condition code
+                 * @return fixup position
+                 */
+                std::size_t jump_if(std::uint8_t cc) {
+                    byte(0x0f);
+                    byte(static_cast<std::uint8_t>(0x80 | cc));
+                    auto pos=position();
+                    dword(0);
+                    return pos;
+                }
+                void land(std::size_t fixup) {
+                    patch(fixup, static_cast<std::uint32_t>(position()-(fixup+4)));
+                }
+
+                void prologue() {
+                    byte(0x53);                 // push rbx
+                    byte(0x41); byte(0x54);     // push r12
+                    byte(0x41); byte(0x55);     // push r13
+                    direct({0x89}, RDI, CONTEXT);
+                    memory({0x8b}, REGISTERS, CONTEXT, offsetof(context, registers));
+                    memory({0x8b}, FLAGS, CONTEXT, offsetof(context, flags));
+                }
+                void epilogue() {
+                    for(auto fixup : _epilogue_fixups) {
+                        land(fixup);
+                    }
+                    byte(0x41); byte(0x5d);     // pop r13
+                    byte(0x41); byte(0x5c);     // pop r12
+                    byte(0x5b);                 // pop rbx
+                    byte(0xc3);                 // ret
+                }
+
+                /**
+                 * leave native code (next address is in rax)
+                 * @param slot successor slot
+                 */
+                void leave(std::uint64_t slot) {
+                    memory({0xc7}, 0, CONTEXT, offsetof(context, slot));
+                    dword(static_cast<std::uint32_t>(slot));
+                    jump_epilogue();
+                }
+                /**
+                 * leave native code
+                 * @param slot successor slot
+                 * @param next next address
+                 */
+                void leave(std::uint64_t slot, std::uint64_t next) {
+                    immediate(RAX, next);
+                    leave(slot);
+                }
+
+                // stack callbacks (ip: guest IP after stack operation, dumped if it raises exception)
+                void push(host value, std::uint64_t ip) {
+                    if(value!=RSI)direct({0x89}, value, RSI);
+                    immediate(RDX, ip);
+                    memory({0x8b}, RDI, CONTEXT, offsetof(context, cpu));
+                    memory({0xff}, 2, CONTEXT, offsetof(context, push), false);
+                }
+                void pop(host empty, std::uint64_t ip) {
+                    if(empty!=RSI)direct({0x89}, empty, RSI);
+                    immediate(RDX, ip);
+                    memory({0x8b}, RDI, CONTEXT, offsetof(context, cpu));
+                    memory({0xff}, 2, CONTEXT, offsetof(context, pop), false);
+                }
+            };
+
+            // condition codes
+            constexpr std::uint8_t CC_E=0x4, CC_NE=0x5;
+        } /* anonymous */
+
+        compiler::~compiler() {
+            for(auto& c : _chunks) {
+                munmap(c.memory, CHUNK_SIZE);
+            }
+        }
+
+        /**
+         * translate basic block into native code
+         * @param b basic block
+         * @return native code (nullptr: block has operations which cannot be translated)
+         */
+        n64::basic_block::native_code compiler::compile(const n64::basic_block& b) {
+            using n64::decoder::opcode;
+
+            emitter e;
+            e.prologue();
+            const auto body=e.position();
+
+            // ecx holds equal flag of directly preceding cmp
+            bool compared=false;
+
+            for(const auto *op=b.operations.data(); op!=b.operations.data()+b.operations.size(); ++op) {
+                const auto address=b.address(op);
+                const bool after_compare=compared;
+                compared=false;
+
+                // jump to target, looping inside native code when target is this block
+                const auto jump=[&](std::uint64_t target) {
+                    if(target==b.entry) {
+                        e.jump(body);
+                    }else{
+                        e.leave(n64::basic_block::TAKEN, target);
+                    }
+                };
+                // conditional jump on flags register bits
+                const auto branch=[&](std::uint32_t mask, std::uint8_t taken_cc) {
+                    std::size_t skip;
+                    if(after_compare && mask==1) {
+                        e.direct({0x85}, RCX, RCX, false);  // test ecx, ecx
+                    }else{
+                        e.memory({0xf7}, 0, FLAGS, 0);      // test qword [flags], mask
+                        e.dword(mask);
+                    }
+                    skip=e.jump_if(static_cast<std::uint8_t>(taken_cc ^ 1));
+                    jump(op->immediate);
+                    e.land(skip);
+                    e.leave(n64::basic_block::FALL_THROUGH, address+1);
+                };
+                // TA arithmetic: rax=src1 <op> [src2]
+                const auto arithmetic=[&](std::initializer_list<std::uint8_t> opcode) {
+                    e.load(RAX, op->source1);
+                    e.memory(opcode, RAX, REGISTERS, op->source2*8);
+                    e.store(op->destination, RAX);
+                };
+
+                switch(op->code) {
+                    case opcode::add: arithmetic({0x03}); break;
+                    case opcode::sub: arithmetic({0x2b}); break;
+                    case opcode::mul: arithmetic({0x0f, 0xaf}); break;
+                    case opcode::and_: arithmetic({0x23}); break;
+                    case opcode::or_: arithmetic({0x0b}); break;
+                    case opcode::xor_: arithmetic({0x33}); break;
+                    case opcode::div:
+                        e.load(RAX, op->source1);
+                        e.direct({0x31}, RDX, RDX, false);  // xor edx, edx
+                        e.memory({0xf7}, 6, REGISTERS, op->source2*8);
+                        e.store(op->destination, RAX);
+                        break;
+                    case opcode::shr:
+                        e.load(RAX, op->source1);
+                        e.load(RCX, op->source2);
+                        e.direct({0xd3}, 5, RAX);
+                        e.store(op->destination, RAX);
+                        break;
+                    case opcode::shl:
+                        // same as interpreter: shift count is source1
+                        e.load(RAX, op->source1);
+                        e.direct({0x89}, RAX, RCX);
+                        e.direct({0xd3}, 4, RAX);
+                        e.store(op->destination, RAX);
+                        break;
+
+                    case opcode::mov:
+                        e.load(RAX, op->source1);
+                        e.store(op->destination, RAX);
+                        break;
+                    case opcode::not_:
+                        e.load(RAX, op->source1);
+                        e.direct({0xf7}, 2, RAX);
+                        e.store(op->destination, RAX);
+                        break;
+                    case opcode::xchg:
+                        if(op->destination!=op->source1) {
+                            e.load(RAX, op->destination);
+                            e.load(RCX, op->source1);
+                            e.store(op->destination, RCX);
+                            e.store(op->source1, RAX);
+                        }
+                        break;
+                    case opcode::cmp:
+                    case opcode::cmp_je:
+                    case opcode::cmp_jne:
+                    case opcode::cmp_ja:
+                    case opcode::cmp_jae:
+                    case opcode::cmp_jb:
+                    case opcode::cmp_jbe:
+                        // fused branch is translated by following operation, which reuses ecx
+                        // flags.equal(op1==op2) is overwritten by flags.equal(op1>op2) in the interpreter
+                        e.load(RAX, op->destination);
+                        e.memory({0x3b}, RAX, REGISTERS, op->source1*8);
+                        e.direct({0x0f, 0x97}, 0, RCX, false);      // seta cl
+                        e.direct({0x0f, 0xb6}, RCX, RCX, false);    // movzx ecx, cl
+                        e.memory({0x83}, 4, FLAGS, 0);              // and qword [flags], ~1
+                        e.byte(0xfe);
+                        e.memory({0x09}, RCX, FLAGS, 0);            // or [flags], rcx
+                        compared=true;
+                        break;
+
+                    case opcode::inc:
+                        e.memory({0xff}, 0, REGISTERS, op->destination*8);
+                        break;
+                    case opcode::dec:
+                        e.memory({0xff}, 1, REGISTERS, op->destination*8);
+                        break;
+                    case opcode::push:
+                        e.load(RSI, op->destination);
+                        e.push(RSI, address+1);
+                        break;
+                    case opcode::push_immediate:
+                        e.immediate(RSI, op->immediate);
+                        e.push(RSI, address+1);
+                        break;
+                    case opcode::pop:
+                        e.load(RSI, op->destination);
+                        e.pop(RSI, address+1);
+                        e.store(op->destination, RAX);
+                        break;
+                    case opcode::pop_discard:
+                        e.pop(RSI, address+1);
+                        break;
+
+                    case opcode::call:
+                        e.immediate(RSI, address+1);
+                        e.push(RSI, address+1);
+                        jump(op->immediate);
+                        break;
+                    case opcode::call_register:
+                        e.immediate(RSI, address+1);
+                        e.push(RSI, address+1);
+                        e.load(RAX, op->destination);
+                        e.leave(n64::basic_block::INDIRECT);
+                        break;
+                    case opcode::jmp:
+                        jump(op->immediate);
+                        break;
+                    case opcode::jmp_register:
+                        e.load(RAX, op->destination);
+                        e.leave(n64::basic_block::INDIRECT);
+                        break;
+                    case opcode::je: branch(1, CC_NE); break;
+                    case opcode::jne: branch(1, CC_E); break;
+                    case opcode::ja: branch(2, CC_NE); break;
+                    case opcode::jae: branch(3, CC_NE); break;
+                    case opcode::jb: branch(3, CC_E); break;
+                    case opcode::jbe: branch(2, CC_E); break;
+
+                    case opcode::hlt:
+                        e.memory({0x83}, 1, FLAGS, 0);      // or qword [flags], 4
+                        e.byte(0x04);
+                        e.leave(HALTED, address+1);
+                        break;
+                    case opcode::ret:
+                        e.immediate(RSI, address+1);
+                        e.pop(RSI, address+1);
+                        e.leave(n64::basic_block::INDIRECT);
+                        break;
+
+                    case opcode::asgn_pair:
+                        e.immediate(RAX, op->immediate);
+                        e.store(op->destination, RAX);
+                        ++op;   // second operation of pair
+                        break;
+                    case opcode::asgn:
+                        e.immediate(RAX, op->immediate);
+                        e.store(op->destination, RAX);
+                        break;
+                    case opcode::asgnh:
+                        e.load(RAX, op->destination);
+                        e.direct({0x89}, RAX, RAX, false);  // mov eax, eax
+                        e.immediate(RCX, (op->immediate & 0xffffffff)<<32);
+                        e.direct({0x09}, RCX, RAX);
+                        e.store(op->destination, RAX);
+                        break;
+                    case opcode::asgnl:
+                        e.load(RAX, op->destination);
+                        e.immediate(RCX, 0xffffffffULL<<32);
+                        e.direct({0x21}, RCX, RAX);
+                        e.byte(0xb9);                       // mov ecx, imm32
+                        e.dword(static_cast<std::uint32_t>(op->immediate & 0xffffffff));
+                        e.direct({0x09}, RCX, RAX);
+                        e.store(op->destination, RAX);
+                        break;
+
+                    case opcode::nop:
+                        break;
+                    case opcode::exit:
+                        e.leave(n64::basic_block::FALL_THROUGH, b.end);
+                        break;
+
+                    case opcode::generic:
+                    default:
+                        return nullptr;
+                }
+            }
+            e.epilogue();
+
+            return reinterpret_cast<n64::basic_block::native_code>(_install(e.code()));
+        }
+
+        /**
+         * copy code into executable memory
+         * @param code machine code
+         * @return executable address
+         */
+        void *compiler::_install(const std::vector<std::uint8_t>& code) {
+            const auto size=(code.size()+15) & ~static_cast<std::size_t>(15);
+            if(size>CHUNK_SIZE)return nullptr;
+
+            if(_chunks.empty() || _chunks.back().used+size>CHUNK_SIZE) {
+                void *memory=mmap(nullptr, CHUNK_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if(memory==MAP_FAILED)return nullptr;
+                _chunks.emplace_back(chunk{static_cast<std::uint8_t*>(memory), 0});
+            }
+
+            auto& c=_chunks.back();
+            if(mprotect(c.memory, CHUNK_SIZE, PROT_READ | PROT_WRITE)!=0)return nullptr;
+            auto address=c.memory+c.used;
+            std::memcpy(address, code.data(), code.size());
+            c.used+=size;
+            mprotect(c.memory, CHUNK_SIZE, PROT_READ | PROT_EXEC);
+
+            return address;
+        }
+    } /* jit */
+} /* n64 */
@@ -0,0 +1,88 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef N64_EMU_JIT_HPP
+#define N64_EMU_JIT_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include "block_cache.hpp"
+
+namespace n64 {
+    namespace jit {
+        /**
+         * state shared between emulator and native code.
+         * native code keeps registers pointer and flags pointer in pinned host registers.
+         */
+        struct context {
+            std::uint64_t *registers;   // cpu registers
+            std::uint64_t *flags;       // flags register value
+            std::uint64_t slot;         // successor slot of last exit (HALTED: hlt executed)
+            void *cpu;                  // argument of stack callbacks
+            void (*push)(void *cpu, std::uint64_t value, std::uint64_t ip);
+            std::uint64_t (*pop)(void *cpu, std::uint64_t empty, std::uint64_t ip);    // returns empty if stack is empty
+        };
+
+        /**
+         * exit slot of hlt
+         */
+        constexpr std::uint64_t HALTED=n64::basic_block::SUCCESSORS;
+
+        /**
+         * x86-64 translator of basic blocks
+         * translated code is placed in mmap'd buffers which are never writable and executable at the same time.
+         * remove: copy & move constructors and copy & move assign operators.
+         */
+        class compiler {
+        private:
+            static constexpr std::size_t CHUNK_SIZE=1<<20;
+
+            struct chunk {
+                std::uint8_t *memory;
+                std::size_t used;
+            };
+            std::vector<chunk> _chunks;
+
+        public:
+            compiler()=default;
+            ~compiler();
+            compiler(const compiler&)=delete;
+            compiler(compiler&&)=delete;
+
+            compiler& operator=(const compiler&)=delete;
+            compiler& operator=(compiler&&)=delete;
+
+        public:
+            /**
+             * translate basic block into native code
+             * @param b basic block
+             * @return native code (nullptr: block has operations which cannot be translated)
+             */
+            n64::basic_block::native_code compile(const n64::basic_block& b);
+
+        private:
+            /**
+             * copy code into executable memory
+             * @param code machine code
+             * @return executable address
+             */
+            void *_install(const std::vector<std::uint8_t>& code);
+        };
+    } /* jit */
+} /* n64 */
+
+#endif //N64_EMU_JIT_HPP
@@ -0,0 +1,124 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <string_view>
+#include <atomic>
+#include <thread>
+
+#include "linker.hpp"
+
+namespace n64 {
+    namespace {
+        using symbol_map_t=std::unordered_map<std::string_view, std::uint64_t>;
+
+        /**
+         * label is local to its object
+         * @param name label
+         * @return starts with '.'
+         */
+        bool is_local(std::string_view name)noexcept {
+            return !name.empty() && name[0]=='.';
+        }
+    } /* anonymous */
+
+    /**
+     * link objects into one program
+     * @param objects objects (addresses relative to start of object)
+     * @param names object file names (for errors)
+     * @param jobs threads applying relocations
+     * @param errors undefined and duplicate symbols (empty: linked)
+     * @return program (entry 0)
+     */
+    n64::program link(const std::vector<n64::program>& objects, const std::vector<std::string>& names,
+                      std::size_t jobs, std::vector<std::string>& errors) {
+        n64::program p;
+
+        // layout and exported symbols
+        std::vector<std::uint64_t> base(objects.size());
+        std::uint64_t size=0;
+        std::size_t symbols=0;
+        for(std::size_t i=0; i<objects.size(); ++i) {
+            base[i]=size;
+            size+=objects[i].code.size();
+            symbols+=objects[i].symbols.size();
+        }
+        p.code.resize(size);
+
+        symbol_map_t exported;
+        std::unordered_map<std::string_view, std::size_t> owner;
+        exported.reserve(symbols);
+        p.symbols.reserve(symbols);
+        for(std::size_t i=0; i<objects.size(); ++i) {
+            for(const auto& s : objects[i].symbols) {
+                p.symbols.push_back({s.name, base[i]+s.address});
+                if(is_local(s.name))continue;
+                if(!exported.emplace(s.name, base[i]+s.address).second) {
+                    errors.push_back("symbol \""+s.name+"\" is defined in "+names[owner[s.name]]+" and "+names[i]);
+                }else{
+                    owner.emplace(s.name, i);
+                }
+            }
+        }
+
+        // code and relocations, every object is written by one thread
+        std::vector<std::vector<std::string>> unresolved(objects.size());
+        std::atomic<std::size_t> next(0);
+        const auto apply=[&]() {
+            for(auto i=next++; i<objects.size(); i=next++) {
+                const auto& o=objects[i];
+                std::copy(std::begin(o.code), std::end(o.code), std::begin(p.code)+static_cast<std::ptrdiff_t>(base[i]));
+
+                symbol_map_t local;
+                for(const auto& s : o.symbols) {
+                    if(is_local(s.name))local.emplace(s.name, base[i]+s.address);
+                }
+                std::unordered_set<std::string_view> reported;
+                for(const auto& r : o.relocations) {
+                    const auto& table=is_local(r.symbol) ? local : exported;
+                    const auto itr=table.find(r.symbol);
+                    if(r.address>=o.code.size()) {
+                        unresolved[i].push_back("relocation at "+std::to_string(r.address)+" is out of code of "+names[i]);
+                    }else if(itr==std::end(table)) {
+                        if(reported.insert(r.symbol).second) {
+                            unresolved[i].push_back("undefined symbol \""+r.symbol+"\" (referenced from "+names[i]+")");
+                        }
+                    }else{
+                        p.code[base[i]+r.address].u.imm.immediate=itr->second;
+                    }
+                }
+            }
+        };
+        std::vector<std::thread> threads;
+        for(std::size_t t=1; t<std::min(jobs, objects.size()); ++t) {
+            threads.emplace_back(apply);
+        }
+        apply();
+        for(auto& t : threads) {
+            t.join();
+        }
+        for(auto& u : unresolved) {
+            errors.insert(std::end(errors), std::begin(u), std::end(u));
+        }
+
+        if(objects.size()==1) {
+            p.source=objects[0].source;
+            p.lines=objects[0].lines;
+        }
+        return p;
+    }
+} /* n64 */
@@ -0,0 +1,41 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef N64_EMU_LINKER_HPP
+#define N64_EMU_LINKER_HPP
+
+#include <cstddef>
+#include <vector>
+#include <string>
+
+#include "binary.hpp"
+
+namespace n64 {
+    /**
+     * link objects into one program.
+     * objects are placed in given order, exported labels go to one hash table and
+     * relocations of every object are applied by separate threads.
+     * line table is kept for a single object only (it has one source name).
+     * @param objects objects (addresses relative to start of object)
+     * @param names object file names (for errors)
+     * @param jobs threads applying relocations
+     * @param errors undefined and duplicate symbols (empty: linked)
+     * @return program (entry 0)
+     */
+    n64::program link(const std::vector<n64::program>& objects, const std::vector<std::string>& names,
+                      std::size_t jobs, std::vector<std::string>& errors);
+} /* n64 */
+
+#endif //N64_EMU_LINKER_HPP
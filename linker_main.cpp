@@ -0,0 +1,117 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <system_error>
+#include <exception>
+
+#include "cmdline.hpp"
+
+#include "binary.hpp"
+#include "linker.hpp"
+
+int main(int argc, char **argv) {
+    std::cout<<"N64 Linker"<<std::endl;
+    std::cout<<"Version: "<<1<<std::endl;
+
+    cmdline::parser parser;
+    parser.add<std::string>("output", 'o', "output file", false, "a.n64");
+    parser.add<std::string>("format", 'f', "output format (n64: container, raw: instructions only)", false, "n64",
+                            cmdline::oneof<std::string>("n64", "raw"));
+    parser.add<std::string>("entry", 'e', "label of entry point", false, "");
+    parser.add<std::size_t>("jobs", 'j', "threads loading objects and applying relocations (0: number of cores)", false, 1);
+    parser.footer("object ...");
+
+    parser.parse_check(argc, argv);
+    const auto& inputs=parser.rest();
+    if(inputs.empty()) {
+        std::cerr<<"error: no object file"<<std::endl<<parser.usage();
+        return EXIT_FAILURE;
+    }
+    auto jobs=parser.get<std::size_t>("jobs");
+    if(jobs==0) {
+        jobs=std::max(1U, std::thread::hardware_concurrency());
+    }
+
+    // objects are loaded in parallel, errors are reported in command line order
+    std::vector<n64::program> objects(inputs.size());
+    std::vector<std::string> load_errors(inputs.size());
+    std::atomic<std::size_t> next(0);
+    const auto load=[&]() {
+        for(auto i=next++; i<inputs.size(); i=next++) {
+            try {
+                objects[i]=n64::load_object(inputs[i]);
+            }catch(const std::exception& e) {
+                load_errors[i]=e.what();
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for(std::size_t t=1; t<std::min(jobs, inputs.size()); ++t) {
+        threads.emplace_back(load);
+    }
+    load();
+    for(auto& t : threads) {
+        t.join();
+    }
+    bool loaded=true;
+    for(const auto& e : load_errors) {
+        if(e.empty())continue;
+        std::cerr<<"error: "<<e<<std::endl;
+        loaded=false;
+    }
+    if(!loaded) {
+        return EXIT_FAILURE;
+    }
+
+    std::vector<std::string> errors;
+    auto program=n64::link(objects, inputs, jobs, errors);
+    for(const auto& e : errors) {
+        std::cerr<<"error: "<<e<<std::endl;
+    }
+    if(!errors.empty()) {
+        return EXIT_FAILURE;
+    }
+
+    const auto entry=parser.get<std::string>("entry");
+    if(!entry.empty()) {
+        auto itr=std::find_if(std::begin(program.symbols), std::end(program.symbols), [&entry](const n64::symbol& s) {
+            return s.name==entry;
+        });
+        if(itr==std::end(program.symbols)) {
+            std::cerr<<"error: undefined entry point \""<<entry<<"\""<<std::endl;
+            return EXIT_FAILURE;
+        }
+        program.entry=itr->address;
+    }
+
+    const auto output=parser.get<std::string>("output");
+    try {
+        if(parser.get<std::string>("format")=="raw") {
+            n64::save_binary(output, program.code);
+        }else{
+            n64::save_program(output, program);
+        }
+    }catch(const std::system_error& e) {
+        std::cerr<<"error: "<<e.what()<<std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,620 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef N64_EMU_MACHINE_HPP
+#define N64_EMU_MACHINE_HPP
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "instruction.hpp"
+#include "binary.hpp"
+#include "symbol_table.hpp"
+#include "memory.hpp"
+#include "paged_memory.hpp"
+
+namespace n64 {
+    /**
+     * flags register
+     */
+    class flags {
+    private:
+        std::uint64_t _value;
+
+    private:
+        /**
+         * set bit
+         * @param bit bit index
+         * @param w 1 (true) or 0 (false)
+         */
+        void _set(int bit, bool w)noexcept {
+            if(w) {
+                _value |= 1ULL<<bit;
+            }else{
+                _value &= ~(1ULL<<bit);
+            }
+        }
+        /**
+         * get bit
+         * @param bit bit index
+         * @return 1 (true) or 0 (false)
+         */
+        bool _get(int bit)const noexcept {
+            return (_value & (1ULL<<bit)) != 0;
+        }
+
+    public:
+        flags() : _value(0) {}
+
+        /**
+         * set equal flag
+         * @param w 0 or 1
+         */
+        void equal(bool w)noexcept {
+            _set(0, w);
+        }
+        /**
+         * get equal flag
+         * @return 0 or 1
+         */
+        bool equal()const noexcept {
+            return _get(0);
+        }
+
+        /**
+         * set above flag
+         * @param w 0 or 1
+         */
+        void above(bool w)noexcept {
+            _set(1, w);
+        }
+        /**
+         * get above flag
+         * @return 0 or 1
+         */
+        bool above()const noexcept {
+            return _get(1);
+        }
+
+        /**
+         * set halt flag
+         * @param w 0 or 1
+         */
+        void halt(bool w)noexcept {
+            _set(2, w);
+        }
+        /**
+         * get halt flag
+         * @return 0 or 1
+         */
+        bool halt()const noexcept {
+            return _get(2);
+        }
+
+        /**
+         * raw register value (used by native code)
+         * @return register value
+         */
+        std::uint64_t *data()noexcept {
+            return &_value;
+        }
+
+        /**
+         * dump flags register data
+         * @return dumped string
+         */
+        std::string dump() {
+            std::string s;
+            if(equal()) {
+                s+="e";
+            }else{
+                s+="-";
+            }
+            if(above()) {
+                s+="a";
+            }else{
+                s+="-";
+            }
+            if(halt()) {
+                s+="h";
+            }else{
+                s+="-";
+            }
+            return s;
+        }
+    };
+
+    /**
+     * guest stack.
+     * preallocated region (guard pages included) placed just below TOP in guest address space.
+     * stack grows downward, sp register points last pushed value.
+     * remove: default constructor, copy & move constructors and copy & move assign operators.
+     */
+    class stack {
+    public:
+        static constexpr std::uint64_t TOP=std::uint64_t(1) << 63;
+        static constexpr std::size_t DEFAULT_SIZE=1<<20;
+
+    private:
+        n64::memory _region;
+        std::uint64_t _bottom;  // guest address of lowest byte
+
+    public:
+        stack()=delete;
+        /**
+         * @param size stack size in bytes (rounded up to page size)
+         */
+        explicit stack(std::size_t size) : _region(size), _bottom(TOP-_region.size()) {}
+        stack(const stack&)=delete;
+        stack(stack&&)=delete;
+
+        stack& operator=(const stack&)=delete;
+        stack& operator=(stack&&)=delete;
+
+    public:
+        /**
+         * initial stack pointer
+         * @return guest address one past the highest byte
+         */
+        std::uint64_t top()const noexcept {
+            return TOP;
+        }
+
+        /**
+         * read 64bit value (addresses below stack wrap around and are rejected)
+         * @param address guest address
+         * @param value read value
+         * @return address is in stack
+         */
+        bool load(std::uint64_t address, std::uint64_t& value)const noexcept {
+            return _region.load(address-_bottom, value);
+        }
+
+        /**
+         * write 64bit value
+         * @param address guest address
+         * @param value value
+         * @return address is in stack
+         */
+        bool store(std::uint64_t address, std::uint64_t value)noexcept {
+            return _region.store(address-_bottom, value);
+        }
+    };
+
+    /**
+     * architectural state and reference semantics of one instruction.
+     * shared by every emulator engine and by code generated with n64aot.
+     */
+    class machine {
+    public:
+        static constexpr unsigned IP=n64::reg::id::IP, FLAGS=n64::reg::id::FLAGS,
+                RS_FIRST=n64::reg::id::RS[0], RS_LAST=n64::reg::id::RS[31],
+                RT_FIRST=n64::reg::id::RT[0], RT_LAST=n64::reg::id::RT[31];
+        static constexpr unsigned SP=n64::reg::id::SP, BP=n64::reg::id::BP;
+        static constexpr int UD=0, MEMORY=1, STACK_OVERFLOW=2, STACK_UNDERFLOW=3;
+    protected:
+        std::uint64_t _registers[128];
+        n64::flags _flags;
+
+        n64::memory _memory;
+        std::unique_ptr<n64::paged_memory> _paged;  // paged memory model (nullptr: flat memory model)
+        n64::stack _stack;
+        const n64::symbol_table *_symbols;          // symbolizes exception dumps (nullptr: raw addresses)
+
+    public:
+        /**
+         * @param memory_size guest memory size in bytes (paged: maximum bytes of allocated pages)
+         * @param model memory model
+         * @param huge_pages back flat guest memory with transparent huge pages
+         * @param stack_size stack size in bytes
+         */
+        explicit machine(std::size_t memory_size=n64::memory::DEFAULT_SIZE,
+                         n64::memory_model model=n64::memory_model::flat, bool huge_pages=false,
+                         std::size_t stack_size=n64::stack::DEFAULT_SIZE)
+                : _registers(), _flags(),
+                  _memory(model==n64::memory_model::flat ? memory_size : 0, huge_pages),
+                  _paged(model==n64::memory_model::paged ? std::make_unique<n64::paged_memory>(memory_size) : nullptr),
+                  _stack(stack_size), _symbols(nullptr) {
+            _registers[SP]=_registers[BP]=_stack.top();
+        }
+
+    public:
+        /**
+         * check halted
+         * @return is halted
+         */
+        bool halted()const noexcept {
+            return _flags.halt();
+        }
+
+        /**
+         * dump cpu info
+         * @return current cpu info
+         */
+        std::string dump() {
+            std::stringstream ss;
+            ss
+                    <<"======== ======== ======== dump ======== ======== ========\n"<<std::hex
+                    <<" IP   = 0x"<<std::setw(16)<<std::setfill('0')<<_registers[IP]<<std::setw(0)<<"  FLAGS = "<<_flags.dump()<<std::endl
+                    <<" SP   = 0x"<<std::setw(16)<<std::setfill('0')<<_registers[SP]
+                    <<"  BP   = 0x"<<std::setw(16)<<std::setfill('0')<<_registers[BP]<<std::endl;
+            for(std::size_t i=RS_FIRST; i<=RS_LAST; ++i) {
+                ss<<" RS"<<std::setw(2)<<std::setfill(' ')<<std::dec<<(i-RS_FIRST)<<" = 0x"<<std::setw(16)<<std::setfill('0')<<std::hex<<_registers[i];
+                ++i;
+                ss<<"  RS"<<std::setw(2)<<std::setfill(' ')<<std::dec<<(i-RS_FIRST)<<" = 0x"<<std::setw(16)<<std::setfill('0')<<std::hex<<_registers[i]<<"\n";
+            }
+            for(std::size_t i=RT_FIRST; i<=RT_LAST; ++i) {
+                ss<<" RT"<<std::setw(2)<<std::setfill(' ')<<std::dec<<(i-RT_FIRST)<<" = 0x"<<std::setw(16)<<std::setfill('0')<<std::hex<<_registers[i];
+                ++i;
+                ss<<"  RT"<<std::setw(2)<<std::setfill(' ')<<std::dec<<(i-RT_FIRST)<<" = 0x"<<std::setw(16)<<std::setfill('0')<<std::hex<<_registers[i]<<"\n";
+            }
+            ss<<"======== ======== ======== ---- ======== ======== ========"<<std::endl;
+            return ss.str();
+        }
+
+        /**
+         * raise cpu exception
+         * @param type exception type
+         */
+        void raise_exception(int type) {
+            static const std::string EXCEPT[]={
+                    "undefined instruction", "memory access violation", "stack overflow", "stack underflow"
+            };
+            std::cerr<<"Exception raised: "<<EXCEPT[type]<<std::endl;
+            if(_symbols!=nullptr && _registers[IP]>0) {
+                // IP is already past raising instruction
+                std::cerr<<"  at "<<_symbols->location(_registers[IP]-1)<<std::endl;
+            }
+            std::cerr<<dump()<<std::endl;
+            _flags.halt(false);
+        }
+
+        /**
+         * symbol table used by exception dumps
+         * @param s symbol table (must outlive machine, nullptr: raw addresses)
+         */
+        void symbols(const n64::symbol_table *s)noexcept {
+            _symbols=s;
+        }
+
+        /**
+         * register file
+         * @return registers
+         */
+        std::uint64_t *registers()noexcept {
+            return _registers;
+        }
+
+        /**
+         * place data sections of program in guest memory.
+         * flat memory maps read-only data from file, paged memory copies it into pages.
+         * @param file program file
+         * @param p program loaded from file
+         * @return data fits in memory
+         */
+        bool load_data(const std::string& file, const n64::program& p) {
+            if(!_paged && p.bss_size>0
+               && (p.bss_address>_memory.size() || p.bss_size>_memory.size()-p.bss_address))return false;
+            if(p.rodata_size==0)return true;
+
+            const int fd=open(file.c_str(), O_RDONLY);
+            if(fd<0)return false;
+
+            bool loaded=true;
+            if(!_paged) {
+                loaded=_memory.map(fd, p.rodata_offset, p.rodata_size, p.rodata_address);
+            }else{
+                std::vector<std::uint8_t> bytes((p.rodata_size+7) & ~std::uint64_t(7));
+                loaded=pread(fd, bytes.data(), p.rodata_size, static_cast<off_t>(p.rodata_offset))==static_cast<ssize_t>(p.rodata_size);
+                for(std::size_t i=0; loaded && i<bytes.size(); i+=sizeof(std::uint64_t)) {
+                    std::uint64_t word;
+                    std::memcpy(&word, bytes.data()+i, sizeof(word));
+                    loaded=_paged->store(p.rodata_address+i, word);
+                }
+            }
+            close(fd);
+            return loaded;
+        }
+
+        /**
+         * guest memory of flat memory model
+         * @return memory
+         */
+        n64::memory& memory()noexcept {
+            return _memory;
+        }
+
+        /**
+         * guest memory of paged memory model
+         * @return memory (nullptr: flat memory model)
+         */
+        const n64::paged_memory *paged_memory()const noexcept {
+            return _paged.get();
+        }
+
+    protected:
+        /**
+         * push 64bit value (sp-=8)
+         * @param value value
+         */
+        __attribute__((always_inline)) inline void _push(std::uint64_t value) {
+            const auto sp=_registers[SP]-sizeof(value);
+            if(__builtin_expect(!_stack.store(sp, value), 0)) {
+                raise_exception(STACK_OVERFLOW);
+                return;
+            }
+            _registers[SP]=sp;
+        }
+
+        /**
+         * pop 64bit value (sp+=8)
+         * @param value popped value (unchanged if stack is empty)
+         */
+        __attribute__((always_inline)) inline void _pop(std::uint64_t& value) {
+            const auto sp=_registers[SP];
+            if(__builtin_expect(!_stack.load(sp, value), 0)) {
+                raise_exception(STACK_UNDERFLOW);
+                return;
+            }
+            _registers[SP]=sp+sizeof(value);
+        }
+
+    private:
+        /**
+         * read operand
+         * @param pointer register is used as pointer
+         * @param reg register number
+         * @param option index (pointer)
+         * @return value (0 if address is out of memory)
+         */
+        __attribute__((always_inline)) inline std::uint64_t _read(bool pointer, unsigned reg, std::uint64_t option) {
+            if(!pointer)return _registers[reg];
+
+            std::uint64_t value;
+            const auto address=_registers[reg]+option;
+            if(__builtin_expect(!(_paged ? _paged->load(address, value) : _memory.load(address, value)), 0)
+               && !_stack.load(address, value)) {
+                raise_exception(MEMORY);
+                return 0;
+            }
+            return value;
+        }
+
+        /**
+         * write operand
+         * @param pointer register is used as pointer
+         * @param reg register number
+         * @param option index (pointer)
+         * @param value value (ignored if address is out of memory)
+         */
+        __attribute__((always_inline)) inline void _write(bool pointer, unsigned reg, std::uint64_t option, std::uint64_t value) {
+            if(!pointer) {
+                _registers[reg]=value;
+                return;
+            }
+
+            const auto address=_registers[reg]+option;
+            if(__builtin_expect(!(_paged ? _paged->store(address, value) : _memory.store(address, value)), 0)
+               && !_stack.store(address, value)) {
+                raise_exception(MEMORY);
+            }
+        }
+
+    public:
+        /**
+         * run one instruction (IP is already pointing next instruction)
+         * pointer operands ([reg + index]) access guest memory at register value + option.
+         * always inlined, so a constant instruction folds into its own semantics (n64aot)
+         * @param ins instruction
+         */
+        __attribute__((always_inline)) inline void execute(const n64::instruction::instruction& ins) {
+            switch(ins.instruction.type) {
+                case n64::instruction::THREE_ADDRESS:{
+                    const unsigned type=ins.ta.type;
+                    const std::uint64_t src1=_read((type & 0b010)!=0, ins.ta.source1, ins.ta.source1_option);
+                    const std::uint64_t src2=_read((type & 0b001)!=0, ins.ta.source2, ins.ta.source2_option);
+                    std::uint64_t dest;
+
+                    switch(ins.instruction.instruction) {
+                        case 0b00000: // add
+                            dest=src1+src2;
+                            break;
+                        case 0b00001: // sub
+                            dest=src1-src2;
+                            break;
+                        case 0b00010: // mul
+                            dest=src1*src2;
+                            break;
+                        case 0b00011: // div
+                            dest=src1/src2;
+                            break;
+                        case 0b00100: // shr
+                            dest=src1 >> src2;
+                            break;
+                        case 0b00101: // shl
+                            dest=src1 << src1;
+                            break;
+                        case 0b00110: // and
+                            dest=src1 & src2;
+                            break;
+                        case 0b00111: // or
+                            dest=src1 | src2;
+                            break;
+                        case 0b01000: // xor
+                            dest=src1 ^ src2;
+                            break;
+                        default:
+                            raise_exception(UD);
+                            return;
+                    }
+                    _write((type & 0b100)!=0, ins.ta.destination, ins.ta.destination_option, dest);
+                }
+                    break;
+                case n64::instruction::BINOMIAL:{
+                    const bool pointer1=(ins.b.type & 0b10)!=0, pointer2=(ins.b.type & 0b01)!=0;
+
+                    switch(ins.instruction.instruction) {
+                        case 0b00000: // not
+                            _write(pointer1, ins.b.operand1, ins.b.operand1_option,
+                                   ~_read(pointer2, ins.b.operand2, ins.b.operand2_option));
+                            break;
+                        case 0b00001:{ // xchg
+                            const auto op1=_read(pointer1, ins.b.operand1, ins.b.operand1_option);
+                            const auto op2=_read(pointer2, ins.b.operand2, ins.b.operand2_option);
+                            _write(pointer1, ins.b.operand1, ins.b.operand1_option, op2);
+                            _write(pointer2, ins.b.operand2, ins.b.operand2_option, op1);
+                        }
+                            break;
+                        case 0b00010:{ // cmp
+                            const auto op1=_read(pointer1, ins.b.operand1, ins.b.operand1_option);
+                            const auto op2=_read(pointer2, ins.b.operand2, ins.b.operand2_option);
+                            _flags.equal(op1==op2);
+                            _flags.equal(op1 > op2);
+                        }
+                            break;
+                        default:
+                            raise_exception(UD);
+                            return;
+                    }
+                }
+                    break;
+                case n64::instruction::UNARY:{
+                    std::uint64_t data=0;
+                    switch(ins.u.type) {
+                        case 0b00: // register
+                            data=_registers[ins.u.reg.operand];
+                            break;
+                        case 0b01: // pointer
+                            data=_read(true, ins.u.reg.operand, ins.u.reg.operand_option);
+                            break;
+                        case 0b11: // immediate
+                            data=ins.u.imm.immediate;
+                            break;
+                    }
+
+                    bool assign=false, jump=false;
+
+                    switch(ins.instruction.instruction) {
+                        case 0b00000: // inc
+                            ++data;
+                            assign=true;
+                            break;
+                        case 0b00001: // dec
+                            --data;
+                            assign=true;
+                            break;
+                        case 0b01011: // push
+                            _push(data);
+                            break;
+                        case 0b01100: // pop
+                            _pop(data);
+                            assign=true;
+                            break;
+
+                        case 0b00010: // call
+                            _push(_registers[IP]);
+                        case 0b00011: // jmp
+                        case 0b00100: // jr
+                            jump=true;
+                            break;
+                        case 0b00101: // je
+                            jump=_flags.equal();
+                            break;
+                        case 0b00110: // jne
+                            jump=!_flags.equal();
+                            break;
+                        case 0b00111: // ja
+                            jump=_flags.above();
+                            break;
+                        case 0b01000: // jae
+                            jump=_flags.equal() || _flags.above();
+                            break;
+                        case 0b01001: // jb
+                            jump=!_flags.equal() && !_flags.above();
+                            break;
+                        case 0b01010: // jbe
+                            jump=!_flags.above();
+                            break;
+                        default:
+                            raise_exception(UD);
+                            return;
+                    }
+
+                    if(assign) {
+                        switch(ins.u.type) {
+                            case 0b00: // register
+                                _registers[ins.u.reg.operand]=data;
+                                break;
+                            case 0b01: // pointer
+                                _write(true, ins.u.reg.operand, ins.u.reg.operand_option, data);
+                                break;
+                        }
+                    }
+                    if(jump) {
+                        _registers[IP]=data;
+                    }
+                }
+                    break;
+                case n64::instruction::NO_OPERAND:
+                    switch(ins.instruction.instruction) {
+                        case 0b00000: // hlt
+                            _flags.halt(true);
+                            break;
+                        case 0b00001: // ret
+                            _pop(_registers[IP]);
+                            break;
+                        default:
+                            raise_exception(UD);
+                            return;
+                    }
+                    break;
+                case n64::instruction::REGISTER_IMMEDIATE:{
+                    std::uint64_t& reg=_registers[ins.ri.reg];
+                    std::uint64_t imm=ins.ri.immediate;
+
+                    switch(ins.instruction.instruction) {
+                        case 0: // asgn
+                            break;
+                        case 0b00001: // asgnh
+                            imm &= 0xffffffff;
+                            imm <<= 32;
+                            imm |= (reg & 0xffffffff);
+                            break;
+                        case 0b00010: // asgnl
+                            imm &= 0xffffffff;
+                            imm |= (reg & (0xffffffffULL<<32));
+                            break;
+                        default:
+                            raise_exception(UD);
+                            return;
+                    }
+                    reg=imm;
+                }
+                    break;
+            }
+        }
+    };
+} /* n64 */
+
+#endif //N64_EMU_MACHINE_HPP
@@ -0,0 +1,164 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef N64_EMU_MEMORY_HPP
+#define N64_EMU_MEMORY_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cerrno>
+#include <system_error>
+
+#include <sys/mman.h>
+
+namespace n64 {
+    /**
+     * guest memory model
+     * flat: one reserved region, addresses are offsets in it
+     * paged: sparse 48bit address space, pages are allocated on first write
+     */
+    enum class memory_model {
+        flat, paged
+    };
+
+    /**
+     * guest physical memory (flat memory model).
+     * one anonymous mapping, surrounded by inaccessible guard pages.
+     * remove: default constructor, copy & move constructors and copy & move assign operators.
+     */
+    class memory {
+    public:
+        static constexpr std::size_t PAGE_SIZE=4096, HUGE_PAGE_SIZE=2<<20;
+        static constexpr std::size_t DEFAULT_SIZE=16<<20;
+
+    private:
+        std::uint8_t *_mapping;     // whole reservation (guard pages included)
+        std::size_t _mapping_size;
+        std::uint8_t *_base;        // guest address 0
+        std::size_t _size;
+        std::uint64_t _limit;       // last address of 8 bytes access
+
+    public:
+        memory()=delete;
+        /**
+         * map guest memory
+         * @param size memory size in bytes (rounded up to page size)
+         * @param huge_pages use transparent huge pages if available
+         */
+        explicit memory(std::size_t size, bool huge_pages=false) {
+            const std::size_t align=huge_pages ? HUGE_PAGE_SIZE : PAGE_SIZE;
+            _size=size<PAGE_SIZE ? PAGE_SIZE : (size+PAGE_SIZE-1) & ~(PAGE_SIZE-1);
+            _limit=_size-sizeof(std::uint64_t);
+
+            // guard page, memory (aligned), guard page
+            _mapping_size=PAGE_SIZE+align+_size+PAGE_SIZE;
+            void *mapping=mmap(nullptr, _mapping_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if(mapping==MAP_FAILED) {
+                throw std::system_error(errno, std::generic_category(), "cannot reserve guest memory");
+            }
+            _mapping=static_cast<std::uint8_t*>(mapping);
+
+            const auto first=reinterpret_cast<std::uintptr_t>(_mapping)+PAGE_SIZE;
+            _base=reinterpret_cast<std::uint8_t*>((first+align-1) & ~static_cast<std::uintptr_t>(align-1));
+            if(mprotect(_base, _size, PROT_READ | PROT_WRITE)!=0) {
+                const auto error=errno;
+                munmap(_mapping, _mapping_size);
+                throw std::system_error(error, std::generic_category(), "cannot map guest memory");
+            }
+#ifdef MADV_HUGEPAGE
+            if(huge_pages) {
+                madvise(_base, _size, MADV_HUGEPAGE);
+            }
+#endif
+        }
+        ~memory() {
+            munmap(_mapping, _mapping_size);
+        }
+        memory(const memory&)=delete;
+        memory(memory&&)=delete;
+
+        memory& operator=(const memory&)=delete;
+        memory& operator=(memory&&)=delete;
+
+    public:
+        /**
+         * memory size
+         * @return size in bytes
+         */
+        std::size_t size()const noexcept {
+            return _size;
+        }
+
+        /**
+         * host address of guest address 0
+         * @return memory
+         */
+        std::uint8_t *data()noexcept {
+            return _base;
+        }
+
+        /**
+         * map file contents into memory (private copy-on-write mapping, no copy)
+         * @param fd file descriptor
+         * @param offset file offset (page aligned)
+         * @param size size in bytes
+         * @param address guest address (page aligned)
+         * @return mapped
+         */
+        bool map(int fd, std::uint64_t offset, std::size_t size, std::uint64_t address)noexcept {
+            if(size==0)return true;
+            if(address%PAGE_SIZE!=0 || offset%PAGE_SIZE!=0 || address>_size || size>_size-address)return false;
+            return mmap(_base+address, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd,
+                        static_cast<off_t>(offset))!=MAP_FAILED;
+        }
+
+        /**
+         * check 8 bytes access is in memory.
+         * one unsigned comparison, which also rejects wrapped addresses.
+         * @param address guest address
+         * @return access is valid
+         */
+        bool contains(std::uint64_t address)const noexcept {
+            return address<=_limit;
+        }
+
+        /**
+         * read 64bit value
+         * @param address guest address
+         * @param value read value
+         * @return address is in memory
+         */
+        bool load(std::uint64_t address, std::uint64_t& value)const noexcept {
+            if(__builtin_expect(!contains(address), 0))return false;
+            std::memcpy(&value, _base+address, sizeof(value));
+            return true;
+        }
+
+        /**
+         * write 64bit value
+         * @param address guest address
+         * @param value value
+         * @return address is in memory
+         */
+        bool store(std::uint64_t address, std::uint64_t value)noexcept {
+            if(__builtin_expect(!contains(address), 0))return false;
+            std::memcpy(_base+address, &value, sizeof(value));
+            return true;
+        }
+    };
+} /* n64 */
+
+#endif //N64_EMU_MEMORY_HPP
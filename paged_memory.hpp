@@ -0,0 +1,268 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef N64_EMU_PAGED_MEMORY_HPP
+#define N64_EMU_PAGED_MEMORY_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+#include <memory>
+
+namespace n64 {
+    /**
+     * guest virtual memory (paged memory model).
+     * 48bit address space translated by 3 level page table of 4KiB pages.
+     * pages are allocated on first write, unallocated pages read as zero.
+     * a direct-mapped software TLB caches host address of recently used pages.
+     * remove: default constructor, copy & move constructors and copy & move assign operators.
+     */
+    class paged_memory {
+    public:
+        static constexpr unsigned PAGE_BITS=12, LEVEL_BITS=12, LEVELS=3;
+        static constexpr unsigned ADDRESS_BITS=PAGE_BITS+LEVEL_BITS*LEVELS;
+        static constexpr std::size_t PAGE_SIZE=std::size_t(1)<<PAGE_BITS, TLB_SIZE=256;
+
+    private:
+        static constexpr std::uint64_t INVALID=~std::uint64_t(0);   // tag which never matches page number
+
+        /**
+         * page table node (leaf entries point pages)
+         */
+        struct table {
+            void *entry[std::size_t(1)<<LEVEL_BITS];
+        };
+
+        /**
+         * TLB entry.
+         * write tag is INVALID while page is mapped to zero page.
+         */
+        struct tlb_entry {
+            std::uint64_t read;     // page number which can be read
+            std::uint64_t write;    // page number which can be written
+            std::uint8_t *host;     // host address of page
+        };
+
+        std::unique_ptr<table> _root;
+        std::vector<std::unique_ptr<table>> _tables;
+        std::vector<std::unique_ptr<std::uint8_t[]>> _pages;
+        std::size_t _page_limit;
+        std::unique_ptr<std::uint8_t[]> _zero;
+
+        tlb_entry _tlb[TLB_SIZE];
+        std::uint64_t _hits, _misses;
+
+    public:
+        paged_memory()=delete;
+        /**
+         * @param size maximum bytes of allocated pages
+         */
+        explicit paged_memory(std::size_t size)
+                : _root(std::make_unique<table>()), _page_limit((size+PAGE_SIZE-1)/PAGE_SIZE),
+                  _zero(std::make_unique<std::uint8_t[]>(PAGE_SIZE)), _hits(0), _misses(0) {
+            for(auto& e : _tlb) {
+                e={INVALID, INVALID, nullptr};
+            }
+        }
+        paged_memory(const paged_memory&)=delete;
+        paged_memory(paged_memory&&)=delete;
+
+        paged_memory& operator=(const paged_memory&)=delete;
+        paged_memory& operator=(paged_memory&&)=delete;
+
+    public:
+        /**
+         * read 64bit value
+         * @param address guest address
+         * @param value read value
+         * @return address is in address space
+         */
+        bool load(std::uint64_t address, std::uint64_t& value)noexcept {
+            const auto page=address >> PAGE_BITS;
+            const auto offset=address & (PAGE_SIZE-1);
+            const auto& e=_tlb[page & (TLB_SIZE-1)];
+            if(__builtin_expect(e.read==page && offset<=PAGE_SIZE-sizeof(value), 1)) {
+                ++_hits;
+                std::memcpy(&value, e.host+offset, sizeof(value));
+                return true;
+            }
+            return _load_slow(address, value);
+        }
+
+        /**
+         * write 64bit value
+         * @param address guest address
+         * @param value value
+         * @return address is in address space and page could be allocated
+         */
+        bool store(std::uint64_t address, std::uint64_t value) {
+            const auto page=address >> PAGE_BITS;
+            const auto offset=address & (PAGE_SIZE-1);
+            const auto& e=_tlb[page & (TLB_SIZE-1)];
+            if(__builtin_expect(e.write==page && offset<=PAGE_SIZE-sizeof(value), 1)) {
+                ++_hits;
+                std::memcpy(e.host+offset, &value, sizeof(value));
+                return true;
+            }
+            return _store_slow(address, value);
+        }
+
+        /**
+         * TLB hit count
+         * @return hits
+         */
+        std::uint64_t hits()const noexcept {
+            return _hits;
+        }
+
+        /**
+         * TLB miss count
+         * @return misses
+         */
+        std::uint64_t misses()const noexcept {
+            return _misses;
+        }
+
+        /**
+         * allocated page count
+         * @return pages
+         */
+        std::size_t pages()const noexcept {
+            return _pages.size();
+        }
+
+    private:
+        /**
+         * check 8 bytes access is in address space
+         * @param address guest address
+         * @return access is valid
+         */
+        static bool _contains(std::uint64_t address)noexcept {
+            return address<=(std::uint64_t(1) << ADDRESS_BITS)-sizeof(std::uint64_t);
+        }
+
+        /**
+         * host address of page through TLB
+         * @param page page number
+         * @param write page is written (allocate it)
+         * @return host address (nullptr: page cannot be allocated)
+         */
+        std::uint8_t *_host(std::uint64_t page, bool write) {
+            auto& e=_tlb[page & (TLB_SIZE-1)];
+            if((write ? e.write : e.read)==page) {
+                ++_hits;
+                return e.host;
+            }
+            ++_misses;
+
+            auto *host=_walk(page, write);
+            if(host==nullptr) {
+                if(write)return nullptr;
+                e={page, INVALID, _zero.get()};
+            }else{
+                e={page, page, host};
+            }
+            return e.host;
+        }
+
+        /**
+         * walk page table
+         * @param page page number
+         * @param allocate allocate missing tables and page (nothing is allocated if page limit is reached)
+         * @return host address of page (nullptr: not allocated)
+         */
+        std::uint8_t *_walk(std::uint64_t page, bool allocate) {
+            constexpr std::uint64_t MASK=(std::uint64_t(1) << LEVEL_BITS)-1;
+
+            auto *t=_root.get();
+            for(unsigned level=LEVELS-1; level>0; --level) {
+                auto& next=t->entry[(page >> (LEVEL_BITS*level)) & MASK];
+                if(next==nullptr) {
+                    // missing table means missing page, so limit is checked before table is allocated
+                    if(!allocate || _pages.size()>=_page_limit)return nullptr;
+                    _tables.emplace_back(std::make_unique<table>());
+                    next=_tables.back().get();
+                }
+                t=static_cast<table*>(next);
+            }
+
+            auto& leaf=t->entry[page & MASK];
+            if(leaf==nullptr) {
+                if(!allocate || _pages.size()>=_page_limit)return nullptr;
+                _pages.emplace_back(std::make_unique<std::uint8_t[]>(PAGE_SIZE));
+                leaf=_pages.back().get();
+            }
+            return static_cast<std::uint8_t*>(leaf);
+        }
+
+        /**
+         * read on TLB miss or across pages
+         * @param address guest address
+         * @param value read value
+         * @return address is in address space
+         */
+        bool _load_slow(std::uint64_t address, std::uint64_t& value) {
+            if(!_contains(address))return false;
+
+            const auto page=address >> PAGE_BITS;
+            const auto offset=address & (PAGE_SIZE-1);
+            const auto head=PAGE_SIZE-offset<sizeof(value) ? PAGE_SIZE-offset : sizeof(value);
+
+            std::uint8_t bytes[sizeof(value)];
+            std::memcpy(bytes, _host(page, false)+offset, head);
+            if(head<sizeof(value)) {
+                std::memcpy(bytes+head, _host(page+1, false), sizeof(value)-head);
+            }
+            std::memcpy(&value, bytes, sizeof(value));
+            return true;
+        }
+
+        /**
+         * write on TLB miss or across pages
+         * @param address guest address
+         * @param value value
+         * @return address is in address space and pages could be allocated
+         */
+        bool _store_slow(std::uint64_t address, std::uint64_t value) {
+            if(!_contains(address))return false;
+
+            const auto page=address >> PAGE_BITS;
+            const auto offset=address & (PAGE_SIZE-1);
+            const auto head=PAGE_SIZE-offset<sizeof(value) ? PAGE_SIZE-offset : sizeof(value);
+
+            // failing store allocates nothing: both pages of split store must fit in page limit
+            if(head<sizeof(value)) {
+                const std::size_t missing=(_walk(page, false)==nullptr)+(_walk(page+1, false)==nullptr);
+                if(missing>_page_limit-_pages.size())return false;
+            }
+
+            // pages are never released, so host addresses stay valid after TLB replacement
+            auto *first=_host(page, true);
+            auto *second=head<sizeof(value) ? _host(page+1, true) : first;
+            if(first==nullptr || second==nullptr)return false;
+
+            std::uint8_t bytes[sizeof(value)];
+            std::memcpy(bytes, &value, sizeof(value));
+            std::memcpy(first+offset, bytes, head);
+            if(head<sizeof(value)) {
+                std::memcpy(second, bytes+head, sizeof(value)-head);
+            }
+            return true;
+        }
+    };
+} /* n64 */
+
+#endif //N64_EMU_PAGED_MEMORY_HPP
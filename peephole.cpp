@@ -0,0 +1,274 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+
+#include "decoder.hpp"
+#include "peephole.hpp"
+
+namespace n64 {
+    namespace {
+        namespace nd=n64::decoder;
+
+        /**
+         * check operation copies register (add d,s,r0 with r0 always zero)
+         * @param op operation
+         * @param zero r0 is always zero
+         * @return is move
+         */
+        bool is_move(const nd::operation& op, bool zero)noexcept {
+            return zero && op.code==nd::opcode::add && op.source2==n64::reg::id::R0;
+        }
+
+        /**
+         * program state which peephole rules read and fix up
+         */
+        class optimizer {
+        private:
+            n64::program& _p;
+            bool _object;
+            bool _zero;
+            std::unordered_map<std::string, std::uint64_t> _defined;     // label -> address
+            std::unordered_map<std::uint64_t, std::size_t> _relocation;  // instruction address -> relocation index
+            std::vector<bool> _target;                                   // address is label, jump target or entry
+
+        public:
+            optimizer()=delete;
+            optimizer(n64::program& p, bool object) : _p(p), _object(object),
+                                                      _zero(nd::is_zero_register_constant(p.code)) {
+                _index();
+            }
+
+        public:
+            /**
+             * retarget jumps whose target is jmp
+             * @return retargeted jumps
+             */
+            std::uint64_t thread() {
+                std::uint64_t threaded=0;
+                for(std::size_t i=0; i<_p.code.size(); ++i) {
+                    const auto op=nd::decode(_p.code[i]);
+                    if(!nd::is_direct_jump(op))continue;
+
+                    const auto *reloc=_relocation_of(i);
+                    if(_object && (reloc==nullptr || _defined.count(reloc->symbol)==0))continue;
+                    const std::string *symbol=nullptr;
+                    auto to=op.immediate;
+                    for(std::size_t steps=0; to<_p.code.size() && steps<_p.code.size(); ++steps) {
+                        const auto next=nd::decode(_p.code[to]);
+                        if(next.code!=nd::opcode::jmp || next.immediate==to)break;
+                        if(_object) {
+                            // label of next jump is followed only when it is defined here
+                            const auto *r=_relocation_of(to);
+                            if(r==nullptr)break;
+                            const auto itr=_defined.find(r->symbol);
+                            if(itr==std::end(_defined))break;
+                            symbol=&r->symbol;
+                            to=itr->second;
+                        }else{
+                            to=next.immediate;
+                        }
+                    }
+                    if(_object ? symbol==nullptr || *symbol==reloc->symbol : to==op.immediate)continue;
+                    if(_object) {
+                        _p.relocations[_relocation.at(i)].symbol=*symbol;
+                    }
+                    _p.code[i].u.imm.immediate=to;
+                    ++threaded;
+                }
+                if(threaded>0)_index();
+                return threaded;
+            }
+
+            /**
+             * remove and merge instructions, one sweep
+             * @param report counts
+             * @return some instruction was removed
+             */
+            bool sweep(n64::peephole_report& report) {
+                auto& code=_p.code;
+                std::vector<bool> removed(code.size(), false);
+                bool changed=false;
+                for(std::size_t i=0; i<code.size(); ++i) {
+                    const auto op=nd::decode(code[i]);
+                    if(op.code==nd::opcode::nop) {
+                        removed[i]=changed=true;
+                        ++report.nops;
+                        continue;
+                    }
+                    if(is_move(op, _zero) && op.destination==op.source1) {
+                        removed[i]=changed=true;
+                        ++report.moves;
+                        continue;
+                    }
+                    // pairs: second instruction must not be entered from elsewhere
+                    if(i+1>=code.size() || _target[i+1])continue;
+                    const auto next=nd::decode(code[i+1]);
+
+                    if(((op.code==nd::opcode::inc && next.code==nd::opcode::dec) || (op.code==nd::opcode::dec && next.code==nd::opcode::inc))
+                       && op.destination==next.destination) {
+                        removed[i]=removed[i+1]=changed=true;
+                        ++report.cancelled;
+                        ++i;
+                    }else if(((op.code==nd::opcode::asgnh && next.code==nd::opcode::asgnl) || (op.code==nd::opcode::asgnl && next.code==nd::opcode::asgnh))
+                             && op.destination==next.destination) {
+                        const auto high=op.code==nd::opcode::asgnh ? op.immediate : next.immediate;
+                        const auto low=op.code==nd::opcode::asgnl ? op.immediate : next.immediate;
+                        const auto value=((high & 0xffffffff) << 32) | (low & 0xffffffff);
+                        if(value<nd::RI_LIMIT) {
+                            code[i].instruction.instruction=0b00000;    // asgn
+                            code[i].ri.immediate=value;
+                            removed[i+1]=changed=true;
+                            ++report.folded;
+                            ++i;
+                        }
+                    }else if(is_move(op, _zero) && is_move(next, _zero)
+                             && ((next.destination==op.destination && next.source1==op.source1)
+                                 || (next.destination==op.source1 && next.source1==op.destination))) {
+                        // second move copies value which is already there
+                        removed[i+1]=changed=true;
+                        ++report.moves;
+                        ++i;
+                    }
+                }
+                if(changed) {
+                    n64::remove_instructions(_p, removed, _object);
+                    _index();
+                }
+                return changed;
+            }
+
+        private:
+            /**
+             * relocation of instruction
+             * @param address instruction address
+             * @return relocation (nullptr: none)
+             */
+            const n64::relocation *_relocation_of(std::uint64_t address)const {
+                const auto itr=_relocation.find(address);
+                return itr==std::end(_relocation) ? nullptr : &_p.relocations[itr->second];
+            }
+
+            /**
+             * rebuild label, relocation and jump target tables
+             */
+            void _index() {
+                const auto size=_p.code.size();
+                _defined.clear();
+                _relocation.clear();
+                _target.assign(size+1, false);
+                for(const auto& s : _p.symbols) {
+                    _defined.emplace(s.name, s.address);
+                    if(s.address<=size)_target[s.address]=true;
+                }
+                for(std::size_t i=0; i<_p.relocations.size(); ++i) {
+                    _relocation.emplace(_p.relocations[i].address, i);
+                }
+                if(_p.entry<=size)_target[_p.entry]=true;
+                for(std::size_t i=0; i<size; ++i) {
+                    const auto op=nd::decode(_p.code[i]);
+                    if(nd::is_direct_jump(op) && op.immediate<=size)_target[op.immediate]=true;
+                }
+            }
+        };
+    } /* anonymous */
+
+    /**
+     * remove instructions and move every address after them
+     * @param p program
+     * @param removed instructions to remove (one per instruction)
+     * @param object p is object (only jumps with relocation are moved)
+     */
+    void remove_instructions(n64::program& p, const std::vector<bool>& removed, bool object) {
+        auto& code=p.code;
+        const auto size=code.size();
+
+        // address -> new address (removed instruction: next kept one)
+        std::vector<std::uint64_t> moved(size+1);
+        std::uint64_t kept=0;
+        for(std::size_t i=0; i<size; ++i) {
+            moved[i]=kept;
+            if(!removed[i])code[kept++]=code[i];
+        }
+        moved[size]=kept;
+        const auto relocate=[&](std::uint64_t address) {
+            return address<=size ? moved[address] : address-(size-kept);
+        };
+
+        // source line of every kept instruction, then runs again
+        std::vector<std::uint64_t> lines(kept, 0);
+        for(std::size_t r=0; r<p.lines.size(); ++r) {
+            const auto end=r+1<p.lines.size() ? p.lines[r+1].address : size;
+            for(auto a=p.lines[r].address; a<end && a<size; ++a) {
+                if(!removed[a])lines[moved[a]]=p.lines[r].line+(a-p.lines[r].address);
+            }
+        }
+        p.lines.clear();
+        for(std::uint64_t a=0; a<kept; ++a) {
+            if(lines[a]==0)continue;
+            if(p.lines.empty() || p.lines.back().line+(a-p.lines.back().address)!=lines[a]) {
+                p.lines.push_back({a, lines[a]});
+            }
+        }
+
+        // object: numbers are addresses of linked program, labels are set by linker anyway
+        std::vector<bool> relocated;
+        if(object) {
+            relocated.assign(size, false);
+            for(const auto& r : p.relocations) {
+                if(r.address<size)relocated[r.address]=true;
+            }
+        }
+        std::uint64_t address=0;
+        for(std::size_t i=0; i<size; ++i) {
+            if(removed[i])continue;
+            auto& ins=code[address++];
+            const auto op=nd::decode(ins);
+            if(!nd::is_direct_jump(op) || (object && !relocated[i]))continue;
+            ins.u.imm.immediate=relocate(op.immediate);
+        }
+        code.resize(kept);
+        for(auto& s : p.symbols) {
+            s.address=relocate(s.address);
+        }
+        for(auto& r : p.relocations) {
+            r.address=moved[r.address];
+        }
+        p.entry=relocate(p.entry);
+    }
+
+    /**
+     * peephole optimisation of assembled program
+     * @param p program (executable or object)
+     * @param object p is object (label operands are relocations)
+     * @return changes
+     */
+    n64::peephole_report peephole(n64::program& p, bool object) {
+        n64::peephole_report report;
+        optimizer o(p, object);
+        report.threaded+=o.thread();
+        if(const auto computed=nd::find_computed_jump(p.code); computed<p.code.size()) {
+            report.exact=false;
+            report.computed=computed;
+            return report;
+        }
+        while(o.sweep(report)) {
+            report.threaded+=o.thread();
+        }
+        return report;
+    }
+} /* n64 */
@@ -0,0 +1,84 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef N64_EMU_PEEPHOLE_HPP
+#define N64_EMU_PEEPHOLE_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "binary.hpp"
+
+namespace n64 {
+    /**
+     * what peephole pass changed
+     */
+    struct peephole_report {
+        std::uint64_t nops=0;           // nop (xchg r,r) removed
+        std::uint64_t moves=0;          // self moves and repeated moves removed
+        std::uint64_t cancelled=0;      // inc/dec pairs removed (2 instructions each)
+        std::uint64_t folded=0;         // asgnh/asgnl pairs folded into asgn
+        std::uint64_t threaded=0;       // jumps retargeted past jmp chains
+        bool exact=true;                // every jump target is known (false: nothing was removed)
+        std::uint64_t computed=0;       // first instruction which makes a jump target computed when not exact
+
+        /**
+         * removed instructions
+         * @return count
+         */
+        std::uint64_t removed()const noexcept {
+            return nops+moves+cancelled*2+folded;
+        }
+
+        /**
+         * one line summary
+         * @return text
+         */
+        std::string str()const {
+            return std::to_string(removed())+" instructions removed (nop "+std::to_string(nops)+", mov "+std::to_string(moves)
+                   +", inc/dec "+std::to_string(cancelled)+" pairs, asgnh/asgnl "+std::to_string(folded)+" pairs), "
+                   +std::to_string(threaded)+" jumps threaded"
+                   +(exact ? "" : " (nothing removed, jump target computed at "+std::to_string(computed)+")");
+        }
+    };
+
+    /**
+     * peephole optimisation of assembled program.
+     * removes nops, self moves and repeated moves, cancels inc/dec pairs, folds asgnh/asgnl pairs
+     * into asgn when the value fits in 49 bits and retargets jumps past chains of jmp.
+     * pairs are only merged when no label or jump targets their second instruction.
+     * symbols, jump targets, entry, line table and relocations are fixed up after deletion.
+     * code addresses computed at run time cannot be fixed up, so programs with a computed jump
+     * (decoder::find_computed_jump, e.g. push 4; ret) only get jumps retargeted.
+     * objects keep jumps through undefined labels and to numbers (absolute in linked program) as they are.
+     * @param p program (executable or object)
+     * @param object p is object (label operands are relocations)
+     * @return changes
+     */
+    n64::peephole_report peephole(n64::program& p, bool object=false);
+
+    /**
+     * remove instructions from program.
+     * symbols, jump targets, entry, line table and relocations are moved, addresses of removed
+     * instructions move to the next kept instruction.
+     * @param p program
+     * @param removed instructions to remove (one per instruction)
+     * @param object p is object (only jumps with relocation are moved)
+     */
+    void remove_instructions(n64::program& p, const std::vector<bool>& removed, bool object=false);
+} /* n64 */
+
+#endif //N64_EMU_PEEPHOLE_HPP
@@ -0,0 +1,131 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <algorithm>
+#include <numeric>
+#include <bitset>
+#include <sstream>
+#include <iomanip>
+
+#include "profile.hpp"
+
+namespace n64 {
+    namespace {
+        /**
+         * percentage text
+         * @param count count
+         * @param total total
+         * @return percentage with 2 decimals
+         */
+        std::string percent(std::uint64_t count, std::uint64_t total) {
+            std::stringstream ss;
+            ss<<std::fixed<<std::setprecision(2)<<(total>0 ? 100.0*static_cast<double>(count)/static_cast<double>(total) : 0.0)<<"%";
+            return ss.str();
+        }
+
+        /**
+         * mnemonic or raw opcode byte of undefined instruction
+         * @param ins instruction
+         * @return name
+         */
+        std::string name(const n64::instruction::instruction& ins) {
+            const auto *m=n64::instruction::mnemonic(ins);
+            if(m!=nullptr)return m;
+            std::stringstream ss;
+            ss<<"(0x"<<std::hex<<std::setw(2)<<std::setfill('0')<<(ins.data & 0xff)<<")";
+            return ss.str();
+        }
+    } /* anonymous */
+
+    /**
+     * make report
+     * @param code instructions
+     * @param symbols symbol table of program
+     * @param top number of hot addresses and branches to show
+     * @return report
+     */
+    std::string profile::report(const std::vector<n64::instruction::instruction>& code, const n64::symbol_table& symbols,
+                                std::size_t top)const {
+        const auto total=std::accumulate(std::begin(_executed), std::end(_executed), std::uint64_t(0));
+
+        // opcode byte: type (3 bits) and instruction (5 bits)
+        std::vector<std::uint64_t> opcodes(256, 0);
+        for(std::size_t address=0; address<_executed.size(); ++address) {
+            opcodes[code[address].data & 0xff]+=_executed[address];
+        }
+        std::vector<std::size_t> order(opcodes.size());
+        std::iota(std::begin(order), std::end(order), 0);
+        std::stable_sort(std::begin(order), std::end(order), [&opcodes](std::size_t a, std::size_t b) {
+            return opcodes[a]>opcodes[b];
+        });
+
+        std::stringstream ss;
+        ss
+                <<"======== ======== ======== profile ======== ======== ========"<<std::endl
+                <<"executed instructions: "<<total<<std::endl
+                <<std::endl
+                <<"opcode     type,ins          count        share"<<std::endl;
+        for(auto opcode : order) {
+            if(opcodes[opcode]==0)break;
+            n64::instruction::instruction ins={};
+            ins.data=opcode;
+            ss
+                    <<std::left<<std::setw(10)<<name(ins)<<" "
+                    <<std::bitset<3>(ins.instruction.type)<<","<<std::bitset<5>(ins.instruction.instruction)<<std::right
+                    <<std::setw(16)<<opcodes[opcode]<<std::setw(13)<<percent(opcodes[opcode], total)<<std::endl;
+        }
+
+        std::vector<std::size_t> hot(_executed.size());
+        std::iota(std::begin(hot), std::end(hot), 0);
+        const auto hot_count=std::min(top, hot.size());
+        std::partial_sort(std::begin(hot), std::begin(hot)+hot_count, std::end(hot), [this](std::size_t a, std::size_t b) {
+            return _executed[a]!=_executed[b] ? _executed[a]>_executed[b] : a<b;
+        });
+        ss
+                <<std::endl
+                <<"hot addresses"<<std::endl
+                <<"address           location                 instruction          count        share"<<std::endl;
+        for(std::size_t i=0; i<hot_count && _executed[hot[i]]>0; ++i) {
+            const auto address=hot[i];
+            ss
+                    <<std::hex<<std::setw(16)<<std::setfill('0')<<address<<std::dec<<std::setfill(' ')<<"  "
+                    <<std::left<<std::setw(24)<<symbols.name(address)<<" "<<std::setw(10)<<name(code[address])<<std::right
+                    <<std::setw(16)<<_executed[address]<<std::setw(13)<<percent(_executed[address], total)<<std::endl;
+        }
+
+        std::vector<std::size_t> branches;
+        for(std::size_t address=0; address<_executed.size(); ++address) {
+            if(_taken[address]+_not_taken[address]>0)branches.emplace_back(address);
+        }
+        const auto branch_count=std::min(top, branches.size());
+        std::partial_sort(std::begin(branches), std::begin(branches)+branch_count, std::end(branches), [this](std::size_t a, std::size_t b) {
+            const auto ca=_taken[a]+_not_taken[a], cb=_taken[b]+_not_taken[b];
+            return ca!=cb ? ca>cb : a<b;
+        });
+        ss
+                <<std::endl
+                <<"conditional branches"<<std::endl
+                <<"address           location                 instruction          taken    not taken        taken"<<std::endl;
+        for(std::size_t i=0; i<branch_count; ++i) {
+            const auto address=branches[i];
+            ss
+                    <<std::hex<<std::setw(16)<<std::setfill('0')<<address<<std::dec<<std::setfill(' ')<<"  "
+                    <<std::left<<std::setw(24)<<symbols.name(address)<<" "<<std::setw(10)<<name(code[address])<<std::right
+                    <<std::setw(16)<<_taken[address]<<std::setw(13)<<_not_taken[address]
+                    <<std::setw(13)<<percent(_taken[address], _taken[address]+_not_taken[address])<<std::endl;
+        }
+        return ss.str();
+    }
+} /* n64 */
@@ -0,0 +1,110 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef N64_EMU_PROFILE_HPP
+#define N64_EMU_PROFILE_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <string>
+
+#include "instruction.hpp"
+#include "symbol_table.hpp"
+
+namespace n64 {
+    /**
+     * execution profile.
+     * engines count executions per instruction address and outcomes of conditional branches,
+     * per opcode counts are derived from address counts when the report is made.
+     * remove: default constructor, copy & move constructors and copy & move assign operators.
+     */
+    class profile {
+    private:
+        std::vector<std::uint64_t> _executed;
+        std::vector<std::uint64_t> _taken, _not_taken;
+
+    public:
+        profile()=delete;
+        /**
+         * @param size instruction count of program
+         */
+        explicit profile(std::size_t size) : _executed(size, 0), _taken(size, 0), _not_taken(size, 0) {}
+        profile(const profile&)=delete;
+        profile(profile&&)=delete;
+
+        profile& operator=(const profile&)=delete;
+        profile& operator=(profile&&)=delete;
+
+    public:
+        /**
+         * count execution
+         * @param address instruction address (in program)
+         */
+        void executed(std::uint64_t address)noexcept {
+            ++_executed[address];
+        }
+
+        /**
+         * count conditional branch outcome
+         * @param address branch address (in program)
+         * @param taken branch was taken
+         */
+        void branch(std::uint64_t address, bool taken)noexcept {
+            ++(taken ? _taken : _not_taken)[address];
+        }
+
+        /**
+         * check instruction is conditional branch (je, jne, ja, jae, jb, jbe)
+         * @param ins instruction
+         * @return is conditional branch
+         */
+        static bool is_conditional_branch(const n64::instruction::instruction& ins)noexcept {
+            return ins.instruction.type==n64::instruction::UNARY
+                   && ins.instruction.instruction>=0b00101 && ins.instruction.instruction<=0b01010;
+        }
+
+        /**
+         * condition of conditional branch (flags are not changed by branch, so they can be read after it)
+         * @param ins conditional branch
+         * @param equal equal flag
+         * @param above above flag
+         * @return branch is taken
+         */
+        static bool is_taken(const n64::instruction::instruction& ins, bool equal, bool above)noexcept {
+            switch(ins.instruction.instruction) {
+                case 0b00101: return equal;             // je
+                case 0b00110: return !equal;            // jne
+                case 0b00111: return above;             // ja
+                case 0b01000: return equal || above;    // jae
+                case 0b01001: return !equal && !above;  // jb
+                default: return !above;                 // jbe
+            }
+        }
+
+        /**
+         * make report.
+         * hot addresses are shown as label+offset of nearest preceding symbol (raw address without symbols).
+         * @param code instructions
+         * @param symbols symbol table of program
+         * @param top number of hot addresses and branches to show
+         * @return report
+         */
+        std::string report(const std::vector<n64::instruction::instruction>& code, const n64::symbol_table& symbols,
+                           std::size_t top)const;
+    };
+} /* n64 */
+
+#endif //N64_EMU_PROFILE_HPP
@@ -0,0 +1,44 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <algorithm>
+
+#include "symbol_table.hpp"
+
+namespace n64 {
+    /**
+     * @param p program with symbols and line table
+     */
+    symbol_table::symbol_table(const n64::program& p) : _symbols(p.symbols), _source(p.source), _size(p.code.size()) {
+        std::stable_sort(std::begin(_symbols), std::end(_symbols), [](const n64::symbol& a, const n64::symbol& b) {
+            return a.address<b.address;
+        });
+        _addresses.reserve(_symbols.size());
+        for(const auto& s : _symbols) {
+            _addresses.emplace_back(s.address);
+        }
+
+        auto lines=p.lines;
+        std::stable_sort(std::begin(lines), std::end(lines), [](const n64::source_line& a, const n64::source_line& b) {
+            return a.address<b.address;
+        });
+        _line_addresses.reserve(lines.size());
+        _lines.reserve(lines.size());
+        for(const auto& l : lines) {
+            _line_addresses.emplace_back(l.address);
+            _lines.emplace_back(l.line);
+        }
+    }
+} /* n64 */
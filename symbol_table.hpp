@@ -0,0 +1,129 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef N64_EMU_SYMBOL_TABLE_HPP
+#define N64_EMU_SYMBOL_TABLE_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <sstream>
+
+#include "binary.hpp"
+
+namespace n64 {
+    /**
+     * address to symbol and source line lookup.
+     * addresses are kept in their own sorted arrays, so a lookup is one binary search over contiguous integers.
+     * lookups are inline (machine uses them without linking this library), construction is not.
+     */
+    class symbol_table {
+    private:
+        std::vector<std::uint64_t> _addresses;          // symbol addresses (ascending)
+        std::vector<n64::symbol> _symbols;              // symbols in same order
+        std::vector<std::uint64_t> _line_addresses;     // first addresses of line runs (ascending)
+        std::vector<std::uint64_t> _lines;              // source lines of first addresses
+        std::string _source;
+        std::uint64_t _size;                            // instruction count (addresses with source line)
+
+    public:
+        /**
+         * empty table (every address is shown raw)
+         */
+        symbol_table() : _size(0) {}
+        /**
+         * @param p program with symbols and line table
+         */
+        explicit symbol_table(const n64::program& p);
+
+    public:
+        /**
+         * nearest symbol at or before address (first one of symbols at same address)
+         * @param address instruction address
+         * @return symbol (nullptr: no symbol before address)
+         */
+        const n64::symbol *find(std::uint64_t address)const noexcept {
+            auto itr=std::upper_bound(std::begin(_addresses), std::end(_addresses), address);
+            if(itr==std::begin(_addresses))return nullptr;
+            --itr;
+            itr=std::lower_bound(std::begin(_addresses), itr, *itr);
+            return &_symbols[static_cast<std::size_t>(itr-std::begin(_addresses))];
+        }
+
+        /**
+         * source line of address
+         * @param address instruction address
+         * @return line (0: unknown)
+         */
+        std::uint64_t line(std::uint64_t address)const noexcept {
+            if(address>=_size)return 0;
+            auto itr=std::upper_bound(std::begin(_line_addresses), std::end(_line_addresses), address);
+            if(itr==std::begin(_line_addresses))return 0;
+            --itr;
+            return _lines[static_cast<std::size_t>(itr-std::begin(_line_addresses))]+(address-*itr);
+        }
+
+        /**
+         * symbolic name: label, label+offset or raw address (0x hex)
+         * @param address instruction address
+         * @return name
+         */
+        std::string name(std::uint64_t address)const {
+            std::stringstream ss;
+            const auto *s=find(address);
+            if(s==nullptr) {
+                ss<<"0x"<<std::hex<<address;
+            }else{
+                ss<<s->name;
+                if(address!=s->address)ss<<"+"<<(address-s->address);
+            }
+            return ss.str();
+        }
+
+        /**
+         * name with source position ("label+offset (file:line)")
+         * @param address instruction address
+         * @return location
+         */
+        std::string location(std::uint64_t address)const {
+            auto text=name(address);
+            const auto l=line(address);
+            if(l>0) {
+                text+=" ("+_source+":"+std::to_string(l)+")";
+            }
+            return text;
+        }
+
+        /**
+         * source file name of line table
+         * @return source file name (empty: no line table)
+         */
+        const std::string& source()const noexcept {
+            return _source;
+        }
+
+        /**
+         * symbol count
+         * @return symbols
+         */
+        std::size_t size()const noexcept {
+            return _symbols.size();
+        }
+    };
+} /* n64 */
+
+#endif //N64_EMU_SYMBOL_TABLE_HPP
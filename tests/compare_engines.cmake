@@ -0,0 +1,48 @@
+# Copyright 2018 SiLeader.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# assemble SOURCE, run it on every engine and compare register dumps with reference engine.
+# tiered engine runs with thresholds of 1, so blocks are promoted to block engine and JIT at once.
+# usage: cmake -DN64AS=<n64as> -DN64EMU=<n64emu> -DSOURCE=<source> -DWORK=<directory> -P compare_engines.cmake
+
+get_filename_component(name "${SOURCE}" NAME_WE)
+file(MAKE_DIRECTORY "${WORK}")
+set(binary "${WORK}/${name}.n64")
+
+execute_process(COMMAND "${N64AS}" -o "${binary}" "${SOURCE}"
+                RESULT_VARIABLE result OUTPUT_VARIABLE output ERROR_VARIABLE output)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "n64as ${SOURCE} failed:\n${output}")
+endif()
+
+function(run_engine engine)
+    execute_process(COMMAND "${N64EMU}" --no-cache --engine=${engine} ${ARGN} "${binary}"
+                    RESULT_VARIABLE result OUTPUT_VARIABLE dump ERROR_VARIABLE error)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "n64emu --engine=${engine} ${binary} failed:\n${error}")
+    endif()
+    set(${engine} "${dump}${error}" PARENT_SCOPE)
+endfunction()
+
+run_engine(reference)
+foreach(engine threaded block jit)
+    run_engine(${engine})
+endforeach()
+run_engine(tiered --tier-threshold=1 --jit-threshold=1)
+
+foreach(engine threaded block jit tiered)
+    if(NOT ${engine} STREQUAL reference)
+        message(FATAL_ERROR "${SOURCE}: ${engine} engine ends in different state\nreference:\n${reference}\n${engine}:\n${${engine}}")
+    endif()
+endforeach()
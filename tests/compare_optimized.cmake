@@ -0,0 +1,42 @@
+# Copyright 2018 SiLeader.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# assemble SOURCE plain and with -O -G, run both on reference engine and compare register dumps.
+# IP is ignored because optimised code is shorter.
+# usage: cmake -DN64AS=<n64as> -DN64EMU=<n64emu> -DSOURCE=<source> -DWORK=<directory> -P compare_optimized.cmake
+
+get_filename_component(name "${SOURCE}" NAME_WE)
+file(MAKE_DIRECTORY "${WORK}")
+
+function(run_program variant)
+    set(binary "${WORK}/${name}.${variant}.n64")
+    execute_process(COMMAND "${N64AS}" ${ARGN} -o "${binary}" "${SOURCE}"
+                    RESULT_VARIABLE result OUTPUT_VARIABLE output ERROR_VARIABLE output)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "n64as ${ARGN} ${SOURCE} failed:\n${output}")
+    endif()
+    execute_process(COMMAND "${N64EMU}" --engine=reference "${binary}"
+                    RESULT_VARIABLE result OUTPUT_VARIABLE dump ERROR_VARIABLE error)
+    if(NOT result EQUAL 0 OR NOT error STREQUAL "")
+        message(FATAL_ERROR "n64emu ${binary} failed:\n${error}")
+    endif()
+    string(REGEX REPLACE "IP   = 0x[0-9a-f]+" "IP   = (ignored)" dump "${dump}")
+    set(${variant} "${dump}" PARENT_SCOPE)
+endfunction()
+
+run_program(plain)
+run_program(optimized -O -G)
+if(NOT plain STREQUAL optimized)
+    message(FATAL_ERROR "${SOURCE}: optimised program ends in different state\nplain:\n${plain}\noptimized:\n${optimized}")
+endif()
@@ -0,0 +1,154 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <system_error>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "trace.hpp"
+
+namespace n64 {
+    namespace trace {
+        namespace {
+            /**
+             * write whole buffer
+             * @param fd file descriptor
+             * @param data data
+             * @param size size in bytes
+             * @return written
+             */
+            bool write_all(int fd, const std::uint8_t *data, std::size_t size) {
+                while(size>0) {
+                    const auto written=write(fd, data, size);
+                    if(written<0) {
+                        if(errno==EINTR)continue;
+                        return false;
+                    }
+                    data+=written;
+                    size-=static_cast<std::size_t>(written);
+                }
+                return true;
+            }
+        } /* anonymous */
+
+        /**
+         * create trace file and start drain thread
+         * @param file trace file name
+         * @param l trace level (not off)
+         * @param buffer ring buffer size in bytes
+         */
+        recorder::recorder(const std::string& file, level l, std::size_t buffer)
+                : _fd(-1), _size(record_size(l)), _capacity(1), _head(0), _reserved(0), _stalls(0), _tail(0),
+                  _closing(false), _failed(false) {
+            while(_capacity*2*_size<=buffer) {
+                _capacity*=2;
+            }
+            _ring=std::make_unique<std::uint8_t[]>(_capacity*_size);
+
+            _fd=open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if(_fd<0) {
+                throw std::system_error(errno, std::generic_category(), file);
+            }
+            std::uint8_t header[HEADER_SIZE]={};
+            const std::uint32_t fields[]={VERSION, static_cast<std::uint32_t>(l), static_cast<std::uint32_t>(_size)};
+            std::memcpy(header, MAGIC, sizeof(MAGIC));
+            std::memcpy(header+8, fields, sizeof(fields));
+            if(!write_all(_fd, header, sizeof(header))) {
+                const auto error=errno;
+                ::close(_fd);
+                throw std::system_error(error, std::generic_category(), file);
+            }
+
+            _drain=std::thread([this]() {
+                _run();
+            });
+        }
+
+        recorder::~recorder() {
+            close();
+        }
+
+        /**
+         * drain remaining records and close file
+         * @return every record was written
+         */
+        bool recorder::close() {
+            if(_drain.joinable()) {
+                _closing.store(true, std::memory_order_release);
+                _drain.join();
+            }
+            if(_fd>=0) {
+                if(::close(_fd)!=0)_failed=true;
+                _fd=-1;
+            }
+            return !_failed;
+        }
+
+        /**
+         * wait until slot is free
+         * @param head slot sequence
+         */
+        void recorder::_wait(std::uint64_t head) {
+            ++_stalls;
+            while(head-_tail.load(std::memory_order_acquire)>=_capacity) {
+                // publish pending record so drain thread can make progress
+                _head.store(_reserved, std::memory_order_release);
+                std::this_thread::yield();
+            }
+        }
+
+        /**
+         * drain thread.
+         * writes every contiguous run of published records with one system call.
+         */
+        void recorder::_run() {
+            auto tail=_tail.load(std::memory_order_relaxed);
+            for(;;) {
+                const bool closing=_closing.load(std::memory_order_acquire);
+                const auto head=_head.load(std::memory_order_acquire);
+                if(head==tail) {
+                    if(closing)break;
+                    std::this_thread::sleep_for(std::chrono::microseconds(100));
+                    continue;
+                }
+
+                while(tail!=head) {
+                    const auto first=tail & (_capacity-1);
+                    const auto count=std::min<std::uint64_t>(head-tail, _capacity-first);
+                    if(!_failed && !write_all(_fd, _ring.get()+first*_size, count*_size)) {
+                        _failed=true;
+                    }
+                    tail+=count;
+                    _tail.store(tail, std::memory_order_release);
+                }
+            }
+        }
+
+        /**
+         * trace level name
+         * @param l trace level
+         * @return name
+         */
+        const char *name(level l) {
+            static const char *NAMES[]={"off", "branches", "instructions", "registers"};
+            return NAMES[static_cast<std::size_t>(l)];
+        }
+    } /* trace */
+} /* n64 */
@@ -0,0 +1,186 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef N64_EMU_TRACE_HPP
+#define N64_EMU_TRACE_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <string>
+
+/*
+ * trace file (native byte order)
+ *
+ * header (32 bytes)
+ *   0  magic "N64TRACE"
+ *   8  u32 version
+ *  12  u32 level
+ *  16  u32 record size
+ *  20  u32 reserved (0)
+ *  24  u64 reserved (0)
+ * records (record size bytes each)
+ *   0  u64 sequence (executed instructions before this one)
+ *   8  u64 address
+ *  16  u64 next IP
+ *  24  u64 instruction
+ *  32  u64 registers[REGISTERS] after instruction (level registers only, FLAGS slot holds flags)
+ */
+
+namespace n64 {
+    namespace trace {
+        constexpr char MAGIC[8]={'N', '6', '4', 'T', 'R', 'A', 'C', 'E'};
+        constexpr std::uint32_t VERSION=1;
+        constexpr std::size_t HEADER_SIZE=32;
+        constexpr std::size_t REGISTERS=72;     // r0, rs0-31, rt0-31, ip, flags, sp, bp and padding
+        constexpr std::size_t DEFAULT_BUFFER=std::size_t(4)<<20;
+
+        /**
+         * trace level
+         * branches: control transfer instructions (taken or not) and every other change of IP
+         * instructions: every instruction
+         * registers: every instruction with register state after it
+         */
+        enum class level : std::uint32_t {
+            off, branches, instructions, registers
+        };
+
+        /**
+         * trace record
+         */
+        struct record {
+            std::uint64_t sequence;
+            std::uint64_t address;
+            std::uint64_t next;
+            std::uint64_t instruction;
+        };
+
+        /**
+         * record size of level
+         * @param l trace level
+         * @return record size in bytes
+         */
+        constexpr std::size_t record_size(level l) {
+            return sizeof(record)+(l==level::registers ? REGISTERS*sizeof(std::uint64_t) : 0);
+        }
+
+        /**
+         * trace recorder.
+         * the emulator thread writes fixed-size records into a single-producer single-consumer
+         * lock-free ring buffer, a background thread drains it to the trace file.
+         * the producer waits (never drops records) when the ring is full.
+         * remove: default constructor, copy & move constructors and copy & move assign operators.
+         */
+        class recorder {
+        private:
+            int _fd;
+            std::size_t _size;          // record size
+            std::size_t _capacity;      // ring capacity in records (power of 2)
+            std::unique_ptr<std::uint8_t[]> _ring;
+
+            alignas(64) std::atomic<std::uint64_t> _head;   // records written by producer
+            std::uint64_t _reserved;                        // producer private: records whose slot was handed out
+            std::uint64_t _stalls;                          // producer waits for full ring
+            alignas(64) std::atomic<std::uint64_t> _tail;   // records written to file by consumer
+            std::atomic<bool> _closing;
+            bool _failed;
+
+            std::thread _drain;
+
+        public:
+            recorder()=delete;
+            /**
+             * create trace file and start drain thread
+             * @param file trace file name
+             * @param l trace level (not off)
+             * @param buffer ring buffer size in bytes
+             * @throw std::system_error file cannot be created
+             */
+            recorder(const std::string& file, level l, std::size_t buffer=DEFAULT_BUFFER);
+            ~recorder();
+            recorder(const recorder&)=delete;
+            recorder(recorder&&)=delete;
+
+            recorder& operator=(const recorder&)=delete;
+            recorder& operator=(recorder&&)=delete;
+
+        public:
+            /**
+             * slot for next record (waits while ring is full)
+             * @return slot of record size bytes
+             */
+            std::uint8_t *slot() {
+                const auto head=_reserved;
+                if(__builtin_expect(head-_tail.load(std::memory_order_acquire)>=_capacity, 0)) {
+                    _wait(head);
+                }
+                _reserved=head+1;
+                return _ring.get()+(head & (_capacity-1))*_size;
+            }
+
+            /**
+             * publish record written to slot
+             */
+            void commit()noexcept {
+                _head.store(_reserved, std::memory_order_release);
+            }
+
+            /**
+             * drain remaining records and close file
+             * @return every record was written
+             */
+            bool close();
+
+            /**
+             * record count
+             * @return records
+             */
+            std::uint64_t records()const noexcept {
+                return _head.load(std::memory_order_relaxed);
+            }
+
+            /**
+             * number of times producer waited for drain thread
+             * @return stalls
+             */
+            std::uint64_t stalls()const noexcept {
+                return _stalls;
+            }
+
+        private:
+            /**
+             * wait until slot is free
+             * @param head slot sequence
+             */
+            void _wait(std::uint64_t head);
+
+            /**
+             * drain thread
+             */
+            void _run();
+        };
+
+        /**
+         * trace level name
+         * @param l trace level
+         * @return name
+         */
+        const char *name(level l);
+    } /* trace */
+} /* n64 */
+
+#endif //N64_EMU_TRACE_HPP
@@ -0,0 +1,261 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cinttypes>
+#include <system_error>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "instruction.hpp"
+#include "decoder.hpp"
+#include "trace.hpp"
+#include "symbol_table.hpp"
+#include "cmdline.hpp"
+
+namespace {
+    /**
+     * read address (decimal, 0x hex or 0 octal)
+     */
+    struct address_reader {
+        std::uint64_t operator()(const std::string& str) {
+            std::size_t end=0;
+            const auto value=std::stoull(str, &end, 0);
+            if(end!=str.size())throw cmdline::cmdline_error("invalid address: "+str);
+            return value;
+        }
+    };
+
+    /**
+     * register name in register records
+     * @param index register index
+     * @return name (empty: padding)
+     */
+    std::string register_name(std::size_t index) {
+        namespace id=n64::reg::id;
+        if(index==id::R0)return "r0";
+        if(index>=id::RS[0] && index<=id::RS[31])return "rs"+std::to_string(index-id::RS[0]);
+        if(index>=id::RT[0] && index<=id::RT[31])return "rt"+std::to_string(index-id::RT[0]);
+        if(index==id::IP)return "ip";
+        if(index==id::FLAGS)return "flags";
+        if(index==id::SP)return "sp";
+        if(index==id::BP)return "bp";
+        return "";
+    }
+
+    /**
+     * operation name without C++ keyword suffix (xor_ -> xor)
+     * @param code operation kind
+     * @return name
+     */
+    std::string operation_name(std::size_t code) {
+        std::string name=n64::decoder::name(static_cast<n64::decoder::opcode>(code));
+        if(!name.empty() && name.back()=='_')name.pop_back();
+        return name;
+    }
+
+    /**
+     * read-only mapping of trace file
+     * remove: default constructor, copy & move constructors and copy & move assign operators.
+     */
+    class trace_file {
+    private:
+        const std::uint8_t *_data;
+        std::size_t _size;
+
+    public:
+        trace_file()=delete;
+        explicit trace_file(const std::string& file) : _data(nullptr), _size(0) {
+            const int fd=open(file.c_str(), O_RDONLY);
+            if(fd<0) {
+                throw std::system_error(errno, std::generic_category(), file);
+            }
+            struct stat st={};
+            if(fstat(fd, &st)==0 && st.st_size>0) {
+                _size=static_cast<std::size_t>(st.st_size);
+                auto *mapping=mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if(mapping==MAP_FAILED) {
+                    const auto error=errno;
+                    close(fd);
+                    throw std::system_error(error, std::generic_category(), file);
+                }
+                madvise(mapping, _size, MADV_SEQUENTIAL);
+                _data=static_cast<const std::uint8_t*>(mapping);
+            }
+            close(fd);
+        }
+        ~trace_file() {
+            if(_data!=nullptr)munmap(const_cast<std::uint8_t*>(_data), _size);
+        }
+        trace_file(const trace_file&)=delete;
+        trace_file(trace_file&&)=delete;
+
+        trace_file& operator=(const trace_file&)=delete;
+        trace_file& operator=(trace_file&&)=delete;
+
+    public:
+        const std::uint8_t *data()const noexcept {
+            return _data;
+        }
+        std::size_t size()const noexcept {
+            return _size;
+        }
+    };
+} /* anonymous */
+
+int main(int argc, char **argv) {
+    cmdline::parser parser;
+    parser.add<std::uint64_t>("from", 'f', "first sequence number to print", false, 0);
+    parser.add<std::uint64_t>("count", 'n', "maximum number of records to print (0: all)", false, 0);
+    parser.add<std::uint64_t>("address", 'a', "print only records of instruction at address", false, 0, address_reader());
+    parser.add("taken", '\0', "print only records which transfer control");
+    parser.add("registers", 'r', "print registers changed by each instruction (registers level)");
+    parser.add("summary", 's', "print record counts per operation instead of records");
+    parser.add<std::string>("program", 'p', "program of trace (print label and source line of addresses)", false, "");
+
+    parser.parse_check(argc, argv);
+    if(parser.rest().empty()) {
+        std::cerr<<"error: no trace file"<<std::endl<<parser.usage();
+        return EXIT_FAILURE;
+    }
+    const auto input=parser.rest()[0];
+
+    std::unique_ptr<trace_file> trace;
+    try {
+        trace=std::make_unique<trace_file>(input);
+    }catch(const std::system_error& e) {
+        std::cerr<<"error: "<<e.what()<<std::endl;
+        return EXIT_FAILURE;
+    }
+
+    n64::symbol_table symbols;
+    const auto program=parser.get<std::string>("program");
+    if(!program.empty()) {
+        try {
+            symbols=n64::symbol_table(n64::load_program(program));
+        }catch(const std::exception& e) {
+            std::cerr<<"error: "<<e.what()<<std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    const auto *data=trace->data();
+    std::uint32_t header[3]={};
+    if(trace->size()<n64::trace::HEADER_SIZE || std::memcmp(data, n64::trace::MAGIC, sizeof(n64::trace::MAGIC))!=0) {
+        std::cerr<<"error: "<<input<<" is not a trace file"<<std::endl;
+        return EXIT_FAILURE;
+    }
+    std::memcpy(header, data+8, sizeof(header));
+    const auto level=static_cast<n64::trace::level>(header[1]);
+    if(header[0]!=n64::trace::VERSION || header[1]>static_cast<std::uint32_t>(n64::trace::level::registers)
+       || header[2]!=n64::trace::record_size(level)) {
+        std::cerr<<"error: unsupported trace file "<<input<<std::endl;
+        return EXIT_FAILURE;
+    }
+    const std::size_t size=header[2];
+    const auto records=(trace->size()-n64::trace::HEADER_SIZE)/size;
+    if((trace->size()-n64::trace::HEADER_SIZE)%size!=0) {
+        std::cerr<<"warning: "<<input<<" ends with a partial record"<<std::endl;
+    }
+
+    const auto from=parser.get<std::uint64_t>("from");
+    const auto count=parser.get<std::uint64_t>("count");
+    const bool by_address=parser.exist("address");
+    const auto address=parser.get<std::uint64_t>("address");
+    const bool taken=parser.exist("taken");
+    const bool registers=parser.exist("registers") && level==n64::trace::level::registers;
+    const bool summary=parser.exist("summary");
+
+    std::vector<std::uint64_t> executed(static_cast<std::size_t>(n64::decoder::opcode::exit)+1, 0);
+    std::vector<std::uint64_t> transfers(executed.size(), 0);
+    std::uint64_t previous[n64::trace::REGISTERS]={};
+    std::uint64_t printed=0;
+    std::string out;
+    char line[160];
+
+    for(std::size_t i=0; i<records; ++i) {
+        const auto *at=data+n64::trace::HEADER_SIZE+i*size;
+        n64::trace::record r;
+        std::memcpy(&r, at, sizeof(r));
+
+        std::uint64_t current[n64::trace::REGISTERS];
+        if(registers) {
+            std::memcpy(current, at+sizeof(r), sizeof(current));
+        }
+        const auto changed_registers=[&]() {
+            for(std::size_t reg=0; reg<n64::trace::REGISTERS; ++reg) {
+                if(current[reg]==previous[reg] || reg==n64::reg::id::IP)continue;
+                const auto name=register_name(reg);
+                if(name.empty())continue;
+                std::snprintf(line, sizeof(line), " %s=0x%" PRIx64, name.c_str(), current[reg]);
+                out+=line;
+            }
+            std::memcpy(previous, current, sizeof(previous));
+        };
+
+        if(r.sequence<from || (by_address && r.address!=address) || (taken && r.next==r.address+1)) {
+            if(registers)std::memcpy(previous, current, sizeof(previous));
+            continue;
+        }
+        if(count>0 && printed>=count)break;
+        ++printed;
+
+        n64::instruction::instruction ins={};
+        ins.data=r.instruction;
+        const auto code=static_cast<std::size_t>(n64::decoder::decode(ins).code);
+        if(summary) {
+            ++executed[code];
+            if(r.next!=r.address+1)++transfers[code];
+            continue;
+        }
+
+        std::snprintf(line, sizeof(line), "%12" PRIu64 "  %016" PRIx64 "  %-10s %016" PRIx64 "  -> %016" PRIx64,
+                      r.sequence, r.address, operation_name(code).c_str(), r.instruction, r.next);
+        out+=line;
+        if(!program.empty()) {
+            out+="  "+symbols.location(r.address);
+        }
+        if(registers)changed_registers();
+        out+='\n';
+        if(out.size()>=1<<16) {
+            std::fwrite(out.data(), 1, out.size(), stdout);
+            out.clear();
+        }
+    }
+    std::fwrite(out.data(), 1, out.size(), stdout);
+
+    if(summary) {
+        std::cout
+                <<"trace: "<<input<<" ("<<n64::trace::name(level)<<", "<<records<<" records, "<<printed<<" selected)"<<std::endl
+                <<"operation      records    control transfers"<<std::endl;
+        for(std::size_t code=0; code<executed.size(); ++code) {
+            if(executed[code]==0)continue;
+            std::snprintf(line, sizeof(line), "%-10s %12" PRIu64 " %12" PRIu64 "\n",
+                          operation_name(code).c_str(), executed[code], transfers[code]);
+            std::cout<<line;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,419 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <iomanip>
+#include <sstream>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "translation_cache.hpp"
+
+namespace n64 {
+    namespace {
+        constexpr char MAGIC[8]={'N', '6', '4', 'C', 'A', 'C', 'H', 'E'};
+        constexpr std::size_t HEADER_SIZE=64;
+        constexpr std::uint32_t LAYOUT=static_cast<std::uint32_t>(sizeof(n64::decoder::operation))
+                                       | (static_cast<std::uint32_t>(n64::decoder::opcode::exit)+1) << 16;
+        constexpr std::uint32_t ZERO_REGISTER=1;
+        constexpr unsigned REGISTERS=128;
+        constexpr const char *SUFFIX=".n64c";
+
+        /**
+         * cache entry header
+         */
+        struct header {
+            char magic[8];
+            std::uint32_t version;
+            std::uint32_t layout;
+            std::uint64_t key;
+            std::uint64_t size;
+            std::uint64_t checksum;
+            std::uint64_t terminators;
+            std::uint64_t hot;
+            std::uint32_t flags;
+            std::uint32_t reserved;
+        };
+        static_assert(sizeof(header)==HEADER_SIZE, "cache header must be 64 bytes");
+        static_assert(sizeof(n64::decoder::operation)%sizeof(std::uint64_t)==0, "operation must be 8 bytes aligned");
+
+        constexpr std::uint64_t BASIS=0xcbf29ce484222325ULL, PRIME=0x100000001b3ULL;
+
+        /**
+         * fold 4 hash lanes into one value
+         * @param lane lanes
+         * @param count hashed word count
+         * @return hash
+         */
+        std::uint64_t fold(const std::uint64_t (&lane)[4], std::uint64_t count) {
+            auto hash=BASIS ^ count;
+            for(auto l : lane) {
+                hash=(hash ^ l)*PRIME;
+                hash^=hash >> 29;
+            }
+            return hash;
+        }
+
+        /**
+         * FNV-1a over 64bit words in 4 independent lanes (one multiply chain per lane)
+         * @param data data
+         * @param size data size (multiple of 8)
+         * @return hash
+         */
+        std::uint64_t checksum(const std::uint8_t *data, std::size_t size) {
+            std::uint64_t lane[4]={BASIS, BASIS+1, BASIS+2, BASIS+3};
+            const auto count=size/sizeof(std::uint64_t);
+            for(std::size_t i=0; i<count; ++i) {
+                std::uint64_t word;
+                std::memcpy(&word, data+i*sizeof(word), sizeof(word));
+                lane[i%4]=(lane[i%4] ^ word)*PRIME;
+            }
+            return fold(lane, count);
+        }
+
+        /**
+         * create directory and its parents
+         * @param directory directory
+         * @return directory exists
+         */
+        bool make_directories(const std::string& directory) {
+            for(std::size_t at=1; at<=directory.size(); ++at) {
+                if(at<directory.size() && directory[at]!='/')continue;
+                const auto prefix=directory.substr(0, at);
+                if(mkdir(prefix.c_str(), 0755)!=0 && errno!=EEXIST)return false;
+            }
+            struct stat st={};
+            return stat(directory.c_str(), &st)==0 && S_ISDIR(st.st_mode);
+        }
+
+        /**
+         * write whole buffer
+         * @param fd file descriptor
+         * @param data data
+         * @param size size in bytes
+         * @return written
+         */
+        bool write_all(int fd, const std::uint8_t *data, std::size_t size) {
+            while(size>0) {
+                const auto written=write(fd, data, size);
+                if(written<0) {
+                    if(errno==EINTR)continue;
+                    return false;
+                }
+                data+=written;
+                size-=static_cast<std::size_t>(written);
+            }
+            return true;
+        }
+    } /* anonymous */
+
+    /**
+     * decode program
+     * @param instructions instructions
+     */
+    translation::translation(const std::vector<n64::instruction::instruction>& instructions)
+            : _decoded(n64::decoder::predecode(instructions)), _mapping(nullptr), _mapping_size(0), _bound_size(0),
+              _zero(n64::decoder::is_zero_register_constant(instructions)) {
+        // block boundaries come from unfused operations, fused cmp_j* would end blocks one instruction early
+        for(std::uint64_t ip=0; ip<instructions.size(); ++ip) {
+            if(n64::decoder::is_terminator(_decoded[ip].code)) {
+                _decoded_terminators.emplace_back(ip);
+            }
+        }
+        n64::decoder::fuse(_decoded, _zero);
+
+        _operations=_decoded.data();
+        _size=instructions.size();
+        _terminators=_decoded_terminators.data();
+        _terminator_count=_decoded_terminators.size();
+    }
+
+    /**
+     * adopt mapped cache entry (validated by translation_cache)
+     */
+    translation::translation(void *mapping, std::size_t mapping_size, n64::decoder::operation *operations, std::size_t size,
+                             const std::uint64_t *terminators, std::size_t terminator_count, std::vector<std::uint64_t> hot,
+                             bool zero)
+            : _mapping(mapping), _mapping_size(mapping_size), _bound_size(0), _operations(operations), _size(size),
+              _terminators(terminators), _terminator_count(terminator_count), _hot(std::move(hot)), _zero(zero) {}
+
+    translation::~translation() {
+        if(_mapping!=nullptr)munmap(_mapping, _mapping_size);
+        if(_bound_size>0)munmap(_operations, _bound_size);
+    }
+
+    /**
+     * bind engine handlers to all operations
+     * @param handlers handler table indexed by n64::decoder::opcode
+     * @return operations (nullptr: mapping cannot be made writable)
+     */
+    n64::decoder::operation *translation::bind(const void *const *handlers) {
+        if(_mapping!=nullptr && _bound_size==0) {
+            // copy out of file mapping into huge page backed memory: one fault per 2MiB instead of one copy-on-write per page
+            const auto size=(_size+1)*sizeof(n64::decoder::operation);
+            auto *bound=mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if(bound==MAP_FAILED)return nullptr;
+#ifdef MADV_HUGEPAGE
+            madvise(bound, size, MADV_HUGEPAGE);
+#endif
+            std::memcpy(bound, _operations, size);
+            _operations=static_cast<n64::decoder::operation*>(bound);
+            _bound_size=size;
+        }
+        for(std::size_t i=0; i<=_size; ++i) {
+            _operations[i].handler=handlers[static_cast<std::size_t>(_operations[i].code)];
+        }
+        return _operations;
+    }
+
+    /**
+     * end of basic block
+     * @param entry entry address
+     * @return one past the last instruction address
+     */
+    std::uint64_t translation::block_end(std::uint64_t entry)const noexcept {
+        const auto *last=_terminators+_terminator_count;
+        const auto *t=std::lower_bound(_terminators, last, entry);
+        return t!=last ? *t+1 : _size;
+    }
+
+    /**
+     * @param directory cache directory (created if missing)
+     * @param capacity maximum total size of entries in bytes
+     */
+    translation_cache::translation_cache(std::string directory, std::size_t capacity)
+            : _directory(std::move(directory)), _capacity(capacity), _usable(false),
+              _hits(0), _misses(0), _corrupted(0), _evicted(0) {
+        _usable=!_directory.empty() && make_directories(_directory) && access(_directory.c_str(), W_OK)==0;
+    }
+
+    /**
+     * default cache directory ($N64_CACHE_DIR, $XDG_CACHE_HOME/n64 or $HOME/.cache/n64)
+     * @return directory (empty: no candidate)
+     */
+    std::string translation_cache::default_directory() {
+        if(const auto *dir=std::getenv("N64_CACHE_DIR"))return dir;
+        if(const auto *xdg=std::getenv("XDG_CACHE_HOME"); xdg!=nullptr && xdg[0]=='/')return std::string(xdg)+"/n64";
+        if(const auto *home=std::getenv("HOME"); home!=nullptr && home[0]!='\0')return std::string(home)+"/.cache/n64";
+        return "";
+    }
+
+    /**
+     * cache key of program (hash of instruction words, independent of container layout)
+     * @param instructions instructions
+     * @return key
+     */
+    std::uint64_t translation_cache::key(const std::vector<n64::instruction::instruction>& instructions) {
+        std::uint64_t lane[4]={BASIS, BASIS+1, BASIS+2, BASIS+3};
+        for(std::size_t i=0; i<instructions.size(); ++i) {
+            lane[i%4]=(lane[i%4] ^ instructions[i].data)*PRIME;
+        }
+        return fold(lane, instructions.size());
+    }
+
+    /**
+     * map cache entry.
+     * entry is checked (header, size, checksum, instruction words and operand ranges) before use, invalid entry is removed.
+     * @param key cache key
+     * @param instructions program
+     * @return translation (nullptr: not cached, or entry was corrupted or stale and removed)
+     */
+    std::unique_ptr<n64::translation> translation_cache::load(std::uint64_t key, const std::vector<n64::instruction::instruction>& instructions) {
+        const auto size=instructions.size();
+        if(!_usable) {
+            ++_misses;
+            return nullptr;
+        }
+        const auto path=_path(key);
+        const int fd=open(path.c_str(), O_RDONLY);
+        if(fd<0) {
+            ++_misses;
+            return nullptr;
+        }
+
+        struct stat st={};
+        void *mapping=MAP_FAILED;
+        std::size_t mapping_size=0;
+        if(fstat(fd, &st)==0 && static_cast<std::size_t>(st.st_size)>=HEADER_SIZE) {
+            mapping_size=static_cast<std::size_t>(st.st_size);
+            // read-only until handlers are bound, so populating does not copy pages
+            mapping=mmap(nullptr, mapping_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        }
+        const auto reject=[&]() -> std::unique_ptr<n64::translation> {
+            if(mapping!=MAP_FAILED)munmap(mapping, mapping_size);
+            close(fd);
+            unlink(path.c_str());
+            ++_corrupted;
+            ++_misses;
+            return nullptr;
+        };
+        if(mapping==MAP_FAILED)return reject();
+
+        auto *data=static_cast<std::uint8_t*>(mapping);
+        header h;
+        std::memcpy(&h, data, sizeof(h));
+        if(std::memcmp(h.magic, MAGIC, sizeof(MAGIC))!=0 || h.version!=VERSION || h.layout!=LAYOUT)return reject();
+        if(h.key!=key || h.size!=size)return reject();
+
+        // counts are bounded by file size first, so size computation cannot overflow
+        const auto body=mapping_size-HEADER_SIZE;
+        constexpr auto OPERATION=sizeof(n64::decoder::operation);
+        if(h.size>=body/OPERATION || h.terminators>body/8 || h.hot>body/8)return reject();
+        if((h.size+1)*OPERATION+(h.size+h.terminators+h.hot)*8!=body)return reject();
+        if(checksum(data+HEADER_SIZE, body)!=h.checksum)return reject();
+
+        // key is a 64bit hash, so equal key does not prove same program
+        auto *operations=reinterpret_cast<n64::decoder::operation*>(data+HEADER_SIZE);
+        const auto *code=reinterpret_cast<const std::uint64_t*>(operations+h.size+1);
+        for(std::size_t i=0; i<h.size; ++i) {
+            if(code[i]!=instructions[i].data)return reject();
+        }
+
+        for(std::size_t i=0; i<=h.size; ++i) {
+            const auto& op=operations[i];
+            if(op.code>n64::decoder::opcode::exit || (op.code==n64::decoder::opcode::exit)!=(i==h.size))return reject();
+            if(op.destination>=REGISTERS || op.source1>=REGISTERS || op.source2>=REGISTERS)return reject();
+        }
+        const auto *terminators=code+h.size;
+        const auto *hot=terminators+h.terminators;
+        const auto ascending=[&h](const std::uint64_t *first, std::size_t count) {
+            for(std::size_t i=0; i<count; ++i) {
+                if(first[i]>=h.size || (i>0 && first[i-1]>=first[i]))return false;
+            }
+            return true;
+        };
+        if(!ascending(terminators, h.terminators) || !ascending(hot, h.hot))return reject();
+
+        // least recently used eviction is based on modification time
+        futimens(fd, nullptr);
+        close(fd);
+        ++_hits;
+        return std::make_unique<n64::translation>(mapping, mapping_size, operations, h.size, terminators, h.terminators,
+                                                  std::vector<std::uint64_t>(hot, hot+h.hot), (h.flags & ZERO_REGISTER)!=0);
+    }
+
+    /**
+     * write cache entry (atomically replaced) and evict old entries
+     * @param key cache key
+     * @param t translation
+     * @param instructions program translated by t
+     * @return written
+     */
+    bool translation_cache::store(std::uint64_t key, const n64::translation& t, const std::vector<n64::instruction::instruction>& instructions) {
+        if(!_usable || instructions.size()!=t.size())return false;
+
+        constexpr auto OPERATION=sizeof(n64::decoder::operation);
+        const auto body=(t.size()+1)*OPERATION+(t.size()+t.terminator_count()+t.hot().size())*8;
+        if(HEADER_SIZE+body>_capacity)return false;
+
+        std::vector<std::uint8_t> out(HEADER_SIZE+body);
+        auto *operations=out.data()+HEADER_SIZE;
+        std::memcpy(operations, t.operations(), (t.size()+1)*OPERATION);
+        for(std::size_t i=0; i<=t.size(); ++i) {
+            // handlers are engine and process specific
+            std::memset(operations+i*OPERATION+offsetof(n64::decoder::operation, handler), 0, sizeof(void*));
+        }
+        auto *code=operations+(t.size()+1)*OPERATION;
+        for(std::size_t i=0; i<t.size(); ++i) {
+            std::memcpy(code+i*8, &instructions[i].data, 8);
+        }
+        auto *terminators=code+t.size()*8;
+        std::memcpy(terminators, t.terminators(), t.terminator_count()*8);
+        std::memcpy(terminators+t.terminator_count()*8, t.hot().data(), t.hot().size()*8);
+
+        header h={};
+        std::memcpy(h.magic, MAGIC, sizeof(MAGIC));
+        h.version=VERSION;
+        h.layout=LAYOUT;
+        h.key=key;
+        h.size=t.size();
+        h.checksum=checksum(out.data()+HEADER_SIZE, body);
+        h.terminators=t.terminator_count();
+        h.hot=t.hot().size();
+        h.flags=t.zero() ? ZERO_REGISTER : 0;
+        std::memcpy(out.data(), &h, sizeof(h));
+
+        // readers never see partial entry: write temporary file and rename it over the entry
+        const auto path=_path(key);
+        const auto temporary=path+".tmp"+std::to_string(getpid());
+        const int fd=open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd<0)return false;
+        const bool written=write_all(fd, out.data(), out.size());
+        if(close(fd)!=0 || !written || rename(temporary.c_str(), path.c_str())!=0) {
+            unlink(temporary.c_str());
+            return false;
+        }
+        _evict();
+        return true;
+    }
+
+    /**
+     * entry file name
+     * @param key cache key
+     * @return path
+     */
+    std::string translation_cache::_path(std::uint64_t key)const {
+        std::stringstream ss;
+        ss<<_directory<<"/"<<std::hex<<std::setw(16)<<std::setfill('0')<<key<<SUFFIX;
+        return ss.str();
+    }
+
+    /**
+     * remove least recently used entries until total size is under capacity
+     */
+    void translation_cache::_evict() {
+        struct entry {
+            std::string path;
+            std::size_t size;
+            struct timespec used;
+        };
+        std::vector<entry> entries;
+        std::size_t total=0;
+
+        auto *dir=opendir(_directory.c_str());
+        if(dir==nullptr)return;
+        while(const auto *e=readdir(dir)) {
+            const std::string name=e->d_name;
+            const auto suffix=std::strlen(SUFFIX);
+            if(name.size()<=suffix || name.compare(name.size()-suffix, suffix, SUFFIX)!=0)continue;
+
+            struct stat st={};
+            auto path=_directory+"/"+name;
+            if(stat(path.c_str(), &st)!=0 || !S_ISREG(st.st_mode))continue;
+            total+=static_cast<std::size_t>(st.st_size);
+            entries.push_back({std::move(path), static_cast<std::size_t>(st.st_size), st.st_mtim});
+        }
+        closedir(dir);
+        if(total<=_capacity)return;
+
+        std::sort(std::begin(entries), std::end(entries), [](const entry& a, const entry& b) {
+            return a.used.tv_sec!=b.used.tv_sec ? a.used.tv_sec<b.used.tv_sec : a.used.tv_nsec<b.used.tv_nsec;
+        });
+        for(const auto& e : entries) {
+            if(total<=_capacity)break;
+            if(unlink(e.path.c_str())==0) {
+                total-=e.size;
+                ++_evicted;
+            }
+        }
+    }
+} /* n64 */
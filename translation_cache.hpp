@@ -0,0 +1,261 @@
+// Copyright 2018 SiLeader.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//         http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef N64_EMU_TRANSLATION_CACHE_HPP
+#define N64_EMU_TRANSLATION_CACHE_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <string>
+#include <memory>
+
+#include "instruction.hpp"
+#include "decoder.hpp"
+
+/*
+ * translation cache entry (<directory>/<key>.n64c, native byte order, host specific)
+ *
+ * header (64 bytes)
+ *   0  magic "N64CACHE"
+ *   8  u32 version (translation_cache::VERSION)
+ *  12  u32 layout (sizeof(operation) | opcode count << 16)
+ *  16  u64 key (hash of instructions)
+ *  24  u64 instruction count
+ *  32  u64 checksum of every byte after header
+ *  40  u64 terminator count
+ *  48  u64 hot block count
+ *  56  u32 flags (bit 0: r0 is constant), u32 reserved
+ * body
+ *   operation[instruction count+1]    predecoded and fused operations (handler is nullptr)
+ *   u64[instruction count]             instruction words (compared with program, key is not collision free)
+ *   u64[terminator count]              addresses of block terminators (ascending)
+ *   u64[hot block count]               blocks promoted by tiered engine (ascending)
+ */
+
+namespace n64 {
+    /**
+     * whole-program translation: predecoded operation stream and basic block boundaries.
+     * either decoded from instructions, or mapped from translation cache (read-only mapping,
+     * operations are copied out when engine binds handlers).
+     * remove: default constructor, copy & move constructors and copy & move assign operators.
+     */
+    class translation {
+    private:
+        std::vector<n64::decoder::operation> _decoded;
+        std::vector<std::uint64_t> _decoded_terminators;
+        void *_mapping;
+        std::size_t _mapping_size;
+        std::size_t _bound_size;    // size of writable copy of mapped operations (0: not copied)
+
+        n64::decoder::operation *_operations;
+        std::size_t _size;
+        const std::uint64_t *_terminators;
+        std::size_t _terminator_count;
+        std::vector<std::uint64_t> _hot;
+        bool _zero;
+
+    public:
+        translation()=delete;
+        /**
+         * decode program
+         * @param instructions instructions
+         */
+        explicit translation(const std::vector<n64::instruction::instruction>& instructions);
+        /**
+         * adopt mapped cache entry (validated by translation_cache)
+         */
+        translation(void *mapping, std::size_t mapping_size, n64::decoder::operation *operations, std::size_t size,
+                    const std::uint64_t *terminators, std::size_t terminator_count, std::vector<std::uint64_t> hot, bool zero);
+        ~translation();
+        translation(const translation&)=delete;
+        translation(translation&&)=delete;
+
+        translation& operator=(const translation&)=delete;
+        translation& operator=(translation&&)=delete;
+
+    public:
+        /**
+         * operations (one per instruction and a trailing exit operation)
+         * @return operations
+         */
+        const n64::decoder::operation *operations()const noexcept {
+            return _operations;
+        }
+
+        /**
+         * bind engine handlers to all operations
+         * @param handlers handler table indexed by n64::decoder::opcode
+         * @return operations (nullptr: mapping cannot be made writable)
+         */
+        n64::decoder::operation *bind(const void *const *handlers);
+
+        /**
+         * instruction count
+         * @return count (without exit operation)
+         */
+        std::size_t size()const noexcept {
+            return _size;
+        }
+
+        /**
+         * addresses of instructions which end basic block (before fusion, ascending)
+         * @return terminators
+         */
+        const std::uint64_t *terminators()const noexcept {
+            return _terminators;
+        }
+        std::size_t terminator_count()const noexcept {
+            return _terminator_count;
+        }
+
+        /**
+         * end of basic block
+         * @param entry entry address
+         * @return one past the last instruction address
+         */
+        std::uint64_t block_end(std::uint64_t entry)const noexcept;
+
+        /**
+         * blocks promoted by tiered engine in earlier runs
+         * @return entry addresses (ascending)
+         */
+        const std::vector<std::uint64_t>& hot()const noexcept {
+            return _hot;
+        }
+        void hot(std::vector<std::uint64_t> entries) {
+            _hot=std::move(entries);
+        }
+
+        /**
+         * r0 is never written (decoder::is_zero_register_constant)
+         * @return r0 is constant
+         */
+        bool zero()const noexcept {
+            return _zero;
+        }
+
+        /**
+         * loaded from translation cache
+         * @return mapped from cache entry
+         */
+        bool cached()const noexcept {
+            return _mapping!=nullptr;
+        }
+    };
+
+    /**
+     * persistent translation cache.
+     * entries are keyed by hash of instructions and evicted least recently used first
+     * when the directory grows over capacity. corrupted or stale entries are removed on load,
+     * and entry is used only if its instruction words equal the program.
+     * remove: default constructor, copy & move constructors and copy & move assign operators.
+     */
+    class translation_cache {
+    public:
+        static constexpr std::uint32_t VERSION=2;
+        static constexpr std::size_t DEFAULT_CAPACITY=std::size_t(256)<<20;
+
+    private:
+        std::string _directory;
+        std::size_t _capacity;
+        bool _usable;
+        std::uint64_t _hits, _misses, _corrupted, _evicted;
+
+    public:
+        translation_cache()=delete;
+        /**
+         * @param directory cache directory (created if missing)
+         * @param capacity maximum total size of entries in bytes
+         */
+        translation_cache(std::string directory, std::size_t capacity);
+        translation_cache(const translation_cache&)=delete;
+        translation_cache(translation_cache&&)=delete;
+
+        translation_cache& operator=(const translation_cache&)=delete;
+        translation_cache& operator=(translation_cache&&)=delete;
+
+    public:
+        /**
+         * default cache directory ($N64_CACHE_DIR, $XDG_CACHE_HOME/n64 or $HOME/.cache/n64)
+         * @return directory (empty: no candidate)
+         */
+        static std::string default_directory();
+
+        /**
+         * cache key of program
+         * @param instructions instructions
+         * @return key
+         */
+        static std::uint64_t key(const std::vector<n64::instruction::instruction>& instructions);
+
+        /**
+         * map cache entry
+         * @param key cache key
+         * @param instructions program
+         * @return translation (nullptr: not cached, or entry was corrupted or stale and removed)
+         */
+        std::unique_ptr<n64::translation> load(std::uint64_t key, const std::vector<n64::instruction::instruction>& instructions);
+
+        /**
+         * write cache entry (atomically replaced) and evict old entries
+         * @param key cache key
+         * @param t translation
+         * @param instructions program translated by t
+         * @return written
+         */
+        bool store(std::uint64_t key, const n64::translation& t, const std::vector<n64::instruction::instruction>& instructions);
+
+        /**
+         * cache directory is usable
+         * @return usable
+         */
+        bool usable()const noexcept {
+            return _usable;
+        }
+
+        /**
+         * statistics
+         * @return counts
+         */
+        std::uint64_t hits()const noexcept {
+            return _hits;
+        }
+        std::uint64_t misses()const noexcept {
+            return _misses;
+        }
+        std::uint64_t corrupted()const noexcept {
+            return _corrupted;
+        }
+        std::uint64_t evicted()const noexcept {
+            return _evicted;
+        }
+
+    private:
+        /**
+         * entry file name
+         * @param key cache key
+         * @return path
+         */
+        std::string _path(std::uint64_t key)const;
+
+        /**
+         * remove least recently used entries until total size is under capacity
+         */
+        void _evict();
+    };
+} /* n64 */
+
+#endif //N64_EMU_TRANSLATION_CACHE_HPP